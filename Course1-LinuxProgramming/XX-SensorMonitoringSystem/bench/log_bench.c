@@ -0,0 +1,237 @@
+/** @file log_bench.c
+ *  @brief Logging cost benchmark
+ *
+ *  Measures the time a gateway thread spends per log message, with a
+ *  forked log process writing the messages to a scratch log file:
+ *    1. snprintf into a buffer, then log_event(), as before log_eventf()
+ *    2. log_info(), formatted later by the log process
+ *    3. log_event() with a constant message
+ *    4. log_debug() below the runtime threshold, discarded
+ *  Messages are sent in bursts that fit a thread's ring, and the rings
+ *  are drained between bursts, so the time is the cost of the call and
+ *  not of waiting for the log process. The best and the median burst
+ *  are reported: on a machine with few cores, bursts during which the
+ *  log process got the CPU also count its time.
+ *
+ *  Then the lines per second the log process sustains: every ring is
+ *  filled while the log process is stopped, and the time it takes to
+ *  drain them is measured. The last line of the log file is then checked
+ *  to carry the number of every message logged; the log file is rotated
+ *  on the way, and the oldest rotated files are deleted.
+ *
+ *  Usage: ./log_bench [messages] [log_path]
+ *
+ *  @author Phuc
+ *  @bug No known bugs.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <sys/wait.h>
+#include "clock_service.h"
+#include "log.h"
+
+#define BURST (LOG_RING_SLOTS / 2)
+#define DRAIN_THREADS (LOG_MAX_THREADS - 1) // The main thread has a ring as well
+
+enum
+{
+    MODE_SNPRINTF,
+    MODE_DEFERRED,
+    MODE_CONSTANT,
+    MODE_FILTERED
+};
+
+static int compare_ull(const void *a, const void *b)
+{
+    unsigned long long x = *(const unsigned long long *)a;
+    unsigned long long y = *(const unsigned long long *)b;
+    return x < y ? -1 : x > y;
+}
+
+static void run(const char *name, int messages, int mode)
+{
+    int bursts = (messages + BURST - 1) / BURST;
+    unsigned long long *burst_ns = malloc(sizeof(unsigned long long) * bursts);
+    int b = 0;
+
+    for (int sent = 0; sent < messages; sent += BURST)
+    {
+        int n = messages - sent < BURST ? messages - sent : BURST;
+        unsigned long long start = clock_mono_ns();
+        for (int i = 0; i < n; i++)
+        {
+            int id = 1 + (sent + i) % 10;
+            float temp = 20.0f + (i % 50) / 10.0f;
+            long ts = 1744568370L + sent + i;
+
+            if (mode == MODE_SNPRINTF)
+            {
+                char msg[256];
+                snprintf(msg, sizeof(msg), "Received data: sensor_id=%d, temp=%.2f, time=%ld", id, temp, ts);
+                log_event(msg);
+            }
+            else if (mode == MODE_DEFERRED)
+            {
+                log_info("Received data: sensor_id=%d, temp=%.2f, time=%ld", id, temp, ts);
+            }
+            else if (mode == MODE_CONSTANT)
+            {
+                log_event("Data pushed to buffer");
+            }
+            else
+            {
+                log_debug("Received data: sensor_id=%d, temp=%.2f, time=%ld", id, temp, ts);
+            }
+        }
+        burst_ns[b++] = (clock_mono_ns() - start) / n;
+        log_flush();
+    }
+
+    qsort(burst_ns, bursts, sizeof(unsigned long long), compare_ull);
+    printf("%-30s %10d messages %6llu ns/message best %6llu ns/message median\n",
+           name, messages, burst_ns[0], burst_ns[bursts / 2]);
+    free(burst_ns);
+}
+
+static void *fill_ring(void *arg)
+{
+    long base = *(long *)arg;
+    for (int i = 0; i < LOG_RING_SLOTS; i++)
+    {
+        log_info("Received data: sensor_id=%d, temp=%.2f, time=%ld", 1 + i % 10, 20.0f + (i % 50) / 10.0f, base + i);
+    }
+    return NULL;
+}
+
+// Time the log process draining full rings. Returns the number of messages logged.
+static long run_drain(pid_t log_pid, int messages)
+{
+    pthread_t threads[DRAIN_THREADS];
+    long bases[DRAIN_THREADS];
+    unsigned long long busy_ns = 0;
+    long lines = 0;
+    int status;
+
+    while (lines < messages)
+    {
+        // Rings of the threads of the previous round are reused, they were drained
+        kill(log_pid, SIGSTOP);
+        waitpid(log_pid, &status, WUNTRACED);
+        for (int t = 0; t < DRAIN_THREADS; t++)
+        {
+            bases[t] = 1744568370L + lines + (long)t * LOG_RING_SLOTS;
+            pthread_create(&threads[t], NULL, fill_ring, &bases[t]);
+        }
+        for (int t = 0; t < DRAIN_THREADS; t++)
+            pthread_join(threads[t], NULL);
+
+        unsigned long long start = clock_mono_ns();
+        kill(log_pid, SIGCONT);
+        log_flush();
+        busy_ns += clock_mono_ns() - start;
+        lines += (long)DRAIN_THREADS * LOG_RING_SLOTS;
+    }
+
+    printf("%-30s %10ld messages %10.0f lines/s\n", "log process drain", lines, lines / (busy_ns / 1e9));
+    return lines;
+}
+
+// Sequence number of the last line of the log file, -1 if there is none.
+// Rotated files may have been deleted, but the numbering goes on.
+static long last_seq(const char *path)
+{
+    char tail[1024];
+    FILE *fp = fopen(path, "r");
+    long seq = -1;
+
+    if (fp == NULL)
+        return -1;
+    fseek(fp, 0, SEEK_END);
+    long size = ftell(fp);
+    long start = size > (long)sizeof(tail) - 1 ? size - (long)sizeof(tail) + 1 : 0;
+    fseek(fp, start, SEEK_SET);
+    size_t n = fread(tail, 1, sizeof(tail) - 1, fp);
+    fclose(fp);
+
+    tail[n] = '\0';
+    if (n > 0 && tail[n - 1] == '\n')
+        tail[--n] = '\0';
+    char *line = strrchr(tail, '\n');
+    if (n > 0)
+        seq = atol(line != NULL ? line + 1 : tail);
+    return seq;
+}
+
+// Remove the log file and the rotated files of an earlier run
+static void remove_logs(const char *path)
+{
+    char dir_path[256];
+    char file[512];
+    const char *base = strrchr(path, '/');
+    struct dirent *entry;
+
+    snprintf(dir_path, sizeof(dir_path), "%.*s", base != NULL ? (int)(base - path) : 1, base != NULL ? path : ".");
+    base = base != NULL ? base + 1 : path;
+    DIR *dir = opendir(dir_path);
+    if (dir == NULL)
+        return;
+    while ((entry = readdir(dir)) != NULL)
+    {
+        if (strncmp(entry->d_name, base, strlen(base)) == 0)
+        {
+            snprintf(file, sizeof(file), "%s/%s", dir_path, entry->d_name);
+            unlink(file);
+        }
+    }
+    closedir(dir);
+}
+
+int main(int argc, char *argv[])
+{
+    int messages = argc > 1 ? atoi(argv[1]) : 1000000;
+    const char *path = argc > 2 ? argv[2] : "/tmp/log_bench/gateway.log";
+
+    if (messages <= 0)
+    {
+        fprintf(stderr, "Usage: %s [messages > 0] [log_path]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    remove_logs(path);
+    if (log_init() != 0)
+        return EXIT_FAILURE;
+
+    pid_t log_pid = fork();
+    if (log_pid == -1)
+    {
+        perror("Failed to fork log process");
+        return EXIT_FAILURE;
+    }
+    if (log_pid == 0)
+        log_process_run(path);
+
+    run("snprintf + log_event", messages, MODE_SNPRINTF);
+    run("log_info (deferred)", messages, MODE_DEFERRED);
+    run("log_event (constant)", messages, MODE_CONSTANT);
+    log_level = LOG_LEVEL_INFO;
+    run("log_debug (below threshold)", messages, MODE_FILTERED);
+    long drained = run_drain(log_pid, messages);
+
+    kill(log_pid, SIGTERM);
+    waitpid(log_pid, NULL, 0);
+
+    long lines = last_seq(path);
+    // Discarded messages never reach the log file
+    if (lines != 3L * messages + drained)
+    {
+        fprintf(stderr, "Log file ends at line %ld, expected %ld\n", lines, 3L * messages + drained);
+        return EXIT_FAILURE;
+    }
+    return 0;
+}
@@ -0,0 +1,293 @@
+/** @file series_bench.c
+ *  @brief Storage backend ingest and range-scan benchmark
+ *
+ *  Writes the same synthetic readings (one per second per sensor, a
+ *  random walk in 0.1 degree steps) to both storage backends and
+ *  reports:
+ *    1. ingest rows/s: SQLite with the gateway's WAL settings and
+ *       batched transactions, against the columnar store
+ *    2. bytes on disk per reading
+ *    3. range-scan rows/s: random one-hour windows per sensor, read back
+ *       through the (id, time) primary key and through the block index
+ *  The scans are checked against the generated data.
+ *
+ *  Usage: ./series_bench [readings_per_sensor] [sensors] [scratch_dir]
+ *
+ *  @author Phuc
+ *  @bug No known bugs.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sqlite3.h>
+#include "../include/common.h"
+#include "clock_service.h"
+#include "log.h"
+#include "storage_manager.h"
+#include "storage_columnar.h"
+
+#define BASE_TS 1744568370
+#define SCAN_WINDOW 3600
+#define SCANS 2000
+
+// The columnar store logs through the gateway's log process; print instead
+int log_level = LOG_LEVEL_INFO;
+
+void log_eventf(int level, const char *fmt, ...)
+{
+    va_list ap;
+    (void)level;
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+    fputc('\n', stderr);
+}
+
+static const char *CREATE_TABLE =
+    "CREATE TABLE measurements ("
+    "id INTEGER NOT NULL, "
+    "time INTEGER NOT NULL, "
+    "seq INTEGER NOT NULL, "
+    "temp REAL NOT NULL, "
+    "flags INTEGER NOT NULL DEFAULT 0, "
+    "PRIMARY KEY (id, time, seq)"
+    ") WITHOUT ROWID, STRICT;";
+static const char *INSERT_STMT =
+    "INSERT INTO measurements (id, time, seq, temp, flags) VALUES (?1, ?2, "
+    "COALESCE((SELECT MAX(seq) + 1 FROM measurements WHERE id = ?1 AND time = ?2), 0), ?3, ?4);";
+static const char *SCAN_STMT =
+    "SELECT time, temp, flags FROM measurements WHERE id = ? AND time BETWEEN ? AND ?;";
+
+static float *temps; // temps[sensor * per_sensor + i]
+
+static void generate(int per_sensor, int sensors)
+{
+    temps = malloc(sizeof(float) * per_sensor * sensors);
+    srand(42);
+    for (int s = 0; s < sensors; s++)
+    {
+        int t = 200 + rand() % 50; // Tenths of a degree
+        for (int i = 0; i < per_sensor; i++)
+        {
+            t += rand() % 3 - 1;
+            temps[s * per_sensor + i] = t / 10.0f;
+        }
+    }
+}
+
+static long long dir_bytes(const char *dir)
+{
+    char path[512];
+    struct stat st;
+    long long total = 0;
+    DIR *d = opendir(dir);
+    struct dirent *e;
+
+    while (d && (e = readdir(d)) != NULL)
+    {
+        snprintf(path, sizeof(path), "%s/%s", dir, e->d_name);
+        if (stat(path, &st) == 0 && S_ISREG(st.st_mode))
+            total += st.st_size;
+    }
+    if (d)
+        closedir(d);
+    return total;
+}
+
+static void clear_dir(const char *dir)
+{
+    char path[512];
+    DIR *d = opendir(dir);
+    struct dirent *e;
+
+    while (d && (e = readdir(d)) != NULL)
+    {
+        snprintf(path, sizeof(path), "%s/%s", dir, e->d_name);
+        unlink(path);
+    }
+    if (d)
+        closedir(d);
+    mkdir(dir, 0777);
+}
+
+static void report(const char *name, long long rows, unsigned long long ns)
+{
+    double secs = ns / 1e9;
+    printf("%-30s %10lld rows %9.3f s %12.0f rows/s\n", name, rows, secs, rows / secs);
+}
+
+// Readings are interleaved across sensors, as the gateway receives them
+static void ingest_sqlite(sqlite3 *db, int per_sensor, int sensors)
+{
+    sqlite3_stmt *stmt = NULL;
+    int pending = 0;
+
+    sqlite3_prepare_v2(db, INSERT_STMT, -1, &stmt, NULL);
+    sqlite3_exec(db, "BEGIN;", NULL, NULL, NULL);
+    for (int i = 0; i < per_sensor; i++)
+    {
+        for (int s = 0; s < sensors; s++)
+        {
+            sqlite3_bind_int(stmt, 1, s + 1);
+            sqlite3_bind_int64(stmt, 2, BASE_TS + i);
+            sqlite3_bind_double(stmt, 3, temps[s * per_sensor + i]);
+            sqlite3_bind_int(stmt, 4, 0);
+            sqlite3_step(stmt);
+            sqlite3_reset(stmt);
+            if (++pending == STORE_TXN_MAX_ROWS)
+            {
+                sqlite3_exec(db, "COMMIT; BEGIN;", NULL, NULL, NULL);
+                pending = 0;
+            }
+        }
+    }
+    sqlite3_exec(db, "COMMIT;", NULL, NULL, NULL);
+    sqlite3_finalize(stmt);
+}
+
+static void ingest_columnar(const char *dir, int per_sensor, int sensors)
+{
+    int pending = 0;
+
+    columnar_open(dir);
+    for (int i = 0; i < per_sensor; i++)
+    {
+        for (int s = 0; s < sensors; s++)
+        {
+            columnar_append(s + 1, BASE_TS + i, temps[s * per_sensor + i], 0);
+            if (++pending == STORE_TXN_MAX_ROWS)
+            {
+                columnar_commit();
+                pending = 0;
+            }
+        }
+    }
+    columnar_close();
+}
+
+typedef struct
+{
+    int sensor;
+    int per_sensor;
+    long long rows;
+    int errors;
+} check_t;
+
+static void check_point(check_t *c, time_t ts, double temp)
+{
+    long i = (long)(ts - BASE_TS);
+    if (i < 0 || i >= c->per_sensor || (float)temp != temps[c->sensor * c->per_sensor + i])
+        c->errors++;
+    c->rows++;
+}
+
+static int columnar_check(const columnar_point_t *p, void *ctx)
+{
+    check_point(ctx, p->timestamp, p->temperature);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    int per_sensor = argc > 1 ? atoi(argv[1]) : 86400;
+    int sensors = argc > 2 ? atoi(argv[2]) : 10;
+    const char *dir = argc > 3 ? argv[3] : "/tmp/series_bench";
+    char db_path[512];
+    char pragmas[256];
+    unsigned long long start;
+
+    if (per_sensor <= SCAN_WINDOW || sensors <= 0 || sensors >= MAX_SENSORS)
+    {
+        fprintf(stderr, "Usage: %s [readings_per_sensor > %d] [sensors < %d] [scratch_dir]\n",
+                argv[0], SCAN_WINDOW, MAX_SENSORS);
+        return EXIT_FAILURE;
+    }
+
+    long long rows = (long long)per_sensor * sensors;
+    generate(per_sensor, sensors);
+
+    char sqlite_dir[300], columnar_dir[300];
+    mkdir(dir, 0777);
+    snprintf(sqlite_dir, sizeof(sqlite_dir), "%s/sqlite", dir);
+    snprintf(columnar_dir, sizeof(columnar_dir), "%s/columnar", dir);
+    clear_dir(sqlite_dir);
+    clear_dir(columnar_dir);
+    snprintf(db_path, sizeof(db_path), "%s/sensors.db", sqlite_dir);
+
+    // Ingest
+    sqlite3 *db = NULL;
+    sqlite3_open(db_path, &db);
+    snprintf(pragmas, sizeof(pragmas),
+             "PRAGMA journal_mode=%s; PRAGMA synchronous=%s; PRAGMA cache_size=-%d; PRAGMA mmap_size=%lld;",
+             STORE_JOURNAL_MODE, STORE_SYNCHRONOUS, STORE_CACHE_SIZE_KB, STORE_MMAP_SIZE);
+    sqlite3_exec(db, pragmas, NULL, NULL, NULL);
+    sqlite3_exec(db, CREATE_TABLE, NULL, NULL, NULL);
+
+    start = clock_mono_ns();
+    ingest_sqlite(db, per_sensor, sensors);
+    report("ingest: sqlite", rows, clock_mono_ns() - start);
+    sqlite3_exec(db, "PRAGMA wal_checkpoint(TRUNCATE);", NULL, NULL, NULL);
+
+    start = clock_mono_ns();
+    ingest_columnar(columnar_dir, per_sensor, sensors);
+    report("ingest: columnar", rows, clock_mono_ns() - start);
+
+    printf("%-30s %10.2f bytes/reading\n", "disk: sqlite", (double)dir_bytes(sqlite_dir) / rows);
+    printf("%-30s %10.2f bytes/reading\n", "disk: columnar", (double)dir_bytes(columnar_dir) / rows);
+
+    // Range scans over the same random windows
+    sqlite3_stmt *scan = NULL;
+    sqlite3_prepare_v2(db, SCAN_STMT, -1, &scan, NULL);
+    check_t c = {0};
+    c.per_sensor = per_sensor;
+
+    srand(7);
+    start = clock_mono_ns();
+    for (int q = 0; q < SCANS; q++)
+    {
+        c.sensor = rand() % sensors;
+        time_t from = BASE_TS + rand() % (per_sensor - SCAN_WINDOW);
+        sqlite3_bind_int(scan, 1, c.sensor + 1);
+        sqlite3_bind_int64(scan, 2, from);
+        sqlite3_bind_int64(scan, 3, from + SCAN_WINDOW - 1);
+        while (sqlite3_step(scan) == SQLITE_ROW)
+            check_point(&c, sqlite3_column_int64(scan, 0), sqlite3_column_double(scan, 1));
+        sqlite3_reset(scan);
+    }
+    report("range scan: sqlite", c.rows, clock_mono_ns() - start);
+    int sqlite_errors = c.errors;
+    long long sqlite_rows = c.rows;
+    sqlite3_finalize(scan);
+    sqlite3_close(db);
+
+    c.rows = 0;
+    c.errors = 0;
+    srand(7);
+    start = clock_mono_ns();
+    for (int q = 0; q < SCANS; q++)
+    {
+        c.sensor = rand() % sensors;
+        time_t from = BASE_TS + rand() % (per_sensor - SCAN_WINDOW);
+        columnar_scan(columnar_dir, c.sensor + 1, from, from + SCAN_WINDOW - 1, columnar_check, &c);
+    }
+    report("range scan: columnar", c.rows, clock_mono_ns() - start);
+
+    if (sqlite_errors || c.errors || sqlite_rows != (long long)SCANS * SCAN_WINDOW || c.rows != sqlite_rows)
+    {
+        fprintf(stderr, "Scan mismatch: sqlite %lld rows %d errors, columnar %lld rows %d errors\n",
+                sqlite_rows, sqlite_errors, c.rows, c.errors);
+        return EXIT_FAILURE;
+    }
+
+    clear_dir(sqlite_dir);
+    clear_dir(columnar_dir);
+    rmdir(sqlite_dir);
+    rmdir(columnar_dir);
+    free(temps);
+    return 0;
+}
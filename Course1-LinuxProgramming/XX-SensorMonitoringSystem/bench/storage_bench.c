@@ -0,0 +1,151 @@
+/** @file storage_bench.c
+ *  @brief Storage insert benchmark
+ *
+ *  Measures rows/s for the insert strategies of the storage manager on a
+ *  scratch database:
+ *    1. per-row prepare/finalize, one implicit transaction per row (old storage manager)
+ *    2. cached prepared statement, one implicit transaction per row
+ *    3. cached prepared statement, explicit transactions of STORE_TXN_MAX_ROWS rows
+ *  each with the default rollback journal and with the gateway's WAL settings.
+ *
+ *  Usage: ./storage_bench [rows] [db_path]
+ *
+ *  @author Phuc
+ *  @bug No known bugs.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sqlite3.h>
+#include "../include/common.h"
+#include "clock_service.h"
+#include "storage_manager.h"
+
+static const char *CREATE_TABLE =
+    "CREATE TABLE measurements ("
+    "id INTEGER NOT NULL, "
+    "time INTEGER NOT NULL, "
+    "seq INTEGER NOT NULL, "
+    "temp REAL NOT NULL, "
+    "flags INTEGER NOT NULL DEFAULT 0, "
+    "PRIMARY KEY (id, time, seq)"
+    ") WITHOUT ROWID, STRICT;";
+// Same statement as the storage manager
+static const char *INSERT_STMT =
+    "INSERT INTO measurements (id, time, seq, temp, flags) VALUES (?1, ?2, "
+    "COALESCE((SELECT MAX(seq) + 1 FROM measurements WHERE id = ?1 AND time = ?2), 0), ?3, ?4);";
+
+static void remove_scratch(const char *path)
+{
+    char side[300];
+    unlink(path);
+    snprintf(side, sizeof(side), "%s-wal", path);
+    unlink(side);
+    snprintf(side, sizeof(side), "%s-shm", path);
+    unlink(side);
+}
+
+static sqlite3 *open_scratch(const char *path, int wal)
+{
+    sqlite3 *db = NULL;
+    char pragmas[256];
+
+    remove_scratch(path);
+    if (sqlite3_open(path, &db) != SQLITE_OK || sqlite3_exec(db, CREATE_TABLE, NULL, NULL, NULL) != SQLITE_OK)
+    {
+        fprintf(stderr, "Failed to open scratch database %s: %s\n", path, sqlite3_errmsg(db));
+        exit(EXIT_FAILURE);
+    }
+
+    if (wal)
+    {
+        // Same settings as the storage manager
+        snprintf(pragmas, sizeof(pragmas),
+                 "PRAGMA journal_mode=%s; PRAGMA synchronous=%s; PRAGMA cache_size=-%d; PRAGMA mmap_size=%lld;",
+                 STORE_JOURNAL_MODE, STORE_SYNCHRONOUS, STORE_CACHE_SIZE_KB, STORE_MMAP_SIZE);
+        sqlite3_exec(db, pragmas, NULL, NULL, NULL);
+    }
+    return db;
+}
+
+static void bind_row(sqlite3_stmt *stmt, int i)
+{
+    sqlite3_bind_int(stmt, 1, 1 + i % (MAX_SENSORS - 1));
+    sqlite3_bind_int64(stmt, 2, 1744568370 + i / 4);
+    sqlite3_bind_double(stmt, 3, 20.0 + (i % 100) * 0.1);
+    sqlite3_bind_int(stmt, 4, 0);
+}
+
+static void insert_per_row_prepare(sqlite3 *db, int rows)
+{
+    for (int i = 0; i < rows; i++)
+    {
+        sqlite3_stmt *stmt = NULL;
+        sqlite3_prepare_v2(db, INSERT_STMT, -1, &stmt, NULL);
+        bind_row(stmt, i);
+        sqlite3_step(stmt);
+        sqlite3_finalize(stmt);
+    }
+}
+
+static void insert_cached_autocommit(sqlite3 *db, int rows)
+{
+    sqlite3_stmt *stmt = NULL;
+    sqlite3_prepare_v2(db, INSERT_STMT, -1, &stmt, NULL);
+    for (int i = 0; i < rows; i++)
+    {
+        bind_row(stmt, i);
+        sqlite3_step(stmt);
+        sqlite3_reset(stmt);
+    }
+    sqlite3_finalize(stmt);
+}
+
+static void insert_cached_batched(sqlite3 *db, int rows)
+{
+    sqlite3_stmt *stmt = NULL;
+    sqlite3_prepare_v2(db, INSERT_STMT, -1, &stmt, NULL);
+    for (int i = 0; i < rows; i++)
+    {
+        if (i % STORE_TXN_MAX_ROWS == 0)
+            sqlite3_exec(db, "BEGIN;", NULL, NULL, NULL);
+        bind_row(stmt, i);
+        sqlite3_step(stmt);
+        sqlite3_reset(stmt);
+        if (i % STORE_TXN_MAX_ROWS == STORE_TXN_MAX_ROWS - 1 || i == rows - 1)
+            sqlite3_exec(db, "COMMIT;", NULL, NULL, NULL);
+    }
+    sqlite3_finalize(stmt);
+}
+
+static void run(const char *name, void (*fn)(sqlite3 *, int), const char *path, int rows, int wal)
+{
+    sqlite3 *db = open_scratch(path, wal);
+    unsigned long long start = clock_mono_ns();
+    fn(db, rows);
+    double secs = (clock_mono_ns() - start) / 1e9;
+    sqlite3_close(db);
+    printf("%-36s %8d rows %9.3f s %12.0f rows/s\n", name, rows, secs, rows / secs);
+}
+
+int main(int argc, char *argv[])
+{
+    int rows = argc > 1 ? atoi(argv[1]) : 2000;
+    const char *path = argc > 2 ? argv[2] : "/tmp/storage_bench.db";
+
+    if (rows <= 0)
+    {
+        fprintf(stderr, "Usage: %s [rows] [db_path]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    run("per-row prepare, autocommit", insert_per_row_prepare, path, rows, 0);
+    run("cached statement, autocommit", insert_cached_autocommit, path, rows, 0);
+    run("cached statement, batched txn", insert_cached_batched, path, rows * 50, 0);
+    run("WAL: cached statement, autocommit", insert_cached_autocommit, path, rows, 1);
+    run("WAL: cached statement, batched txn", insert_cached_batched, path, rows * 50, 1);
+
+    remove_scratch(path);
+    return 0;
+}
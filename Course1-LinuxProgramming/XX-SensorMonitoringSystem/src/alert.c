@@ -0,0 +1,344 @@
+/** @file alert.c
+ *  @brief Implementation of alert dispatch
+ *
+ *  Bounded alert queue with coalescing, consumed by the alert dispatcher
+ *  thread. Slow sinks (terminal, files, sockets) only delay this thread,
+ *  never the data path.
+ *
+ *  @author Phuc
+ *  @bug No known bugs.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "alert.h"
+#include "log.h"
+#include "metrics.h"
+#include "threads.h"
+#include "clock_service.h"
+
+static alert_t queue[ALERT_QUEUE_SIZE];
+static int head = 0;
+static int tail = 0;
+static int count = 0;
+static pthread_mutex_t alert_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t alert_not_empty = PTHREAD_COND_INITIALIZER;
+
+// Queue slot holding the pending alert for a sensor and type, -1 if none
+static int pending_slot[MAX_SENSORS][ALERT_TYPE_COUNT];
+
+static alert_sink_t sinks[ALERT_MAX_SINKS];
+static int sink_count = 0;
+
+static const char *alert_words[ALERT_TYPE_COUNT] = {
+    [ALERT_TOO_COLD] = "cold",
+    [ALERT_TOO_HOT] = "hot",
+};
+
+/* ---------- Built-in sinks ---------- */
+
+static int stdout_emit(alert_sink_t *sink, const alert_t *alert)
+{
+    char time_str[CLOCK_STR_SIZE];
+    clock_format(alert->time, time_str, sizeof(time_str));
+
+    if (alert->repeat > 1)
+        printf("%s: Sensor %d too %s (avg temp %.1f°C, repeated %d times)\n", time_str,
+              alert->sensor_id, alert_words[alert->type], alert->value, alert->repeat);
+    else
+        printf("%s: Sensor %d too %s (avg temp %.1f°C)\n", time_str,
+              alert->sensor_id, alert_words[alert->type], alert->value);
+    fflush(stdout);
+    return 0;
+}
+
+static int log_emit(alert_sink_t *sink, const alert_t *alert)
+{
+    log_warn("The sensor node with %d reports it's too %s (running avg temperature = %.1f)",
+             alert->sensor_id, alert_words[alert->type], alert->value);
+    return 0;
+}
+
+static int file_open(alert_sink_t *sink)
+{
+    // The log process may not have created the directory yet
+    char dir_path[256];
+    snprintf(dir_path, sizeof(dir_path), "%s", ALERT_FILE_PATH);
+    char *last_slash = strrchr(dir_path, '/');
+    if (last_slash != NULL)
+    {
+        *last_slash = '\0';
+        if (mkdir(dir_path, 0777) == -1 && errno != EEXIST)
+        {
+            perror("Failed to create alert directory");
+            return -1;
+        }
+    }
+
+    FILE *fp = fopen(ALERT_FILE_PATH, "a");
+    if (fp == NULL)
+    {
+        perror("Failed to open alert file");
+        return -1;
+    }
+    sink->ctx = fp;
+    return 0;
+}
+
+static int file_emit(alert_sink_t *sink, const alert_t *alert)
+{
+    FILE *fp = (FILE *)sink->ctx;
+    if (fprintf(fp, "%ld %d too_%s %.2f %d\n", (long)alert->time, alert->sensor_id,
+                alert_words[alert->type], alert->value, alert->repeat) < 0)
+        return -1;
+    return fflush(fp);
+}
+
+static void file_close(alert_sink_t *sink)
+{
+    if (sink->ctx != NULL)
+        fclose((FILE *)sink->ctx);
+    sink->ctx = NULL;
+}
+
+// Format an alert as a single JSON object
+static int alert_to_json(const alert_t *alert, char *buf, size_t size)
+{
+    return snprintf(buf, size,
+                    "{\"sensor_id\":%d,\"alert\":\"too_%s\",\"avg_temp\":%.2f,\"time\":%ld,\"repeat\":%d}",
+                   alert->sensor_id, alert_words[alert->type], alert->value, (long)alert->time, alert->repeat);
+}
+
+static int unix_socket_open(alert_sink_t *sink)
+{
+    int fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+    if (fd == -1)
+    {
+        perror("Failed to create alert socket");
+        return -1;
+    }
+    sink->ctx = (void *)(long)fd;
+    return 0;
+}
+
+static int unix_socket_emit(alert_sink_t *sink, const alert_t *alert)
+{
+    int fd = (int)(long)sink->ctx;
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", ALERT_SOCKET_PATH);
+
+    char buf[256];
+    int len = alert_to_json(alert, buf, sizeof(buf));
+    if (sendto(fd, buf, len, 0, (struct sockaddr *)&addr, sizeof(addr)) == -1)
+    {
+        // Nobody listening is not an error, the sink is best effort
+        if (errno == ENOENT || errno == ECONNREFUSED || errno == EAGAIN)
+            return 0;
+        return -1;
+    }
+    return 0;
+}
+
+static void unix_socket_close(alert_sink_t *sink)
+{
+    close((int)(long)sink->ctx);
+}
+
+// Stand-in for an HTTP webhook: POST the alert to a local UNIX stream socket
+static int webhook_emit(alert_sink_t *sink, const alert_t *alert)
+{
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1)
+        return -1;
+
+    struct timeval tv = {.tv_sec = 1, .tv_usec = 0};
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", ALERT_WEBHOOK_PATH);
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1)
+    {
+        close(fd);
+        return (errno == ENOENT || errno == ECONNREFUSED) ? 0 : -1;
+    }
+
+    char body[256];
+    int body_len = alert_to_json(alert, body, sizeof(body));
+    char request[512];
+    int len = snprintf(request, sizeof(request),
+                       "POST /alerts HTTP/1.1\r\nHost: localhost\r\nContent-Type: application/json\r\n"
+                       "Content-Length: %d\r\nConnection: close\r\n\r\n%s",
+                       body_len, body);
+
+    int ret = write(fd, request, len) == len ? 0 : -1;
+    close(fd);
+    return ret;
+}
+
+/* ---------- Queue ---------- */
+
+// Initialize the alert queue and register the built-in sinks
+int alert_init(void)
+{
+    head = tail = count = 0;
+    for (int i = 0; i < MAX_SENSORS; i++)
+        for (int t = 0; t < ALERT_TYPE_COUNT; t++)
+            pending_slot[i][t] = -1;
+
+    alert_sink_t stdout_sink = {.name = "stdout", .emit = stdout_emit};
+    alert_sink_t log_sink = {.name = "log", .emit = log_emit};
+    if (alert_register_sink(&stdout_sink) != 0 || alert_register_sink(&log_sink) != 0)
+        return -1;
+
+#if ALERT_ENABLE_FILE
+    alert_sink_t file_sink = {.name = "file", .open = file_open, .emit = file_emit, .close = file_close};
+    if (alert_register_sink(&file_sink) != 0)
+        return -1;
+#endif
+#if ALERT_ENABLE_UNIX_SOCKET
+    alert_sink_t socket_sink = {.name = "unix_socket", .open = unix_socket_open,
+                                .emit = unix_socket_emit, .close = unix_socket_close};
+    if (alert_register_sink(&socket_sink) != 0)
+        return -1;
+#endif
+#if ALERT_ENABLE_WEBHOOK
+    alert_sink_t webhook_sink = {.name = "webhook", .emit = webhook_emit};
+    if (alert_register_sink(&webhook_sink) != 0)
+        return -1;
+#else
+    (void)webhook_emit;
+#endif
+
+    return 0;
+}
+
+// Register an additional sink, must be called before the dispatcher starts
+int alert_register_sink(const alert_sink_t *sink)
+{
+    if (sink == NULL || sink->emit == NULL || sink_count == ALERT_MAX_SINKS)
+    {
+        log_error("Failed to register alert sink");
+        return -1;
+    }
+    sinks[sink_count++] = *sink;
+    return 0;
+}
+
+// Queue an alert without blocking
+int alert_raise(int sensor_id, alert_type_t type, float value)
+{
+    if (sensor_id <= 0 || sensor_id >= MAX_SENSORS || type < 0 || type >= ALERT_TYPE_COUNT)
+        return -1;
+
+    time_t now = clock_now();
+
+    if (pthread_mutex_lock(&alert_mutex) != 0)
+        return -1;
+
+    int slot = pending_slot[sensor_id][type];
+    if (slot != -1)
+    {
+        // Coalesce into the alert that is still waiting to be dispatched
+        queue[slot].value = value;
+        queue[slot].time = now;
+        queue[slot].repeat++;
+        pthread_mutex_unlock(&alert_mutex);
+        metrics_add(METRIC_ALERTS_COALESCED, 1);
+        return 0;
+    }
+
+    if (count == ALERT_QUEUE_SIZE)
+    {
+        pthread_mutex_unlock(&alert_mutex);
+        metrics_add(METRIC_ALERTS_DROPPED, 1);
+        return -1;
+    }
+
+    queue[head] = (alert_t){.sensor_id = sensor_id, .type = type, .value = value, .time = now, .repeat = 1};
+    pending_slot[sensor_id][type] = head;
+    head = (head + 1) % ALERT_QUEUE_SIZE;
+    count++;
+
+    pthread_cond_signal(&alert_not_empty);
+    pthread_mutex_unlock(&alert_mutex);
+
+    metrics_add(METRIC_ALERTS_RAISED, 1);
+    return 0;
+}
+
+// Wake the dispatcher so it can observe shutdown_flag
+void alert_wakeup(void)
+{
+    pthread_mutex_lock(&alert_mutex);
+    pthread_cond_broadcast(&alert_not_empty);
+    pthread_mutex_unlock(&alert_mutex);
+}
+
+// Alert dispatcher thread, drains the queue into the sinks
+void *alert_dispatcher(void *arg)
+{
+    for (int i = 0; i < sink_count; i++)
+    {
+        if (sinks[i].open != NULL && sinks[i].open(&sinks[i]) != 0)
+        {
+            log_error("Failed to open alert sink %s, disabling it", sinks[i].name);
+            sinks[i].emit = NULL;
+            sinks[i].close = NULL;
+        }
+    }
+
+    log_info("Alert dispatcher started");
+
+    while (1)
+    {
+        if (pthread_mutex_lock(&alert_mutex) != 0)
+        {
+            log_error("Mutex lock failed in alert dispatcher");
+            break;
+        }
+
+        while (count == 0 && !shutdown_flag)
+        {
+            pthread_cond_wait(&alert_not_empty, &alert_mutex);
+        }
+
+        if (count == 0)
+        {
+            pthread_mutex_unlock(&alert_mutex);
+            break; // Shutdown and nothing left to dispatch
+        }
+
+        alert_t alert = queue[tail];
+        pending_slot[alert.sensor_id][alert.type] = -1;
+        tail = (tail + 1) % ALERT_QUEUE_SIZE;
+        count--;
+
+        pthread_mutex_unlock(&alert_mutex);
+
+        for (int i = 0; i < sink_count; i++)
+        {
+            if (sinks[i].emit != NULL && sinks[i].emit(&sinks[i], &alert) != 0)
+            {
+                log_error("Alert sink %s failed for sensor %d", sinks[i].name, alert.sensor_id);
+            }
+        }
+    }
+
+    for (int i = 0; i < sink_count; i++)
+    {
+        if (sinks[i].close != NULL)
+            sinks[i].close(&sinks[i]);
+    }
+
+    log_info("Alert dispatcher shutting down");
+    threads_mark_exit();
+    return NULL;
+}
@@ -0,0 +1,70 @@
+/** @file alert.h
+ *  @brief Alert dispatch declarations
+ *
+ *  Alerts are queued by the data manager without blocking and written
+ *  out by a dedicated alert dispatcher thread to every registered sink.
+ *
+ *  @author Phuc
+ *  @bug No known bugs.
+ */
+
+#ifndef ALERT_H
+#define ALERT_H
+
+#include <time.h>
+#include "../include/common.h"
+
+#define ALERT_QUEUE_SIZE 64
+#define ALERT_MAX_SINKS 8
+
+// Built-in sinks, enable or disable at compile time
+#define ALERT_ENABLE_FILE 1
+#define ALERT_ENABLE_UNIX_SOCKET 1
+#define ALERT_ENABLE_WEBHOOK 0
+
+#define ALERT_FILE_PATH "logs/alerts.log"
+#define ALERT_SOCKET_PATH "/tmp/alertSock"     // UNIX datagram socket, one alert per datagram
+#define ALERT_WEBHOOK_PATH "/tmp/alertWebhook" // UNIX stream socket receiving an HTTP POST per alert
+
+typedef enum
+{
+    ALERT_TOO_COLD,
+    ALERT_TOO_HOT,
+    ALERT_TYPE_COUNT
+} alert_type_t;
+
+typedef struct
+{
+    int sensor_id;
+    alert_type_t type;
+    float value;   // Running average that triggered the alert
+    time_t time;   // Time of the latest occurrence
+    int repeat;    // Occurrences coalesced into this alert
+} alert_t;
+
+typedef struct alert_sink
+{
+    const char *name;
+    int (*open)(struct alert_sink *sink);
+    int (*emit)(struct alert_sink *sink, const alert_t *alert);
+    void (*close)(struct alert_sink *sink);
+    void *ctx; // Sink private state
+} alert_sink_t;
+
+// Initialize the alert queue and register the built-in sinks
+int alert_init(void);
+
+// Register an additional sink, must be called before the dispatcher starts
+int alert_register_sink(const alert_sink_t *sink);
+
+// Queue an alert without blocking. A pending alert for the same sensor and
+// type is updated in place instead of queueing a duplicate.
+int alert_raise(int sensor_id, alert_type_t type, float value);
+
+// Wake the dispatcher so it can observe shutdown_flag
+void alert_wakeup(void);
+
+// Alert dispatcher thread, drains the queue into the sinks
+void *alert_dispatcher(void *arg);
+
+#endif /* ALERT_H */
@@ -0,0 +1,77 @@
+/** @file anomaly.c
+ *  @brief Implementation of the anomaly detection stage
+ *
+ *  Keeps O(1) state per sensor. Each batch is handled in two passes:
+ *  a sequential pass that snapshots and updates the per-sensor
+ *  statistics, and a branch-free pass over flat arrays that the
+ *  compiler can vectorize.
+ *
+ *  Only the data manager thread calls into this stage, so the
+ *  statistics need no locking.
+ *
+ *  @author Phuc
+ *  @bug No known bugs.
+ */
+
+#include <math.h>
+#include "anomaly.h"
+#include "metrics.h"
+#include "clock_service.h"
+
+static anomaly_stats_t sensor_stats[MAX_SENSORS];
+
+// Score a batch of readings with valid sensor IDs, filling flags[i] for each.
+int anomaly_process_batch(const sensor_data_t *batch, unsigned int *flags, int n)
+{
+    if (batch == NULL || flags == NULL || n < 0 || n > ANOMALY_BATCH_MAX)
+        return -1;
+
+    unsigned long long start_ns = clock_mono_ns();
+
+    float value[ANOMALY_BATCH_MAX];
+    float mean[ANOMALY_BATCH_MAX];
+    float limit[ANOMALY_BATCH_MAX];
+    float prev[ANOMALY_BATCH_MAX];
+    int has_prev[ANOMALY_BATCH_MAX];
+
+    // Pass 1: snapshot the statistics each reading is tested against, then fold it in.
+    // Readings of the same sensor within a batch depend on each other, so this stays scalar.
+    for (int i = 0; i < n; i++)
+    {
+        anomaly_stats_t *st = &sensor_stats[batch[i].sensor_id];
+        double x = batch[i].temperature;
+
+        value[i] = (float)x;
+        mean[i] = (float)st->mean;
+        prev[i] = st->last;
+        has_prev[i] = st->count > 0;
+        // Not enough history yet: an infinite limit never flags
+        limit[i] = st->count >= ANOMALY_MIN_SAMPLES
+                       ? (float)(ANOMALY_Z_THRESHOLD * sqrt(st->m2 / (st->count - 1)))
+                       : INFINITY;
+
+        // Welford update
+        st->count++;
+        double delta = x - st->mean;
+        st->mean += delta / st->count;
+        st->m2 += delta * (x - st->mean);
+        st->last = (float)x;
+    }
+
+    // Pass 2: independent per reading, no branches
+    int flagged = 0;
+    for (int i = 0; i < n; i++)
+    {
+        unsigned int zscore = fabsf(value[i] - mean[i]) > limit[i];
+        unsigned int jump = has_prev[i] & (fabsf(value[i] - prev[i]) > (float)ANOMALY_JUMP_THRESHOLD);
+        flags[i] = (zscore * ANOMALY_FLAG_ZSCORE) | (jump * ANOMALY_FLAG_JUMP);
+        flagged += flags[i] != 0;
+    }
+
+    metrics_add(METRIC_ANOMALY_BATCHES, 1);
+    metrics_add(METRIC_ANOMALY_READINGS, n);
+    metrics_add(METRIC_ANOMALY_FLAGGED, flagged);
+    metrics_add(METRIC_ANOMALY_NS, clock_mono_ns() - start_ns);
+
+    return flagged;
+}
@@ -0,0 +1,41 @@
+/** @file anomaly.h
+ *  @brief Anomaly detection stage declarations
+ *
+ *  Flags readings that deviate from the sensor's own online
+ *  mean/variance (Welford) or jump too far from the previous reading.
+ *
+ *  @author Phuc
+ *  @bug No known bugs.
+ */
+
+#ifndef ANOMALY_H
+#define ANOMALY_H
+
+#include "../include/common.h"
+#include "sbuffer.h"
+
+// Define configurable thresholds (could be passed via config)
+#define ANOMALY_Z_THRESHOLD 3.0     // Flag readings further than this many std devs from the mean
+#define ANOMALY_JUMP_THRESHOLD 10.0 // Flag readings changing more than this (°C) from the previous one
+#define ANOMALY_MIN_SAMPLES 10      // Readings needed before the z-score test is trusted
+
+// Maximum number of readings handled in one call
+#define ANOMALY_BATCH_MAX 64
+
+// Tags attached to stored readings
+#define ANOMALY_FLAG_ZSCORE 0x1
+#define ANOMALY_FLAG_JUMP 0x2
+
+typedef struct
+{
+    long count;      // Number of readings seen
+    double mean;     // Running mean
+    double m2;       // Sum of squared deviations from the mean
+    float last;      // Previous reading, for jump detection
+} anomaly_stats_t;
+
+// Score a batch of readings with valid sensor IDs, filling flags[i] for each.
+// Returns the number of flagged readings, or -1 on invalid input.
+int anomaly_process_batch(const sensor_data_t *batch, unsigned int *flags, int n);
+
+#endif /* ANOMALY_H */
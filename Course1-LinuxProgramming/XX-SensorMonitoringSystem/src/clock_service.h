@@ -0,0 +1,31 @@
+/** @file clock_service.h
+ *  @brief Shared clock declarations
+ *
+ *  Cheap wall-clock time for per-record use and monotonic nanosecond
+ *  timestamps for internal latency measurement.
+ *
+ *  @author Phuc
+ *  @bug No known bugs.
+ */
+
+#ifndef CLOCK_SERVICE_H
+#define CLOCK_SERVICE_H
+
+#include <time.h>
+
+// Size of a formatted time string, same layout as ctime_r() without the newline
+#define CLOCK_STR_SIZE 26
+
+// Current wall-clock second from the coarse clock (no syscall)
+time_t clock_now(void);
+
+// Current time formatted as "Mon Apr 14 01:09:30 2025", formatted once per second per thread
+const char *clock_now_str(void);
+
+// Format an arbitrary time the same way as clock_now_str()
+void clock_format(time_t t, char *buf, size_t size);
+
+// Monotonic timestamp in nanoseconds
+unsigned long long clock_mono_ns(void);
+
+#endif /* CLOCK_SERVICE_H */
@@ -14,10 +14,13 @@
 #include <sys/select.h>
 #include <time.h>
 #include <string.h>
+#include <stdint.h>
 #include "../include/common.h"
 #include "keep_alive.h"
 #include "connection_manager.h"
 #include "threads.h"
+#include "clock_service.h"
+#include "spool.h"
 
 // Handle socket creation, binding, and listening.
 int setup_socket(int port)
@@ -26,7 +29,7 @@ int setup_socket(int port)
     if (socket_fd == -1)
     {
         perror("Failed to create TCP socket");
-        log_event("Failed to create TCP socket");
+        log_error("Failed to create TCP socket");
         return -1;
     }
 
@@ -39,7 +42,7 @@ int setup_socket(int port)
     {
         close(socket_fd);
         perror("Failed to bind TCP socket");
-        log_event("Failed to bind TCP socket");
+        log_error("Failed to bind TCP socket");
         return -1;
     }
 
@@ -47,7 +50,7 @@ int setup_socket(int port)
     {
         close(socket_fd);
         perror("Failed to listen TCP socket");
-        log_event("Failed to listen TCP socket");
+        log_error("Failed to listen TCP socket");
         return -1;
     }
 
@@ -60,52 +63,26 @@ void handle_new_connection(int socket_fd, int *client_fds, int *client_count, fd
     if (shutdown_flag)
         return;
 
-    char msg[256];
-
     if (FD_ISSET(socket_fd, readfds))
     {
         int client_fd = accept(socket_fd, NULL, NULL);
         if (client_fd == -1)
         {
-            log_event("Failed to accept TCP socket");
+            log_error("Failed to accept TCP socket");
             return;
         }
 
-        if (*client_count < MAX_SENSORS)
+        if (*client_count < MAX_SENSORS && add_connection(client_fd) == 0)
         {
             client_fds[(*client_count)++] = client_fd;
 
-            if (pthread_mutex_lock(&conn_mutex) != 0)
-            {
-                perror("Conn mutex lock failed connection manager");
-                log_event("Mutex lock failed in connection manager");
-                return;
-            }
-
-            connections[conn_active_count].connection_id = client_fd;
-            connections[conn_active_count].last_active = time(NULL);
-            connections[conn_active_count].active = 1;
-            conn_active_count++;
-
-            if (pthread_mutex_unlock(&conn_mutex) != 0)
-            {
-                perror("Conn mutex unlock failed in connection manager");
-                log_event("Mutex unlock failed in connection manager");
-                return;
-            }
-
-            snprintf(msg, sizeof(msg), "A sensor node with %d has opened a new connection", client_fd);
-            log_event(msg);
+            log_info("A sensor node with %d has opened a new connection", client_fd);
             // Print to terminal
-            time_t now = time(NULL);
-            char time_str[26];
-            ctime_r(&now, time_str);
-            time_str[strlen(time_str) - 1] = '\0';
-            printf("%s: Connection %d established\n", time_str, client_fd);
+            printf("%s: Connection %d established\n", clock_now_str(), client_fd);
         }
         else
         {
-            log_event("Max client reached");
+            log_warn("Max client reached, or connection %d cannot be tracked", client_fd);
             close(client_fd);
         }
     }
@@ -122,14 +99,20 @@ void shift_clients(int *client_fds, int *client_count, int index)
     (*client_count)--;
 }
 
+// Forget a connection, close it and remove it from client_fds
+void close_client(int *client_fds, int *client_count, int index)
+{
+    remove_connection(client_fds[index]);
+    close(client_fds[index]);
+    shift_clients(client_fds, client_count, index);
+}
+
 // Read data, push to sbuffer, update last_active, close if needed.
 void handle_client_data(int *client_fds, int *client_count, sbuffer_t *sb, fd_set *readfds)
 {
     if (shutdown_flag)
         return;
 
-    char msg[256];
-
     for (int i = 0; i < *client_count; i++)
     {
         if (FD_ISSET(client_fds[i], readfds))
@@ -138,119 +121,99 @@ void handle_client_data(int *client_fds, int *client_count, sbuffer_t *sb, fd_se
             ssize_t bytes = read(client_fds[i], &sdata, sizeof(sensor_data_t));
             if (bytes > 0)
             {
-                snprintf(msg, sizeof(msg), "Received data: sensor_id=%d, temp=%.2f, time=%ld",
-                         sdata.sensor_id, sdata.temperature, sdata.timestamp);
-                log_event(msg);
+                log_debug("Received data: sensor_id=%d, temp=%.2f, time=%ld",
+                          sdata.sensor_id, sdata.temperature, sdata.timestamp);
 
-                if (sbuffer_push(sb, sdata) != 0)
+                // Spool the reading first so a crash before it is stored does not lose it
+                unsigned long long seq = spool_append(&sdata);
+
+                if (sbuffer_push(sb, sdata, seq) != 0)
                 {
-                    log_event("Failed to push data to sbuffer");
+                    log_error("Failed to push data to sbuffer");
+                    spool_release(&seq, 1);
                 }
                 else
                 {
-                    log_event("Data successfully pushed to sbuffer");
+                    log_debug("Data successfully pushed to sbuffer");
                 }
 
-                if (pthread_mutex_lock(&conn_mutex) != 0)
-                {
-                    perror("Conn mutex lock failed connection manager");
-                    log_event("Mutex lock failed in connection manager");
-                    return;
-                }
-
-                connections[i].last_active = time(NULL);
-
-                if (pthread_mutex_unlock(&conn_mutex) != 0)
-                {
-                    perror("Conn mutex unlock failed in connection manager");
-                    log_event("Mutex unlock failed in connection manager");
-                    return;
-                }
+                touch_connection(client_fds[i]);
             }
             else if (bytes == 0)
             {
-                snprintf(msg, sizeof(msg), "The sensor node with %d has closed the connection", client_fds[i]);
-                log_event(msg);
+                log_info("The sensor node with %d has closed the connection", client_fds[i]);
                 // Print to terminal
-                time_t now = time(NULL);
-                char time_str[26];
-                ctime_r(&now, time_str);
-                time_str[strlen(time_str) - 1] = '\0';
-                printf("%s: Connection %d closed\n", time_str, client_fds[i]);
-
-                if (pthread_mutex_lock(&conn_mutex) != 0)
-                {
-                    perror("Conn mutex lock failed connection manager");
-                    log_event("Mutex lock failed in connection manager");
-                    return;
-                }
+                printf("%s: Connection %d closed\n", clock_now_str(), client_fds[i]);
 
-                remove_connection(i);
-
-                if (pthread_mutex_unlock(&conn_mutex) != 0)
-                {
-                    perror("Conn mutex unlock failed in connection manager");
-                    log_event("Mutex unlock failed in connection manager");
-                    return;
-                }
-
-                shift_clients(client_fds, client_count, i);
+                close_client(client_fds, client_count, i);
                 i--;
             }
             else
             {
-                snprintf(msg, sizeof(msg), "Failed to read from sensor node %d", client_fds[i]);
-                log_event(msg);
+                log_error("Failed to read from sensor node %d", client_fds[i]);
 
-                if (pthread_mutex_lock(&conn_mutex) != 0)
-                {
-                    perror("Conn mutex lock failed connection manager");
-                    log_event("Mutex lock failed in connection manager");
-                    return;
-                }
-                remove_connection(i);
-                if (pthread_mutex_unlock(&conn_mutex) != 0)
-                {
-                    perror("Conn mutex unlock failed in connection manager");
-                    log_event("Mutex unlock failed in connection manager");
-                    return;
-                }
-
-                shift_clients(client_fds, client_count, i);
+                close_client(client_fds, client_count, i);
                 i--;
             }
         }
     }
 }
 
-// Close all FDs on shutdown.
-void cleanup_connections(int *client_fds, int client_count, int socket_fd)
+// Close the connections the keep-alive timed out. Runs after handle_new_connection(),
+// so a descriptor closed here is not reused before the next select().
+void handle_timeouts(int *client_fds, int *client_count, fd_set *readfds)
 {
-    if (pthread_mutex_lock(&conn_mutex) != 0)
-    {
-        perror("Conn mutex lock failed connection manager");
-        log_event("Mutex lock failed in connection manager");
+    if (!FD_ISSET(keep_alive_fd, readfds))
+        return;
+
+    uint64_t count;
+    if (read(keep_alive_fd, &count, sizeof(count)) == -1)
         return;
+
+    int fds[MAX_SENSORS];
+    int n;
+    while ((n = take_timed_out(fds, MAX_SENSORS)) > 0)
+    {
+        for (int t = 0; t < n; t++)
+        {
+            for (int i = 0; i < *client_count; i++)
+            {
+                if (client_fds[i] == fds[t])
+                {
+                    // Print to terminal
+                    printf("%s: Connection %d closed (timeout)\n", clock_now_str(), fds[t]);
+                    close(client_fds[i]);
+                    shift_clients(client_fds, client_count, i);
+                    break;
+                }
+            }
+        }
     }
+}
+
+// Feed a reading left in the spool by the previous run back into sbuffer
+static void replay_reading(const sensor_data_t *data, unsigned long long seq, void *ctx)
+{
+    sbuffer_t *sb = (sbuffer_t *)ctx;
 
+    // Only fails on shutdown, and the reading then stays in the spool
+    sbuffer_push_wait(sb, *data, seq);
+}
+
+// Close all FDs on shutdown.
+void cleanup_connections(int *client_fds, int client_count, int socket_fd)
+{
     for (int i = 0; i < client_count; i++)
     {
         if (client_fds[i] != -1)
         {
+            remove_connection(client_fds[i]);
             close(client_fds[i]);
         }
     }
-    conn_active_count = 0;
-
-    if (pthread_mutex_unlock(&conn_mutex) != 0)
-    {
-        perror("Conn mutex unlock failed in connection manager");
-        log_event("Mutex unlock failed in connection manager");
-        return;
-    }
 
     close(socket_fd);
-    log_event("Connection manager shutting down");
+    log_info("Connection manager shutting down");
 }
 
 // Coordinate these functions in the main loop.
@@ -258,18 +221,19 @@ void *connection_manager(void *arg)
 {
     thread_args_t *data = (thread_args_t *)arg;
 
-    char msg[256];
-    snprintf(msg, sizeof(msg), "Connection manager started on port %d", data->port);
-    log_event(msg);
+    log_info("Connection manager started on port %d", data->port);
 
     int socket_fd = setup_socket(data->port);
     if (socket_fd < 0)
     {
         perror("Failed to setup socket");
-        log_event("Failed to setup socket");
+        log_error("Failed to setup socket");
         exit(EXIT_FAILURE);
     }
 
+    // Readings received but not stored before the last shutdown go first
+    spool_replay(replay_reading, data->sb);
+
     int client_fds[MAX_SENSORS] = {-1};
     int client_count = 0;
     fd_set readfds;
@@ -278,7 +242,8 @@ void *connection_manager(void *arg)
     {
         FD_ZERO(&readfds);
         FD_SET(socket_fd, &readfds);
-        int max_fd = socket_fd;
+        FD_SET(keep_alive_fd, &readfds);
+        int max_fd = socket_fd > keep_alive_fd ? socket_fd : keep_alive_fd;
 
         for (int i = 0; i < client_count; i++)
         {
@@ -297,10 +262,11 @@ void *connection_manager(void *arg)
         {
             handle_new_connection(socket_fd, client_fds, &client_count, &readfds);
             handle_client_data(client_fds, &client_count, data->sb, &readfds);
+            handle_timeouts(client_fds, &client_count, &readfds);
         }
         else if (select_result == -1 && !shutdown_flag)
         {
-            log_event("Select failed");
+            log_error("Select failed");
         }
         else if (select_result == 0)
         {
@@ -309,6 +275,7 @@ void *connection_manager(void *arg)
     }
 
     cleanup_connections(client_fds, client_count, socket_fd);
+    threads_mark_exit();
 
     return NULL;
 }
\ No newline at end of file
@@ -25,6 +25,12 @@ void handle_new_connection(int socket_fd, int* client_fds, int* client_count, fd
 // Read data, push to sbuffer, update last_active, close if needed.
 void handle_client_data(int* client_fds, int* client_count, sbuffer_t* sb, fd_set* readfds);
 
+// Close the connections the keep-alive timed out
+void handle_timeouts(int* client_fds, int* client_count, fd_set* readfds);
+
+// Forget a connection, close it and remove it from client_fds
+void close_client(int* client_fds, int* client_count, int index);
+
 // Close all FDs on shutdown.
 void cleanup_connections(int* client_fds, int client_count, int socket_fd);
 
@@ -3,6 +3,10 @@
  *
  *  Processes sensor data, calculates running averages, and logs temperature conditions.
  *
+ *  Readings go through the reordering window first, so averages, alerts,
+ *  rollups, the anomaly stage and storage all see each sensor's readings
+ *  in event-time order.
+ *
  *  @author Phuc
  *  @bug No known bugs.
  */
@@ -19,140 +23,215 @@
 #include "sbuffer.h"
 #include "log.h"
 #include "threads.h"
+#include "anomaly.h"
+#include "alert.h"
+#include "reorder.h"
+#include "rollup.h"
+#include "store_queue.h"
+#include "clock_service.h"
+#include "spool.h"
 
 sensor_avg_t sensor_averages[MAX_SENSORS] = {0};
 pthread_mutex_t avg_mutex = PTHREAD_MUTEX_INITIALIZER;
 
-void *data_manager(void *arg)
+// Readings released by the reordering window, waiting for the anomaly stage
+typedef struct
 {
-    thread_args_t *args = (thread_args_t *)arg;
-    sbuffer_t *sb = args->sb;
-    char msg[256];
-    // Track last alert time per sensor
-    static time_t last_alert_time[MAX_SENSORS] = {0};
+    store_queue_t *sq;
+    sensor_data_t batch[ANOMALY_BATCH_MAX];
+    unsigned long long seqs[ANOMALY_BATCH_MAX]; // Spool sequence numbers of batch
+    int count;
+} stage_batch_t;
 
-    while (!shutdown_flag)
+// Track last alert time per sensor
+static time_t last_alert_time[MAX_SENSORS] = {0};
+
+// Update the running average of a sensor and raise alerts
+static void update_average(const sensor_data_t *data)
+{
+    time_t now = clock_now();
+    float new_sum, new_avg;
+    int new_count;
+
+    if (pthread_mutex_lock(&avg_mutex) != 0)
     {
-        sensor_data_t data;
+        log_error("Mutex lock failed in data_manager for sensor %d", data->sensor_id);
+        return;
+    }
 
-        int pop_retries = 0;
-        while (pop_retries < MAX_RETRIES && sbuffer_pop(sb, &data) != 0)
-        {
-            if (shutdown_flag)
-                goto cleanup;
-            snprintf(msg, sizeof(msg), "Failed to pop data from sbuffer, retry %d/%d", pop_retries + 1, MAX_RETRIES);
-            log_event(msg);
-            sleep(1);
-            pop_retries++;
-        }
+    // Reset average if no recent updates
+    if (difftime(now, sensor_averages[data->sensor_id].last_update) > RESET_THRESHOLD_SECONDS)
+    {
+        sensor_averages[data->sensor_id].sum = data->temperature;
+        sensor_averages[data->sensor_id].count = 1;
+        log_debug("Reset average for sensor %d to %.1f°C",
+                  data->sensor_id, data->temperature);
+    }
+    else
+    {
+        sensor_averages[data->sensor_id].sum += data->temperature;
+        sensor_averages[data->sensor_id].count++;
+    }
 
-        if (pop_retries == MAX_RETRIES)
-        {
-            log_event("Max retries reached for popping data, skipping...");
-            continue;
-        }
+    new_sum = sensor_averages[data->sensor_id].sum;
+    new_count = sensor_averages[data->sensor_id].count;
+    sensor_averages[data->sensor_id].last_update = data->timestamp;
+
+    // Only calculate average if we have enough readings
+    if (new_count >= MIN_AVG_COUNT)
+    {
+        new_avg = new_sum / new_count;
+        // Log running average for debugging
+        log_debug("Sensor %d running avg: %.1f°C (count=%d)",
+                  data->sensor_id, new_avg, new_count);
+    }
+    else
+    {
+        log_debug("Sensor %d accumulating: %.1f°C (count=%d, waiting for %d)",
+                  data->sensor_id, data->temperature, new_count, MIN_AVG_COUNT);
+        new_avg = 0.0; // Avoid using average until MIN_AVG_COUNT
+    }
 
-        // Validate sensor ID (assume valid IDs start at 1)
-        if (data.sensor_id <= 0 || data.sensor_id >= MAX_SENSORS)
+    if (pthread_mutex_unlock(&avg_mutex) != 0)
+    {
+        log_error("Mutex unlock failed in data_manager for sensor %d", data->sensor_id);
+    }
+
+    // Check temperature conditions only if we have enough readings
+    if (new_count >= MIN_AVG_COUNT)
+    {
+        // Only alert if enough time has passed since the last alert
+        if (difftime(now, last_alert_time[data->sensor_id]) >= ALERT_COOLDOWN)
         {
-            snprintf(msg, sizeof(msg), "Received sensor data with invalid sensor ID %d", data.sensor_id);
-            log_event(msg);
-            continue;
+            if (new_avg < TOO_COLD)
+            {
+                alert_raise(data->sensor_id, ALERT_TOO_COLD, new_avg);
+                last_alert_time[data->sensor_id] = now;
+            }
+            else if (new_avg > TOO_HOT)
+            {
+                alert_raise(data->sensor_id, ALERT_TOO_HOT, new_avg);
+                last_alert_time[data->sensor_id] = now;
+            }
         }
+    }
+}
 
-        // Log raw data for debugging
-        snprintf(msg, sizeof(msg), "Processing sensor %d: temp=%.1f°C, time=%ld",
-                 data.sensor_id, data.temperature, data.timestamp);
-        log_event(msg);
+// Run the anomaly stage over the pending batch and hand it to the storage manager
+static void flush_stage_batch(stage_batch_t *stage)
+{
+    unsigned int flags[ANOMALY_BATCH_MAX];
 
-        time_t now = time(NULL);
-        float new_sum, new_avg;
-        int new_count;
+    if (stage->count == 0)
+        return;
 
-        if (pthread_mutex_lock(&avg_mutex) != 0)
-        {
-            snprintf(msg, sizeof(msg), "Mutex lock failed in data_manager for sensor %d", data.sensor_id);
-            log_event(msg);
-            continue;
-        }
+    // Anomaly stage: score the readings of this batch against each sensor's own history
+    if (anomaly_process_batch(stage->batch, flags, stage->count) < 0)
+    {
+        log_warn("Anomaly stage rejected batch, storing readings untagged");
+        memset(flags, 0, sizeof(flags));
+    }
 
-        // Reset average if no recent updates
-        if (difftime(now, sensor_averages[data.sensor_id].last_update) > RESET_THRESHOLD_SECONDS)
+    for (int i = 0; i < stage->count; i++)
+    {
+        const sensor_data_t *data = &stage->batch[i];
+
+        if (flags[i] != 0)
         {
-            sensor_averages[data.sensor_id].sum = data.temperature;
-            sensor_averages[data.sensor_id].count = 1;
-            snprintf(msg, sizeof(msg), "Reset average for sensor %d to %.1f°C",
-                     data.sensor_id, data.temperature);
-            log_event(msg);
+            log_warn("Anomaly on sensor %d: temp=%.1f°C, time=%ld (flags=0x%x)",
+                     data->sensor_id, data->temperature, data->timestamp, flags[i]);
         }
-        else
+
+        store_record_t rec = {.type = STORE_MEASUREMENT, .data = *data, .flags = flags[i],
+                              .spool_seq = stage->seqs[i], .enqueue_ns = clock_mono_ns()};
+        if (store_queue_push(stage->sq, &rec) != 0)
         {
-            sensor_averages[data.sensor_id].sum += data.temperature;
-            sensor_averages[data.sensor_id].count++;
+            log_error("Failed to queue sensor %d data for storage", data->sensor_id);
         }
+    }
 
-        new_sum = sensor_averages[data.sensor_id].sum;
-        new_count = sensor_averages[data.sensor_id].count;
-        sensor_averages[data.sensor_id].last_update = data.timestamp;
+    stage->count = 0;
+}
 
-        // Only calculate average if we have enough readings
-        if (new_count >= MIN_AVG_COUNT)
-        {
-            new_avg = new_sum / new_count;
-            // Log running average for debugging
-            snprintf(msg, sizeof(msg), "Sensor %d running avg: %.1f°C (count=%d)",
-                     data.sensor_id, new_avg, new_count);
-            log_event(msg);
-        }
-        else
+// Called by the reordering window for each reading, in event-time order
+static void emit_reading(const sensor_data_t *data, unsigned long long seq, void *ctx)
+{
+    stage_batch_t *stage = (stage_batch_t *)ctx;
+
+    update_average(data);
+    rollup_add(data, stage->sq);
+
+    stage->seqs[stage->count] = seq;
+    stage->batch[stage->count++] = *data;
+    if (stage->count == ANOMALY_BATCH_MAX)
+        flush_stage_batch(stage);
+}
+
+void *data_manager(void *arg)
+{
+    thread_args_t *args = (thread_args_t *)arg;
+    sbuffer_t *sb = args->sb;
+    stage_batch_t stage = {.sq = args->sq, .count = 0};
+
+    while (!shutdown_flag)
+    {
+        sensor_data_t batch[DATA_BATCH_SIZE];
+        unsigned long long seqs[DATA_BATCH_SIZE];
+        int n = 0;
+
+        // Wake up periodically even without data so held readings are released
+        int pop_retries = 0;
+        while (pop_retries < MAX_RETRIES && (n = sbuffer_pop_batch(sb, batch, seqs, DATA_BATCH_SIZE, DATA_FLUSH_MS)) < 0)
         {
-            snprintf(msg, sizeof(msg), "Sensor %d accumulating: %.1f°C (count=%d, waiting for %d)",
-                     data.sensor_id, data.temperature, new_count, MIN_AVG_COUNT);
-            log_event(msg);
-            new_avg = 0.0; // Avoid using average until MIN_AVG_COUNT
+            if (shutdown_flag)
+                goto cleanup;
+            log_error("Failed to pop data from sbuffer, retry %d/%d", pop_retries + 1, MAX_RETRIES);
+            sleep(1);
+            pop_retries++;
         }
 
-        if (pthread_mutex_unlock(&avg_mutex) != 0)
+        if (pop_retries == MAX_RETRIES)
         {
-            snprintf(msg, sizeof(msg), "Mutex unlock failed in data_manager for sensor %d", data.sensor_id);
-            log_event(msg);
+            log_error("Max retries reached for popping data, skipping...");
+            continue;
         }
 
-        // Check temperature conditions only if we have enough readings
-        if (new_count >= MIN_AVG_COUNT)
+        time_t now = clock_now();
+
+        for (int i = 0; i < n; i++)
         {
-            // Only alert if enough time has passed since the last alert
-            if (difftime(now, last_alert_time[data.sensor_id]) >= ALERT_COOLDOWN)
+            sensor_data_t data = batch[i];
+
+            // Validate sensor ID (assume valid IDs start at 1)
+            if (data.sensor_id <= 0 || data.sensor_id >= MAX_SENSORS)
             {
-                if (new_avg < TOO_COLD)
-                {
-                    snprintf(msg, sizeof(msg), "The sensor node with %d reports it's too cold (running avg temperature = %.1f)",
-                             data.sensor_id, new_avg);
-                    log_event(msg);
-                    time_t now_alert = time(NULL);
-                    char time_str[26];
-                    ctime_r(&now_alert, time_str);
-                    time_str[strlen(time_str) - 1] = '\0';
-                    printf("%s: Sensor %d too cold (avg temp %.1f°C)\n", time_str, data.sensor_id, new_avg);
-                    last_alert_time[data.sensor_id] = now;
-                }
-                else if (new_avg > TOO_HOT)
-                {
-                    snprintf(msg, sizeof(msg), "The sensor node with %d reports it's too hot (running avg temperature = %.1f)",
-                             data.sensor_id, new_avg);
-                    log_event(msg);
-                    time_t now_alert = time(NULL);
-                    char time_str[26];
-                    ctime_r(&now_alert, time_str);
-                    time_str[strlen(time_str) - 1] = '\0';
-                    printf("%s: Sensor %d too hot (avg temp %.1f°C)\n", time_str, data.sensor_id, new_avg);
-                    last_alert_time[data.sensor_id] = now;
-                }
+                log_warn("Received sensor data with invalid sensor ID %d", data.sensor_id);
+                spool_release(&seqs[i], 1);
+                continue;
             }
+
+            // Log raw data for debugging
+            log_debug("Processing sensor %d: temp=%.1f°C, time=%ld",
+                      data.sensor_id, data.temperature, data.timestamp);
+
+            // Dropped readings will never be stored, so the spool must not replay them
+            if (reorder_push(&data, seqs[i], now, emit_reading, &stage) != 0)
+                spool_release(&seqs[i], 1);
         }
+
+        reorder_flush_expired(now, emit_reading, &stage);
+        flush_stage_batch(&stage);
+        rollup_flush_expired(now, stage.sq);
     }
 
 cleanup:
-    log_event("Data manager shutting down");
+    // Readings still held in the reordering window are released in order before exiting
+    reorder_flush_all(emit_reading, &stage);
+    flush_stage_batch(&stage);
+    rollup_flush_all(stage.sq);
+    store_queue_close(stage.sq);
+
+    log_info("Data manager shutting down");
+    threads_mark_exit();
     return NULL;
-}
\ No newline at end of file
+}
@@ -24,6 +24,10 @@
 #define MIN_AVG_COUNT 5
 // Minimum time between alerts for the same sensor (seconds)
 #define ALERT_COOLDOWN 60
+// Maximum readings taken from the sensor buffer per iteration
+#define DATA_BATCH_SIZE 32
+// Longest wait for new data before held readings are checked again (ms)
+#define DATA_FLUSH_MS 500
 
 typedef struct
 {
@@ -3,6 +3,20 @@
  *
  *  Manage the keep-alive loop, connection tracking, and signal handling.
  *
+ *  A timer sits in the slot of the tick of its deadline, and a slot holds
+ *  the timers of every turn that falls on it. When a slot comes up, each
+ *  timer's deadline is computed again from the connection's last
+ *  activity: connections that sent something since are moved to their new
+ *  deadline, the others are timed out. A connection is thus moved at most
+ *  once per TIMEOUT_SECONDS, however many readings it sends. Deadlines
+ *  further than one turn are parked on the last slot of the turn and moved
+ *  on from there, which a single TIMEOUT_SECONDS shorter than a turn never
+ *  needs.
+ *
+ *  Timed out connections stay tracked on a queue of their own until the
+ *  connection manager takes them, so that a connection closed by its
+ *  peer in the meantime is taken off the queue and not closed twice.
+ *
  *  @author Phuc
  *  @bug No known bugs.
  */
@@ -12,54 +26,216 @@
 #include <time.h>
 #include <unistd.h>
 #include <string.h>
+#include <stdint.h>
+#include <sys/eventfd.h>
 #include "../include/common.h"
 #include "keep_alive.h"
 #include "log.h"
+#include "metrics.h"
+#include "clock_service.h"
+
+#define WHEEL_MASK (KEEP_ALIVE_WHEEL_SLOTS - 1)
 
-connection_tracking_t connections[MAX_SENSORS];
+connection_tracking_t connections[KEEP_ALIVE_MAX_FD];
 int conn_active_count = 0;
-pthread_mutex_t conn_mutex;
+pthread_mutex_t conn_mutex = PTHREAD_MUTEX_INITIALIZER;
+int keep_alive_fd = -1;
 
+static connection_tracking_t *wheel[KEEP_ALIVE_WHEEL_SLOTS];
+static connection_tracking_t *timed_out; // Queue for the connection manager
+static long long wheel_tick; // Last tick whose slot was run
+
+// Only async-signal-safe calls: logging writes the interrupted thread's
+// ring, which is not reentrant, so run_keep_alive() logs the signal
 static void sigint_handler(int sig)
 {
-    pthread_mutex_lock(&conn_mutex);
+    (void)sig;
     shutdown_flag = 1;
-    pthread_mutex_unlock(&conn_mutex);
-    
-    log_event("Received SIGINT, initiating shutdown");
     write(STDERR_FILENO, "Shutdown signal received\n", 25);
 }
 
-void remove_connection(int index)
+static long long mono_ms(void)
+{
+    return (long long)(clock_mono_ns() / 1000000ULL);
+}
+
+// Put a timer in the slot of the first tick at or after deadline_ms
+static void wheel_insert(connection_tracking_t *conn, long long deadline_ms)
+{
+    long long tick = (deadline_ms + KEEP_ALIVE_TICK_MS - 1) / KEEP_ALIVE_TICK_MS;
+
+    if (tick <= wheel_tick)
+        tick = wheel_tick + 1;
+    if (tick - wheel_tick >= KEEP_ALIVE_WHEEL_SLOTS)
+        tick = wheel_tick + KEEP_ALIVE_WHEEL_SLOTS - 1;
+
+    conn->slot = (int)(tick & WHEEL_MASK);
+    connection_tracking_t **head = &wheel[conn->slot];
+    conn->prev = NULL;
+    conn->next = *head;
+    if (*head != NULL)
+        (*head)->prev = conn;
+    *head = conn;
+}
+
+static void wheel_unlink(connection_tracking_t *conn)
+{
+    if (conn->prev != NULL)
+        conn->prev->next = conn->next;
+    else if (conn->slot >= 0)
+        wheel[conn->slot] = conn->next;
+    else
+        timed_out = conn->next;
+    if (conn->next != NULL)
+        conn->next->prev = conn->prev;
+    conn->next = NULL;
+    conn->prev = NULL;
+}
+
+// Time out the connections of the slot of wheel_tick that were idle, under conn_mutex.
+// Returns their count.
+static int run_slot(long long now_ms)
+{
+    connection_tracking_t *conn = wheel[wheel_tick & WHEEL_MASK];
+    int expired = 0;
+    wheel[wheel_tick & WHEEL_MASK] = NULL;
+
+    while (conn != NULL)
+    {
+        connection_tracking_t *next = conn->next;
+        long long deadline = atomic_load_explicit(&conn->last_active_ms, memory_order_relaxed) + TIMEOUT_SECONDS * 1000LL;
+
+        if (deadline > now_ms)
+        {
+            wheel_insert(conn, deadline);
+        }
+        else
+        {
+            log_info("Sensor node with %d has disconnected (keep-alive timeout)", conn->connection_id);
+            metrics_add(METRIC_KEEPALIVE_TIMEOUTS, 1);
+
+            conn->slot = -1;
+            conn->prev = NULL;
+            conn->next = timed_out;
+            if (timed_out != NULL)
+                timed_out->prev = conn;
+            timed_out = conn;
+            expired++;
+        }
+        conn = next;
+    }
+    return expired;
+}
+
+int add_connection(int fd)
 {
-    if (index < 0 || index >= conn_active_count)
+    if (fd < 0 || fd >= KEEP_ALIVE_MAX_FD)
+        return -1;
+
+    if (pthread_mutex_lock(&conn_mutex) != 0)
+    {
+        perror("Conn mutex lock failed in add_connection");
+        log_error("Mutex lock failed in add_connection");
+        return -1;
+    }
+
+    connection_tracking_t *conn = &connections[fd];
+    int ret = -1;
+    if (!conn->active)
+    {
+        long long now = mono_ms();
+        conn->connection_id = fd;
+        atomic_store_explicit(&conn->last_active_ms, now, memory_order_relaxed);
+        conn->active = 1;
+        wheel_insert(conn, now + TIMEOUT_SECONDS * 1000LL);
+        conn_active_count++;
+        ret = 0;
+    }
+
+    if (pthread_mutex_unlock(&conn_mutex) != 0)
     {
-        perror("Invalid index in remove_connection");
+        perror("Conn mutex unlock failed in add_connection");
+        log_error("Mutex unlock failed in add_connection");
+        return -1;
+    }
+    return ret;
+}
+
+void touch_connection(int fd)
+{
+    if (fd >= 0 && fd < KEEP_ALIVE_MAX_FD)
+        atomic_store_explicit(&connections[fd].last_active_ms, mono_ms(), memory_order_relaxed);
+}
+
+void remove_connection(int fd)
+{
+    if (fd < 0 || fd >= KEEP_ALIVE_MAX_FD)
+    {
+        perror("Invalid fd in remove_connection");
         return;
     }
 
-    if (conn_active_count <= 0)
+    if (pthread_mutex_lock(&conn_mutex) != 0)
     {
-        perror("conn_active_count is 0 in remove_connection");
+        perror("Conn mutex lock failed in remove_connection");
+        log_error("Mutex lock failed in remove_connection");
         return;
     }
 
-    for (int i = index; i < conn_active_count - 1; i++)
+    connection_tracking_t *conn = &connections[fd];
+    if (conn->active)
     {
-        connections[i] = connections[i + 1];
+        wheel_unlink(conn);
+        conn->active = 0;
+        conn_active_count--;
+    }
+
+    if (pthread_mutex_unlock(&conn_mutex) != 0)
+    {
+        perror("Conn mutex unlock failed in remove_connection");
+        log_error("Mutex unlock failed in remove_connection");
     }
-    conn_active_count--;
 }
 
-int init_keep_alive(void)
+int take_timed_out(int *fds, int max)
 {
-    // Init connection mutex
-    if (pthread_mutex_init(&conn_mutex, NULL) != 0)
+    int count = 0;
+
+    if (pthread_mutex_lock(&conn_mutex) != 0)
     {
-        perror("Init mutex in init_keep_alive failed");
-        return -1;
+        perror("Conn mutex lock failed in take_timed_out");
+        log_error("Mutex lock failed in take_timed_out");
+        return 0;
+    }
+
+    while (timed_out != NULL && count < max)
+    {
+        connection_tracking_t *conn = timed_out;
+        wheel_unlink(conn);
+        conn->active = 0;
+        conn_active_count--;
+        fds[count++] = conn->connection_id;
+    }
+
+    if (pthread_mutex_unlock(&conn_mutex) != 0)
+    {
+        perror("Conn mutex unlock failed in take_timed_out");
+        log_error("Mutex unlock failed in take_timed_out");
     }
+    return count;
+}
 
+void keep_alive_wakeup(void)
+{
+    uint64_t one = 1;
+    if (keep_alive_fd != -1 && write(keep_alive_fd, &one, sizeof(one)) != (ssize_t)sizeof(one))
+    {
+        log_error("Failed to wake the connection manager");
+    }
+}
+
+int init_keep_alive(void)
+{
     // Register exit signal
     if (signal(SIGINT, sigint_handler) == SIG_ERR)
     {
@@ -68,9 +244,22 @@ int init_keep_alive(void)
     }
 
     // Clear connection tracking for keep-alive
-    for (int i = 0; i < MAX_SENSORS; i++)
+    for (int i = 0; i < KEEP_ALIVE_MAX_FD; i++)
     {
         connections[i].active = 0;
+        connections[i].next = NULL;
+        connections[i].prev = NULL;
+    }
+    memset(wheel, 0, sizeof(wheel));
+    timed_out = NULL;
+    wheel_tick = mono_ms() / KEEP_ALIVE_TICK_MS;
+
+    // Wakes the connection manager's select() when connections time out
+    keep_alive_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (keep_alive_fd == -1)
+    {
+        perror("Failed to create keep-alive eventfd");
+        return -1;
     }
 
     return 0;
@@ -78,44 +267,61 @@ int init_keep_alive(void)
 
 int run_keep_alive(void)
 {
+    struct timespec next;
+    long long last_report = mono_ms();
+
+    clock_gettime(CLOCK_MONOTONIC, &next);
     while (!shutdown_flag)
     {
-        sleep(10);
+        // Wake once per tick, on time whatever the time spent in the slots
+        next.tv_nsec += KEEP_ALIVE_TICK_MS * 1000000L;
+        if (next.tv_nsec >= 1000000000L)
+        {
+            next.tv_sec += next.tv_nsec / 1000000000L;
+            next.tv_nsec %= 1000000000L;
+        }
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+
+        long long now = mono_ms();
+        long long now_tick = now / KEEP_ALIVE_TICK_MS;
+        int expired = 0;
 
         if (pthread_mutex_lock(&conn_mutex) != 0)
         {
             perror("Conn mutex lock failed in keep_alive");
-            log_event("Mutex lock failed in keep_alive");
+            log_error("Mutex lock failed in keep_alive");
             return -1;
         }
 
-        for (int i = 0; i < conn_active_count; i++)
+        // After a stall, one turn runs every slot
+        if (now_tick - wheel_tick > KEEP_ALIVE_WHEEL_SLOTS)
+            wheel_tick = now_tick - KEEP_ALIVE_WHEEL_SLOTS;
+        while (wheel_tick < now_tick)
         {
-            if ((connections[i].active == 1) && (time(NULL) - connections[i].last_active > TIMEOUT_SECONDS))
-            {
-                char msg[256];
-                snprintf(msg, sizeof(msg), "Sensor node with %d has disconnected (keep-alive timeout)", connections[i].connection_id);
-                log_event(msg);
-
-                // Print to terminal
-                time_t now = time(NULL);
-                char time_str[26];
-                ctime_r(&now, time_str);
-                time_str[strlen(time_str) - 1] = '\0';
-                printf("%s: Connection %d closed (timeout)\n", time_str, connections[i].connection_id);
-                connections[i].active = 0;
-                remove_connection(i);
-                i--;
-            }
+            wheel_tick++;
+            expired += run_slot(now);
         }
 
         if (pthread_mutex_unlock(&conn_mutex) != 0)
         {
             perror("Conn mutex unlock failed in keep_alive");
-            log_event("Mutex unlock failed in keep_alive");
+            log_error("Mutex unlock failed in keep_alive");
             return -1;
         }
+
+        uint64_t one = 1;
+        if (expired > 0 && write(keep_alive_fd, &one, sizeof(one)) != (ssize_t)sizeof(one))
+        {
+            log_error("Failed to wake the connection manager for %d timed out connections", expired);
+        }
+
+        if (now - last_report >= KEEP_ALIVE_REPORT_MS)
+        {
+            metrics_report();
+            last_report = now;
+        }
     }
 
+    log_info("Received SIGINT, initiating shutdown");
     return 0;
 }
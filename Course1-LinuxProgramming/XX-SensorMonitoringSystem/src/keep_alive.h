@@ -3,6 +3,18 @@
  *
  *  Manage the keep-alive loop, connection tracking, and signal handling.
  *
+ *  Connections are tracked by file descriptor, each with a timer on a
+ *  timing wheel of KEEP_ALIVE_WHEEL_SLOTS ticks of KEEP_ALIVE_TICK_MS.
+ *  The connection manager records activity with one atomic store; the
+ *  keep-alive loop moves a timer only when it fires and the connection
+ *  was active since, so a timeout is detected at most one tick late and
+ *  costs O(1) whatever the number of connections.
+ *
+ *  A connection that timed out is queued for the connection manager,
+ *  which is woken through keep_alive_fd, closes it and forgets it: only
+ *  the thread that accepts connections closes them, so a file
+ *  descriptor is never reused while the keep-alive still tracks it.
+ *
  *  @author Phuc
  *  @bug No known bugs.
  */
@@ -11,23 +23,50 @@
 #define KEEP_ALIVE_H
 
 #include <pthread.h>
+#include <stdatomic.h>
+#include <sys/select.h>
 #include "common.h"
 
-typedef struct
+#define KEEP_ALIVE_TICK_MS 100      // Timeouts are detected at most this late
+#define KEEP_ALIVE_WHEEL_SLOTS 256  // Ticks in one turn of the wheel, a power of 2 spanning TIMEOUT_SECONDS
+#define KEEP_ALIVE_REPORT_MS 10000  // Metrics are reported this often
+#define KEEP_ALIVE_MAX_FD FD_SETSIZE // Connections are tracked by file descriptor, select() takes no more
+
+typedef struct connection_tracking
 {
     int connection_id;
     char ip[16];
     int port;
-    time_t last_active;
+    atomic_llong last_active_ms; // Monotonic, stored by the connection manager without a lock
     int active;
+    // Timer on the wheel, or entry of the timed out queue, under conn_mutex
+    struct connection_tracking *next;
+    struct connection_tracking *prev;
+    int slot;                    // -1 once timed out
 } connection_tracking_t;
 
-extern connection_tracking_t connections[MAX_SENSORS];
+extern connection_tracking_t connections[KEEP_ALIVE_MAX_FD];
 extern int conn_active_count;
 extern pthread_mutex_t conn_mutex;
+extern int keep_alive_fd; // eventfd, readable when connections timed out
 
 int init_keep_alive(void);
 int run_keep_alive(void);
-void remove_connection(int index);
 
-#endif /* KEEP_ALIVE_H */
\ No newline at end of file
+// Start tracking a connection. Returns -1 if fd is out of range or already tracked.
+int add_connection(int fd);
+
+// Record activity on a connection: one atomic store, no lock
+void touch_connection(int fd);
+
+// Stop tracking a connection that was closed
+void remove_connection(int fd);
+
+// Wake the connection manager so it can observe shutdown_flag
+void keep_alive_wakeup(void);
+
+// Take the connections that timed out, at most max, to be closed by the caller.
+// They are no longer tracked. Returns their count.
+int take_timed_out(int *fds, int max);
+
+#endif /* KEEP_ALIVE_H */
@@ -1,25 +1,665 @@
 /** @file log.c
  *  @brief Implementation of the log process
  *
- *  Handles logging events received via FIFO and writes them to gateway.log
+ *  Drains the log rings of the gateway threads, which live in shared
+ *  memory, and writes their messages to gateway.log
+ *
+ *  Messages travel as records: a text message, or the ID of a printf
+ *  format and its raw arguments, formatted by the log process. The ID is
+ *  the offset of the format string in the executable, which the log
+ *  process shares as a fork, or a fresh exec, of the gateway.
+ *
+ *  The log process is supervised by a thread of the gateway. A slot is
+ *  freed only once its lines were written to the file, and the line
+ *  numbering lives in the shared memory, so a restarted log process goes
+ *  on where the last write ended. Lines buffered by a log process that
+ *  died are written again, under the same numbers.
  *
  *  @author Phuc
  *  @bug No known bugs.
  */
 
+#define _GNU_SOURCE // ppoll(), close_range(), program_invocation_name
 #include "log.h"
+#include "clock_service.h"
+#include "metrics.h"
+#include "log_rotate.h"
+#include "log_index.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <stddef.h>
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <unistd.h>
 #include <time.h>
 #include <errno.h>
+#include <signal.h>
 #include <pthread.h>
+#include <stdatomic.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+
+// Bounds of the executable image, from the linker
+extern char __executable_start[];
+extern char _end[];
+
+// Header of a record in a ring slot, followed by len bytes of data: the text,
+// or for a format ID the arguments as 8-byte values and strings inline
+typedef struct
+{
+    unsigned short len;
+    unsigned char level;
+    unsigned char reserved;
+    unsigned int fmt; // Format ID, 0 for a text message
+} log_record_t;
+
+_Static_assert(LOG_MSG_SIZE <= 65535, "record lengths are 16 bits");
+
+static const char *LEVEL_NAMES[] = {"DEBUG", "INFO", "WARN", "ERROR"};
+
+int log_level = LOG_LEVEL_DEFAULT;
+
+// One printf directive, parsed the same way by the gateway and the log process
+typedef struct
+{
+    const char *start; // The '%'
+    const char *mods;  // The length modifier, or the conversion if there is none
+    const char *end;   // Past the conversion
+    char length;       // 'H' for hh, 'q' for ll, the modifier otherwise, 0 if none
+    char conv;
+} log_spec_t;
+
+// Kinds of arguments a record can carry
+enum
+{
+    ARG_NONE,
+    ARG_INT,
+    ARG_UINT,
+    ARG_CHAR,
+    ARG_DOUBLE,
+    ARG_STRING,
+    ARG_POINTER
+};
+
+// Parse the directive at p, the '%'. Returns the kind of its argument, -1 if not supported.
+static int parse_spec(const char *p, log_spec_t *spec)
+{
+    spec->start = p++;
+    while (*p != '\0' && strchr("-+ #0", *p) != NULL)
+        p++;
+    if (*p == '*')
+        p++;
+    while (*p >= '0' && *p <= '9')
+        p++;
+    if (*p == '.')
+    {
+        p++;
+        if (*p == '*')
+            p++;
+        while (*p >= '0' && *p <= '9')
+            p++;
+    }
+
+    spec->mods = p;
+    spec->length = 0;
+    if (*p != '\0' && strchr("hljztL", *p) != NULL)
+    {
+        spec->length = *p++;
+        if ((spec->length == 'h' || spec->length == 'l') && *p == spec->length)
+        {
+            spec->length = spec->length == 'h' ? 'H' : 'q';
+            p++;
+        }
+    }
+    spec->conv = *p;
+    spec->end = *p != '\0' ? p + 1 : p;
+
+    switch (spec->conv)
+    {
+    case '%':
+        return spec->length == 0 ? ARG_NONE : -1;
+    case 'd':
+    case 'i':
+        return spec->length != 'L' ? ARG_INT : -1;
+    case 'o':
+    case 'u':
+    case 'x':
+    case 'X':
+        return spec->length != 'L' ? ARG_UINT : -1;
+    case 'c':
+        return spec->length == 0 ? ARG_CHAR : -1;
+    case 'f':
+    case 'F':
+    case 'e':
+    case 'E':
+    case 'g':
+    case 'G':
+    case 'a':
+    case 'A':
+        return spec->length == 0 || spec->length == 'l' ? ARG_DOUBLE : -1;
+    case 's':
+        return spec->length == 0 ? ARG_STRING : -1;
+    case 'p':
+        return spec->length == 0 ? ARG_POINTER : -1;
+    default:
+        return -1; // %n, %m, wide characters, long double
+    }
+}
+
+// Number of '*' in the directive, each an int argument before the value
+static int spec_stars(const log_spec_t *spec)
+{
+    int stars = 0;
+    for (const char *p = spec->start; p < spec->mods; p++)
+        stars += *p == '*';
+    return stars;
+}
+
+// Take the next 8-byte value of a record. Returns -1 if the data ran out.
+static int take_value(const char **data, const char *end, uint64_t *value)
+{
+    if (end - *data < (ptrdiff_t)sizeof(*value))
+        return -1;
+    memcpy(value, *data, sizeof(*value));
+    *data += sizeof(*value);
+    return 0;
+}
+
+// Decimal digits of value at p. Returns their count.
+static size_t put_decimal(char *p, uint64_t value)
+{
+    char digits[20];
+    size_t n = 0;
+
+    do
+    {
+        digits[n++] = (char)('0' + value % 10);
+        value /= 10;
+    } while (value > 0);
+    for (size_t i = 0; i < n; i++)
+        p[i] = digits[n - 1 - i];
+    return n;
+}
+
+// Format the arguments of a record with its format string, like snprintf.
+// Returns -1 if the record does not match the format.
+static int format_record(char *out, size_t size, const char *fmt, const char *data, size_t len)
+{
+    const char *end = data + len;
+    size_t pos = 0;
+    const char *p = fmt;
+
+    while (*p != '\0' && pos < size - 1)
+    {
+        if (*p != '%')
+        {
+            out[pos++] = *p++;
+            continue;
+        }
+
+        log_spec_t spec;
+        int kind = parse_spec(p, &spec);
+        if (kind < 0)
+            return -1;
+        p = spec.end;
+        if (kind == ARG_NONE)
+        {
+            out[pos++] = '%';
+            continue;
+        }
+
+        // Rebuild the directive with '*' replaced by the values, and with
+        // the integer length the values were widened to
+        char directive[64];
+        size_t d = 0;
+        for (const char *q = spec.start; q < spec.mods && d < sizeof(directive) - 24; q++)
+        {
+            uint64_t star;
+            if (*q != '*')
+            {
+                directive[d++] = *q;
+                continue;
+            }
+            if (take_value(&data, end, &star) != 0)
+                return -1;
+            int n = (int)(int64_t)star;
+            if (q > spec.start && q[-1] == '.' && n < 0)
+                d--; // A negative precision is taken as omitted
+            else
+                d += (size_t)snprintf(directive + d, sizeof(directive) - d, "%d", n);
+        }
+        if (kind == ARG_INT || kind == ARG_UINT)
+        {
+            directive[d++] = 'l';
+            directive[d++] = 'l';
+        }
+        directive[d++] = spec.conv;
+        directive[d] = '\0';
+
+        uint64_t value = 0;
+        const char *text = NULL;
+        if (kind == ARG_STRING)
+        {
+            const char *nul = memchr(data, '\0', (size_t)(end - data));
+            if (nul == NULL)
+                return -1;
+            text = data;
+            data = nul + 1;
+        }
+        else if (take_value(&data, end, &value) != 0)
+        {
+            return -1;
+        }
+
+        size_t room = size - pos;
+        if (spec.mods == spec.start + 1 && (kind == ARG_STRING || spec.conv == 'd' || spec.conv == 'i' || spec.conv == 'u'))
+        {
+            // Plain %d, %u and %s, most of the directives, without snprintf
+            char digits[24];
+            const char *src = digits;
+            size_t n;
+            if (kind == ARG_STRING)
+            {
+                src = text;
+                n = strlen(text);
+            }
+            else if (kind == ARG_INT && (int64_t)value < 0)
+            {
+                digits[0] = '-';
+                n = 1 + put_decimal(digits + 1, 0 - value);
+            }
+            else
+            {
+                n = put_decimal(digits, value);
+            }
+            n = n < room ? n : room - 1;
+            memcpy(out + pos, src, n);
+            pos += n;
+            continue;
+        }
+
+        int n;
+        switch (kind)
+        {
+        case ARG_INT:
+            n = snprintf(out + pos, room, directive, (long long)value);
+            break;
+        case ARG_UINT:
+            n = snprintf(out + pos, room, directive, (unsigned long long)value);
+            break;
+        case ARG_CHAR:
+            n = snprintf(out + pos, room, directive, (int)value);
+            break;
+        case ARG_DOUBLE:
+        {
+            double number;
+            memcpy(&number, &value, sizeof(number));
+            n = snprintf(out + pos, room, directive, number);
+            break;
+        }
+        case ARG_STRING:
+            n = snprintf(out + pos, room, directive, text);
+            break;
+        default:
+            n = snprintf(out + pos, room, directive, (void *)(uintptr_t)value);
+            break;
+        }
+        if (n < 0)
+            return -1;
+        pos += (size_t)n < room ? (size_t)n : room - 1;
+    }
+
+    out[pos] = '\0';
+    return 0;
+}
+
+// Format string of a format ID, NULL if the ID is not in the executable
+static const char *format_of(unsigned int id)
+{
+    size_t image = (size_t)(_end - __executable_start);
+    if (id == 0 || id - 1 >= image || memchr(__executable_start + id - 1, '\0', image - (id - 1)) == NULL)
+        return NULL;
+    return __executable_start + id - 1;
+}
+
+// One record in a ring slot, read in place by the log process
+typedef struct
+{
+    unsigned long long stamp; // clock_mono_ns() when logged, the order of the log file
+    log_record_t rec;
+    char data[LOG_MSG_SIZE];
+} log_slot_t;
+
+// Single-producer single-consumer ring of one thread. Only the owner
+// advances head and only the log process advances tail.
+typedef struct
+{
+    _Atomic unsigned long head;
+    char pad1[64 - sizeof(unsigned long)];
+    _Atomic unsigned long tail;
+    char pad2[64 - sizeof(unsigned long)];
+    atomic_int exited;                // Owner thread gone: reusable once drained
+    log_slot_t slots[LOG_RING_SLOTS];
+} log_ring_t;
+
+// Shared memory between the gateway and the log process
+typedef struct
+{
+    atomic_int ring_count;            // Rings handed out, only grows
+    atomic_int consumer_sleeping;     // The log process waits on wake_fd until a producer writes to it
+    atomic_ulong dropped;             // Messages lost to full rings, not reported in the log yet
+    atomic_uint next_seq;             // Number of the next line, kept across log process restarts
+    _Alignas(64) log_ring_t rings[LOG_MAX_THREADS];
+} log_shared_t;
+
+// The atomics are used by two processes, which lock-based emulation would not cover
+_Static_assert(ATOMIC_INT_LOCK_FREE == 2 && ATOMIC_LONG_LOCK_FREE == 2, "log ring atomics must be lock-free");
+
+static log_shared_t *shared;          // NULL until log_init()
+static int wake_fd = -1;              // eventfd the log process sleeps on
+static int forked;                    // Set in the log process, which does not produce
+static __thread log_ring_t *my_ring;
+static pthread_mutex_t register_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t ring_key;
+static sigset_t wait_mask;            // Signal mask of the log process while it waits
+static volatile sig_atomic_t term_received; // SIGTERM received by the log process
+
+static int shm_fd = -1;               // The shared memory, for log processes started by log_start()
+static char *logger_argv[7];          // Command line of those, NULL until log_start()
+static char logger_args[4][256];
+static pthread_t supervisor;
+static pthread_mutex_t supervisor_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t supervisor_cond = PTHREAD_COND_INITIALIZER;
+static pid_t logger_pid = -1;         // Running log process, -1 while it is being restarted
+static unsigned long long logger_started_ns;
+static int stopping;                  // log_stop() waits for the rings: restart without delay
+static int terminating;               // log_stop() stopped the log process: no more restarts
+static int stopped;                   // No log process left for log_flush() to wait for
+
+// Without the shared rings (before log_init(), or in the log process) messages go to stderr
+static void log_stderr(int level, const char *text)
+{
+    fprintf(stderr, "%s %s %s\n", clock_now_str(),
+            level >= LOG_LEVEL_DEBUG && level <= LOG_LEVEL_ERROR ? LEVEL_NAMES[level] : "?", text);
+}
+
+static void wake_consumer(void)
+{
+    uint64_t one = 1;
+    // Fails only when the counter is saturated, a wakeup is pending then anyway
+    if (write(wake_fd, &one, sizeof(one)) == -1)
+        return;
+}
+
+static void log_term_handler(int sig)
+{
+    (void)sig;
+    term_received = 1;
+}
+
+// Wait for a producer's wakeup, at most timeout_ms
+static void wait_wakeup(int timeout_ms)
+{
+    struct pollfd pfd = {.fd = wake_fd, .events = POLLIN};
+    struct timespec timeout = {.tv_sec = timeout_ms / 1000, .tv_nsec = (timeout_ms % 1000) * 1000000L};
+    uint64_t count;
+
+    if (ppoll(&pfd, 1, &timeout, &wait_mask) > 0 && read(wake_fd, &count, sizeof(count)) == -1)
+        return;
+}
+
+static int rings_empty(void)
+{
+    int nrings = atomic_load_explicit(&shared->ring_count, memory_order_acquire);
+    for (int r = 0; r < nrings && r < LOG_MAX_THREADS; r++)
+    {
+        if (atomic_load_explicit(&shared->rings[r].tail, memory_order_acquire) !=
+            atomic_load_explicit(&shared->rings[r].head, memory_order_acquire))
+            return 0;
+    }
+    return atomic_load_explicit(&shared->dropped, memory_order_relaxed) == 0;
+}
+
+// Output buffer of the log process. Lines are written to the file when it
+// is full, when the oldest has waited LOG_OUT_FLUSH_MS, and when the rings
+// run empty, so a busy log costs one write() per LOG_OUT_BYTES.
+typedef struct
+{
+    int fd;
+    const char *path;
+    unsigned long long size;     // Bytes in the log file
+    size_t len;
+    unsigned long long first_ns; // clock_mono_ns() when the oldest line was added
+    char buf[LOG_OUT_BYTES];
+} log_out_t;
+
+// Time of the lines: the messages' monotonic stamps are moved to the wall
+// clock with an offset taken once per batch, and a second is formatted once
+typedef struct
+{
+    long long mono_to_real_ns;
+    time_t sec;
+    size_t len;
+    char str[CLOCK_STR_SIZE];
+} log_stamp_t;
+
+static log_out_t out = {.fd = -1};
+static log_stamp_t stamp = {.sec = -1};
+static unsigned int seq_num = 1;                  // Number of the next line
+static unsigned long unreleased[LOG_MAX_THREADS]; // Slots taken into the buffer, freed once it is written
+static unsigned long reported_lost;               // Dropped messages noted in the buffer
+
+// Write the output buffer to the log file, rotating it first if it is due
+static void out_flush(void)
+{
+    size_t off = 0;
+
+    if (out.len > 0 && log_rotate_due(out.size, out.len))
+    {
+        // The index is renamed with the file
+        log_index_close();
+        int fd = log_rotate();
+        if (fd != -1)
+        {
+            close(out.fd);
+            out.fd = fd;
+            out.size = 0;
+        }
+        log_index_open(out.path, out.size);
+    }
+
+    while (off < out.len)
+    {
+        ssize_t n = write(out.fd, out.buf + off, out.len - off);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("Failed to write log file");
+            break;
+        }
+        off += (size_t)n;
+    }
+    log_index_written(out.size, off);
+    out.size += off;
+    if (off > 0 && LOG_FDATASYNC && fdatasync(out.fd) == -1)
+        perror("Failed to sync log file");
+    out.len = 0;
+
+    // The lines are in the file: their slots can be reused, and a restarted
+    // log process numbers its lines from here
+    for (int r = 0; r < LOG_MAX_THREADS; r++)
+    {
+        if (unreleased[r] > 0)
+            atomic_fetch_add_explicit(&shared->rings[r].tail, unreleased[r], memory_order_release);
+        unreleased[r] = 0;
+    }
+    if (reported_lost > 0)
+        atomic_fetch_sub_explicit(&shared->dropped, reported_lost, memory_order_relaxed);
+    reported_lost = 0;
+    atomic_store(&shared->next_seq, seq_num);
+}
+
+static void stamp_batch(void)
+{
+    struct timespec real;
+    clock_gettime(CLOCK_REALTIME, &real);
+    stamp.mono_to_real_ns = (long long)real.tv_sec * 1000000000LL + real.tv_nsec - (long long)clock_mono_ns();
+}
+
+// Format the wall-clock second of a message, unless it is the previous one's
+static void stamp_set(unsigned long long mono_ns)
+{
+    time_t sec = (time_t)(((long long)mono_ns + stamp.mono_to_real_ns) / 1000000000LL);
+    if (sec != stamp.sec)
+    {
+        clock_format(sec, stamp.str, sizeof(stamp.str));
+        stamp.len = strlen(stamp.str);
+        stamp.sec = sec;
+    }
+}
+
+// Append "seq time level text\n" to the output buffer
+static void out_line(const char *level, const char *text, size_t len)
+{
+    size_t level_len = strlen(level);
+
+    if (out.len + 10 + stamp.len + level_len + len + 4 > sizeof(out.buf))
+        out_flush();
+    if (out.len == 0)
+        out.first_ns = clock_mono_ns();
+
+    log_index_line(seq_num, (long long)stamp.sec, text, len);
+    char *p = out.buf + out.len;
+    p += put_decimal(p, seq_num++);
+    *p++ = ' ';
+    memcpy(p, stamp.str, stamp.len);
+    p += stamp.len;
+    *p++ = ' ';
+    memcpy(p, level, level_len);
+    p += level_len;
+    *p++ = ' ';
+    memcpy(p, text, len);
+    p += len;
+    *p++ = '\n';
+    out.len = (size_t)(p - out.buf);
+}
+
+// Write a record to the log file, one line per line of the message
+static void write_record(unsigned long long mono_ns, const log_record_t *rec, const char *data)
+{
+    char text[LOG_MSG_SIZE + 1];
+    size_t len;
+
+    if (rec->len > LOG_MSG_SIZE)
+    {
+        // The slots are shared memory, a length is checked before it is used
+        snprintf(text, sizeof(text), "Corrupt log record (%u bytes)", (unsigned int)rec->len);
+        len = strlen(text);
+    }
+    else if (rec->fmt == 0)
+    {
+        len = rec->len;
+        memcpy(text, data, len);
+        text[len] = '\0';
+    }
+    else
+    {
+        const char *fmt = format_of(rec->fmt);
+        if (fmt == NULL || format_record(text, sizeof(text), fmt, data, rec->len) != 0)
+            snprintf(text, sizeof(text), "Undecodable log record (format ID %u, %u bytes)", rec->fmt, (unsigned int)rec->len);
+        len = strlen(text);
+    }
+
+    const char *level = rec->level <= LOG_LEVEL_ERROR ? LEVEL_NAMES[rec->level] : "?";
+    stamp_set(mono_ns);
+    char *line = text;
+    char *end;
+    while ((end = memchr(line, '\n', len - (size_t)(line - text))) != NULL || *line != '\0')
+    {
+        if (end != NULL)
+            *end = '\0';
+        if (*line != '\0')
+            out_line(level, line, strlen(line));
+        if (end == NULL)
+            break;
+        line = end + 1;
+    }
+}
+
+// Write up to LOG_BATCH messages, oldest first across all rings. Returns the number written.
+static int consume_batch(void)
+{
+    int count = 0;
+    int nrings = atomic_load_explicit(&shared->ring_count, memory_order_acquire);
+
+    if (nrings > LOG_MAX_THREADS)
+        nrings = LOG_MAX_THREADS;
+
+    while (count < LOG_BATCH)
+    {
+        log_slot_t *oldest = NULL;
+        int from = -1;
+
+        for (int r = 0; r < nrings; r++)
+        {
+            log_ring_t *ring = &shared->rings[r];
+            unsigned long next = atomic_load_explicit(&ring->tail, memory_order_relaxed) + unreleased[r];
+            if (next == atomic_load_explicit(&ring->head, memory_order_acquire))
+                continue;
+            log_slot_t *slot = &ring->slots[next % LOG_RING_SLOTS];
+            if (oldest == NULL || slot->stamp < oldest->stamp)
+            {
+                oldest = slot;
+                from = r;
+            }
+        }
+        if (oldest == NULL)
+            break;
+
+        if (count == 0)
+            stamp_batch();
+        write_record(oldest->stamp, &oldest->rec, oldest->data);
+        count++;
+        unreleased[from]++;
+    }
 
-// Runs the log process to read from FIFO and write to log file
-void log_process_run(const char *fifo_path, const char *log_file)
+    // Dropped messages are reported in order with the others. The count is
+    // taken off when the note is in the file, so a restart reports it again.
+    unsigned long lost = atomic_load_explicit(&shared->dropped, memory_order_relaxed) - reported_lost;
+    if (lost > 0)
+    {
+        char text[64];
+        log_record_t note = {.level = LOG_LEVEL_WARN, .fmt = 0};
+        note.len = (unsigned short)snprintf(text, sizeof(text), "%lu log messages dropped (log rings full)", lost);
+        stamp_batch();
+        write_record(clock_mono_ns(), &note, text);
+        reported_lost += lost;
+        count++;
+    }
+
+    // Slots are freed when the buffer is written. A thread with half its
+    // ring held that way gets them back now, before it runs out.
+    for (int r = 0; r < nrings; r++)
+    {
+        if (unreleased[r] >= LOG_RING_SLOTS / 2)
+        {
+            out_flush();
+            break;
+        }
+    }
+    return count;
+}
+
+// Runs the log process to drain the shared rings and write to the log file
+void log_process_run(const char *log_file)
 {
     // Ensure the log file directory exists
     char dir_path[256];
@@ -38,129 +678,602 @@ void log_process_run(const char *fifo_path, const char *log_file)
         }
     }
 
-    // Create named pipe FIFO if it doesn't exist
-    if (mkfifo(fifo_path, 0666) == -1 && errno != EEXIST)
-    {
-        perror("Failed to create named pipe fifo in log_process_run");
-        exit(1);
-    }
-
-    // Open FIFO for reading
-    int fifo_fd = open(fifo_path, O_RDONLY);
-    if (fifo_fd == -1)
+    // The rings are inherited from the gateway
+    if (shared == NULL)
     {
-        perror("Failed to open FIFO for reading");
+        fprintf(stderr, "Log rings not set up, log_init() must run before the fork\n");
         exit(1);
     }
 
     // Open log for appending
-    FILE *log_fp = fopen(log_file, "a+");
-    if (log_fp == NULL)
+    out.path = log_file;
+    out.fd = open(log_file, O_RDWR | O_CREAT | O_APPEND, 0666);
+    if (out.fd == -1)
     {
         perror("Failed to open log file");
-        close(fifo_fd);
         exit(1);
     }
 
     // Ensure the file has the correct permissions
-    chmod(log_file, 0666); // Set permissions to match FIFO
+    chmod(log_file, 0666);
+    struct stat st;
+    out.size = fstat(out.fd, &st) == 0 ? (unsigned long long)st.st_size : 0;
+
+    // A log process killed in the middle of a write left a partial line
+    char last;
+    if (out.size > 0 && pread(out.fd, &last, 1, (off_t)out.size - 1) == 1 && last != '\n' &&
+        write(out.fd, "\n", 1) == 1)
+        out.size++;
+
+    // Lines written since the last block of the index are indexed first
+    log_index_open(log_file, out.size);
 
-    // static variable to track number of log entries
-    static unsigned int seq_num = 1;
+    // The gateway handles Ctrl-C, and stops the log process with SIGTERM once
+    // its messages are queued. SIGTERM is only let through while waiting, so
+    // it never interrupts a batch and is never missed before a sleep.
+    sigset_t term;
+    sigemptyset(&term);
+    sigaddset(&term, SIGTERM);
+    signal(SIGINT, SIG_IGN);
+    signal(SIGTERM, log_term_handler);
+    sigprocmask(SIG_BLOCK, &term, &wait_mask);
+    sigdelset(&wait_mask, SIGTERM);
 
-    // Buffer to read log messages from FIFO
-    char buffer[4096]; // Increased buffer size to handle larger reads
-    char *line;
-    char *saveptr = NULL;
-    ssize_t bytes_read;
+    // The compressor thread inherits the mask, SIGTERM stays for this thread
+    log_rotate_start(log_file);
 
-    // Loop to read from FIFO and write to log file
-    while ((bytes_read = read(fifo_fd, buffer, sizeof(buffer) - 1)) > 0)
+    // Numbering goes on from the previous log process
+    seq_num = atomic_load(&shared->next_seq);
+
+    // Loop to drain the rings until the gateway stops the process
+    int napped = 0;
+    while (!term_received)
     {
-        buffer[bytes_read] = '\0';
+        if (consume_batch() > 0)
+        {
+            napped = 0;
+            // Under a steady stream lines wait in the buffer for LOG_OUT_FLUSH_MS at most
+            if (out.len > 0 && clock_mono_ns() - out.first_ns >= LOG_OUT_FLUSH_MS * 1000000ULL)
+                out_flush();
+            continue;
+        }
 
-        // Process each line in the buffer
-        line = strtok_r(buffer, "\n", &saveptr);
-        while (line != NULL)
+        if (!napped)
+        {
+            // More messages are likely after a busy pass: pause without asking
+            // producers for a wakeup, so a steady stream costs them no syscalls
+            wait_wakeup(LOG_NAP_MS);
+            napped = 1;
+        }
+        else
         {
-            // Get current time
-            time_t now;
-            time(&now);
-            char time_str[26];
-            ctime_r(&now, time_str);
-            time_str[strlen(time_str) - 1] = '\0';
+            // Idle: the lines reach the file before the log process sleeps
+            out_flush();
+
+            // Announce the sleep, then look again: a producer that pushed
+            // before seeing the flag would not wake us
+            atomic_store(&shared->consumer_sleeping, 1);
+            if (rings_empty())
+                wait_wakeup(1000);
+            atomic_store(&shared->consumer_sleeping, 0);
+        }
+    }
+
+    // Stopped: write what is left
+    while (consume_batch() > 0)
+        ;
+    out_flush();
+    log_index_close();
+    if (close(out.fd) != 0)
+    {
+        perror("Failed to close log file");
+    }
+    exit(0);
+}
+
+// Runs a log process started by log_start(), which passes the shared memory
+// and the eventfd as inherited descriptors
+void log_process_main(int argc, char *argv[])
+{
+    if (argc != 6 || strcmp(argv[1], LOG_PROCESS_ARG) != 0)
+        return;
 
-            // Write log entry
-            fprintf(log_fp, "%u %s %s\n", seq_num++, time_str, line);
-            fflush(log_fp);
+    // SIGTERM waits for the handler. The log process is stopped, writing what
+    // is queued, when the gateway thread that started it dies.
+    sigset_t term;
+    sigemptyset(&term);
+    sigaddset(&term, SIGTERM);
+    sigprocmask(SIG_BLOCK, &term, NULL);
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+    if (getppid() != (pid_t)atoi(argv[4]))
+        term_received = 1;
 
-            // Get the next line
-            line = strtok_r(NULL, "\n", &saveptr);
+    // Named like the gateway, not after /proc/self/exe
+    const char *name = strrchr(argv[0], '/');
+    prctl(PR_SET_NAME, name != NULL ? name + 1 : argv[0]);
+
+    int fd = atoi(argv[2]);
+    void *map = mmap(NULL, sizeof(log_shared_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+    {
+        perror("Failed to map log shared memory");
+        exit(1);
+    }
+    shared = map;
+    wake_fd = atoi(argv[3]);
+    forked = 1;
+    log_process_run(argv[5]);
+}
+
+static void ring_exit(void *arg)
+{
+    log_ring_t *ring = arg;
+    atomic_store(&ring->exited, 1);
+}
+
+// A forked child, the log process, must not produce into the rings it drains
+static void log_atfork_child(void)
+{
+    forked = 1;
+    my_ring = NULL;
+}
+
+// Set up the shared rings, before the log process is forked
+int log_init(void)
+{
+    char name[64];
+
+    if (shared != NULL)
+        return 0;
+
+    // The name only lives until the mapping is made, so nothing is left
+    // behind after a crash; the log process inherits the mapping, or the
+    // descriptor when it is started by log_start()
+    snprintf(name, sizeof(name), "%s.%d", LOG_SHM_NAME, (int)getpid());
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd == -1)
+    {
+        perror("Failed to create log shared memory");
+        return -1;
+    }
+    shm_unlink(name);
+
+    void *map = MAP_FAILED;
+    if (ftruncate(fd, sizeof(log_shared_t)) == 0)
+        map = mmap(NULL, sizeof(log_shared_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED)
+    {
+        perror("Failed to map log shared memory");
+        close(fd);
+        return -1;
+    }
+
+    wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wake_fd == -1)
+    {
+        perror("Failed to create log wakeup eventfd");
+        munmap(map, sizeof(log_shared_t));
+        close(fd);
+        return -1;
+    }
+
+    pthread_key_create(&ring_key, ring_exit);
+    pthread_atfork(NULL, NULL, log_atfork_child);
+    atexit(log_flush);
+    shm_fd = fd;
+    shared = map;
+    atomic_store(&shared->next_seq, 1);
+    return 0;
+}
+
+// Fork and exec a log process. Other threads of the gateway may hold locks
+// at the fork, so the child only makes async-signal-safe calls before the
+// exec gives it a fresh image.
+static pid_t spawn_logger(void)
+{
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        // Sockets and files of the gateway are not kept open by the log process
+        close_range(3, ~0U, CLOSE_RANGE_CLOEXEC);
+        fcntl(shm_fd, F_SETFD, 0);
+        fcntl(wake_fd, F_SETFD, 0);
+        execv("/proc/self/exe", logger_argv);
+        _exit(127);
+    }
+    return pid;
+}
+
+// Restarts the log process whenever it dies, after a delay that doubles
+// while restarted ones keep dying young
+static void *log_supervisor(void *arg)
+{
+    (void)arg;
+    long delay_ms = LOG_RESTART_MIN_MS;
+    pid_t pid = logger_pid;
+
+    while (1)
+    {
+        int status = 0;
+        while (pid > 0 && waitpid(pid, &status, 0) == -1 && errno == EINTR)
+            ;
+
+        pthread_mutex_lock(&supervisor_mutex);
+        logger_pid = -1;
+        if (terminating)
+            break;
+        if (pid > 0 && clock_mono_ns() - logger_started_ns >= LOG_RESTART_STABLE_MS * 1000000ULL)
+            delay_ms = LOG_RESTART_MIN_MS;
+
+        // Queued here, written by the next log process
+        if (pid > 0 && WIFSIGNALED(status))
+            log_warn("Log process killed by signal %d, restarting it in %ld ms", WTERMSIG(status), delay_ms);
+        else if (pid > 0)
+            log_warn("Log process exited with status %d, restarting it in %ld ms", WEXITSTATUS(status), delay_ms);
+
+        // log_stop() cuts the delay short, the rings are written before the gateway exits
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += delay_ms / 1000;
+        deadline.tv_nsec += (delay_ms % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L)
+        {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
         }
+        while (!stopping && pthread_cond_timedwait(&supervisor_cond, &supervisor_mutex, &deadline) != ETIMEDOUT)
+            ;
+        if (terminating)
+            break;
+
+        pid = spawn_logger();
+        int spawn_errno = errno;
+        logger_pid = pid;
+        logger_started_ns = clock_mono_ns();
+        pthread_mutex_unlock(&supervisor_mutex);
+
+        metrics_add(METRIC_LOG_RESTARTS, 1);
+        if (pid == -1)
+            log_error("Failed to restart the log process: %s", strerror(spawn_errno));
+        delay_ms = delay_ms * 2 < LOG_RESTART_MAX_MS ? delay_ms * 2 : LOG_RESTART_MAX_MS;
     }
 
-    // If read fails or EOF, exit
-    if (bytes_read == -1)
+    pthread_mutex_unlock(&supervisor_mutex);
+    return NULL;
+}
+
+// Start the log process and its supervisor thread
+int log_start(const char *log_file)
+{
+    if (log_init() != 0)
+        return -1;
+
+    snprintf(logger_args[0], sizeof(logger_args[0]), "%d", shm_fd);
+    snprintf(logger_args[1], sizeof(logger_args[1]), "%d", wake_fd);
+    snprintf(logger_args[2], sizeof(logger_args[2]), "%d", (int)getpid());
+    snprintf(logger_args[3], sizeof(logger_args[3]), "%s", log_file);
+    logger_argv[0] = program_invocation_name;
+    logger_argv[1] = LOG_PROCESS_ARG;
+    for (int i = 0; i < 4; i++)
+        logger_argv[2 + i] = logger_args[i];
+    logger_argv[6] = NULL;
+
+    logger_pid = spawn_logger();
+    if (logger_pid == -1)
     {
-        perror("Error reading from FIFO");
-        log_event("FIFO read error, shutting down log process\n");
+        perror("Failed to fork log process");
+        return -1;
     }
+    logger_started_ns = clock_mono_ns();
 
-    // Clean up
-    if (fclose(log_fp) != 0)
+    if (pthread_create(&supervisor, NULL, log_supervisor, NULL) != 0)
     {
-        perror("Failed to close log file");
+        perror("Failed to start log process supervisor");
+        return -1;
+    }
+    return 0;
+}
+
+// Write the queued messages, then stop the log process and its supervisor
+void log_stop(void)
+{
+    if (logger_argv[0] == NULL || stopped)
+        return;
+
+    // A log process being restarted is started at once
+    pthread_mutex_lock(&supervisor_mutex);
+    stopping = 1;
+    pthread_cond_signal(&supervisor_cond);
+    pthread_mutex_unlock(&supervisor_mutex);
+
+    log_flush();
+
+    pthread_mutex_lock(&supervisor_mutex);
+    terminating = 1;
+    if (logger_pid > 0)
+        kill(logger_pid, SIGTERM);
+    pthread_mutex_unlock(&supervisor_mutex);
+    pthread_join(supervisor, NULL);
+    stopped = 1;
+}
+
+// Ring of the calling thread, registered on its first message
+static log_ring_t *get_ring(void)
+{
+    if (my_ring != NULL)
+        return my_ring;
+
+    pthread_mutex_lock(&register_mutex);
+    int count = atomic_load(&shared->ring_count);
+    for (int r = 0; r < count && my_ring == NULL; r++)
+    {
+        // Reuse the drained ring of a thread that exited
+        log_ring_t *ring = &shared->rings[r];
+        if (atomic_load(&ring->exited) && atomic_load(&ring->tail) == atomic_load(&ring->head))
+        {
+            my_ring = ring;
+            atomic_store(&my_ring->exited, 0);
+        }
     }
-    if (close(fifo_fd) != 0)
+    if (my_ring == NULL && count < LOG_MAX_THREADS)
     {
-        perror("Failed to close FIFO");
+        my_ring = &shared->rings[count];
+        atomic_store_explicit(&shared->ring_count, count + 1, memory_order_release);
     }
+    pthread_mutex_unlock(&register_mutex);
 
-    exit(0);
+    if (my_ring != NULL)
+        pthread_setspecific(ring_key, my_ring);
+    return my_ring;
+}
+
+// Next free slot of the calling thread's ring, NULL (and counted as dropped) if there is none
+static log_slot_t *reserve_slot(log_ring_t **ring_out)
+{
+    log_ring_t *ring = get_ring();
+    if (ring == NULL ||
+        atomic_load_explicit(&ring->head, memory_order_relaxed) -
+                atomic_load_explicit(&ring->tail, memory_order_acquire) == LOG_RING_SLOTS)
+    {
+        atomic_fetch_add_explicit(&shared->dropped, 1, memory_order_relaxed);
+        metrics_add(METRIC_LOG_DROPPED, 1);
+        return NULL;
+    }
+
+    *ring_out = ring;
+    return &ring->slots[atomic_load_explicit(&ring->head, memory_order_relaxed) % LOG_RING_SLOTS];
+}
+
+// Hand the filled slot to the log process
+static void publish_slot(log_ring_t *ring, log_slot_t *slot)
+{
+    unsigned long head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    slot->stamp = clock_mono_ns();
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+
+    // Only the first message after an idle period pays for a wakeup, or one
+    // that fills half the ring while the log process naps. The fence pairs
+    // with the log process announcing its sleep before it checks the rings.
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&shared->consumer_sleeping, memory_order_relaxed) ||
+        head + 1 - atomic_load_explicit(&ring->tail, memory_order_relaxed) == LOG_RING_SLOTS / 2)
+        wake_consumer();
 }
 
-// Sends a log message to the FIFO
+// Sends a log message to the log process, at LOG_LEVEL_INFO
 void log_event(const char *msg)
 {
-    static int fifo_fd = -1;
-    static pthread_mutex_t log_mutex = PTHREAD_MUTEX_INITIALIZER;
+    if (LOG_LEVEL_INFO < log_level)
+        return;
 
-    if (pthread_mutex_lock(&log_mutex) != 0)
+    if (shared == NULL || forked)
     {
-        perror("Log mutex lock failed");
+        log_stderr(LOG_LEVEL_INFO, msg);
         return;
     }
 
-    // Initialize FIFO if not already open
-    if (fifo_fd == -1)
+    log_ring_t *ring;
+    log_slot_t *slot = reserve_slot(&ring);
+    if (slot == NULL)
+        return;
+
+    // Truncated like a line of the log file
+    size_t len = strnlen(msg, LOG_MSG_SIZE - 1);
+    memcpy(slot->data, msg, len);
+    slot->rec.len = (unsigned short)len;
+    slot->rec.level = LOG_LEVEL_INFO;
+    slot->rec.fmt = 0;
+    publish_slot(ring, slot);
+}
+
+// Append an 8-byte value to a record. Returns -1 if it does not fit.
+static int put_value(log_slot_t *slot, uint64_t value)
+{
+    if (slot->rec.len + sizeof(value) > LOG_MSG_SIZE)
+        return -1;
+    memcpy(slot->data + slot->rec.len, &value, sizeof(value));
+    slot->rec.len += sizeof(value);
+    return 0;
+}
+
+// Next integer argument of a directive with the given length, after its conversion
+static int64_t signed_arg(va_list *ap, char length)
+{
+    if (length == 'H')
+        return (signed char)va_arg(*ap, int);
+    if (length == 'h')
+        return (short)va_arg(*ap, int);
+    if (length == 'l')
+        return va_arg(*ap, long);
+    if (length == 'q')
+        return va_arg(*ap, long long);
+    if (length == 'j')
+        return va_arg(*ap, intmax_t);
+    if (length == 'z')
+        return va_arg(*ap, ssize_t);
+    if (length == 't')
+        return va_arg(*ap, ptrdiff_t);
+    return va_arg(*ap, int);
+}
+
+static uint64_t unsigned_arg(va_list *ap, char length)
+{
+    if (length == 'H')
+        return (unsigned char)va_arg(*ap, unsigned int);
+    if (length == 'h')
+        return (unsigned short)va_arg(*ap, unsigned int);
+    if (length == 'l')
+        return va_arg(*ap, unsigned long);
+    if (length == 'q')
+        return va_arg(*ap, unsigned long long);
+    if (length == 'j')
+        return va_arg(*ap, uintmax_t);
+    if (length == 'z')
+        return va_arg(*ap, size_t);
+    if (length == 't')
+        return (uint64_t)va_arg(*ap, ptrdiff_t);
+    return va_arg(*ap, unsigned int);
+}
+
+// Copy the arguments of fmt into the record. Returns -1 if a directive is not
+// supported or the arguments do not fit.
+static int encode_args(log_slot_t *slot, const char *fmt, va_list *ap)
+{
+    const char *p = fmt;
+
+    slot->rec.len = 0;
+    while ((p = strchr(p, '%')) != NULL)
     {
-        // Open FIFO in read-write mode so writer doesn't fail if no reader is attached
-        fifo_fd = open(LOG_FIFO, O_RDWR | O_NONBLOCK);
-        if (fifo_fd == -1)
+        log_spec_t spec;
+        int kind = parse_spec(p, &spec);
+        if (kind < 0)
+            return -1;
+        p = spec.end;
+
+        for (int i = spec_stars(&spec); i > 0; i--)
+        {
+            if (put_value(slot, (uint64_t)(int64_t)va_arg(*ap, int)) != 0)
+                return -1;
+        }
+
+        int64_t number = 0;
+        switch (kind)
+        {
+        case ARG_NONE:
+            continue;
+        case ARG_INT:
+            number = signed_arg(ap, spec.length);
+            break;
+        case ARG_UINT:
+            number = (int64_t)unsigned_arg(ap, spec.length);
+            break;
+        case ARG_CHAR:
+            number = va_arg(*ap, int);
+            break;
+        case ARG_DOUBLE:
+        {
+            double d = va_arg(*ap, double);
+            memcpy(&number, &d, sizeof(number));
+            break;
+        }
+        case ARG_POINTER:
+            number = (int64_t)(uintptr_t)va_arg(*ap, void *);
+            break;
+        case ARG_STRING:
         {
-            perror("Failed to open FIFO for writing");
-            pthread_mutex_unlock(&log_mutex);
-            return;
+            const char *text = va_arg(*ap, const char *);
+            if (text == NULL)
+                text = "(null)";
+            size_t len = strnlen(text, LOG_MSG_SIZE) + 1;
+            if (slot->rec.len + len > LOG_MSG_SIZE)
+                return -1;
+            memcpy(slot->data + slot->rec.len, text, len - 1);
+            slot->data[slot->rec.len + len - 1] = '\0';
+            slot->rec.len += (unsigned short)len;
+            continue;
         }
+        }
+        if (put_value(slot, (uint64_t)number) != 0)
+            return -1;
     }
+    return 0;
+}
+
+// Sends a message with its arguments, formatted by the log process
+void log_eventf(int level, const char *fmt, ...)
+{
+    if (level < log_level)
+        return;
 
-    // Create message with newline
-    char msg_with_newline[256];
-    snprintf(msg_with_newline, sizeof(msg_with_newline), "%s\n", msg);
+    va_list ap;
+    va_start(ap, fmt);
 
-    // Write message to FIFO
-    if (fifo_fd != -1)
+    if (shared == NULL || forked)
     {
-        ssize_t bytes_written = write(fifo_fd, msg_with_newline, strlen(msg_with_newline));
-        if (bytes_written == -1)
-        {
-            perror("Failed to write to FIFO");
-        }
+        char text[LOG_MSG_SIZE];
+        vsnprintf(text, sizeof(text), fmt, ap);
+        va_end(ap);
+        log_stderr(level, text);
+        return;
+    }
+
+    log_ring_t *ring;
+    log_slot_t *slot = reserve_slot(&ring);
+    if (slot == NULL)
+    {
+        va_end(ap);
+        return;
     }
 
-    if (pthread_mutex_unlock(&log_mutex) != 0)
+    va_list copy;
+    va_copy(copy, ap);
+
+    // A format outside the executable has no ID the log process can resolve
+    int in_image = fmt >= __executable_start && fmt < _end;
+    if (in_image && encode_args(slot, fmt, &ap) == 0)
+    {
+        slot->rec.fmt = (unsigned int)(fmt - __executable_start) + 1;
+    }
+    else
     {
-        perror("Log mutex unlock failed");
+        // Format here instead, truncated like a line of the log file
+        int n = vsnprintf(slot->data, LOG_MSG_SIZE, fmt, copy);
+        slot->rec.len = n < 0 ? 0 : (unsigned short)(n < LOG_MSG_SIZE ? n : LOG_MSG_SIZE - 1);
+        slot->rec.fmt = 0;
+    }
+    slot->rec.level = (unsigned char)level;
+    va_end(copy);
+    va_end(ap);
+
+    publish_slot(ring, slot);
+}
+
+// Wait until the messages logged so far were written by the log process
+void log_flush(void)
+{
+    if (shared == NULL || forked || stopped)
         return;
+
+    // Slots are freed once their lines are in the file
+    unsigned long long deadline = clock_mono_ns() + LOG_FLUSH_TIMEOUT_MS * 1000000ULL;
+    while (!rings_empty() && clock_mono_ns() < deadline)
+    {
+        wake_consumer();
+        usleep(100);
+    }
+}
+
+// Set the runtime threshold by name
+int log_set_level(const char *name)
+{
+    for (int level = LOG_LEVEL_DEBUG; level <= LOG_LEVEL_ERROR; level++)
+    {
+        if (strcasecmp(name, LEVEL_NAMES[level]) == 0)
+        {
+            log_level = level;
+            return 0;
+        }
     }
-}
\ No newline at end of file
+    return -1;
+}
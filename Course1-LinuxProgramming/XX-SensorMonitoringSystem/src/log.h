@@ -1,7 +1,23 @@
 /** @file log.h
  *  @brief Declarations for logging functions
  *
- *  Defines functions for the log process and sending log events via FIFO
+ *  Defines functions for the log process and sending log events to it.
+ *  Each thread queues its messages in a ring of its own, without locks or
+ *  syscalls. The rings live in shared memory set up by log_init() before
+ *  the log process is forked, and the log process reads the messages
+ *  from them in place, sleeping on an eventfd when they are empty.
+ *  log_eventf() queues its format and raw arguments, and the log process
+ *  formats them, so the calling thread does not pay for snprintf.
+ *
+ *  log_start() runs the log process as a fresh exec of the gateway and
+ *  restarts it, with a growing delay, whenever it dies. Messages wait in
+ *  the rings meanwhile, and a message leaves its ring only once its line
+ *  is in the log file, so a restart loses nothing the rings could hold:
+ *  a message that finds its ring full is dropped, and counted in a note.
+ *
+ *  Messages have a level. log_debug() and the other level macros test
+ *  the runtime threshold before anything is queued, and levels below
+ *  LOG_MIN_LEVEL are removed at compile time.
  *
  *  @author Phuc
  *  @bug No known bugs.
@@ -10,13 +26,89 @@
 #ifndef LOG_PROCESS_H
 #define LOG_PROCESS_H
 
-#define LOG_FIFO "/tmp/logFifo" // Default FIFO name
+#define LOG_SHM_NAME "/sensor_gateway_log" // Shared memory of the rings, suffixed with the pid while it is set up
 #define LOG_FIFO_PATH "logs/gateway.log"
 
-// Runs the log process to read from FIFO and write to log file
-void log_process_run(const char *fifo_path, const char *log_file);
+#define LOG_MSG_SIZE 256          // Longer messages are truncated
+#define LOG_RING_SLOTS 512        // Messages a thread can queue before new ones are dropped
+#define LOG_MAX_THREADS 32        // Threads with a ring; rings of exited threads are reused
+#define LOG_BATCH 64              // Messages the log process takes from the rings per pass
+#define LOG_NAP_MS 2              // Log process pause after a busy pass, producers do not wake it
+#define LOG_FLUSH_TIMEOUT_MS 1000 // Longest wait of log_flush()
+#define LOG_OUT_BYTES 65536       // Output buffer of the log process, written to the file when full
+#define LOG_OUT_FLUSH_MS 200      // Longest time a line stays in the output buffer while messages keep coming
+
+#define LOG_PROCESS_ARG "--log-process" // argv[1] of a log process started by log_start()
+#define LOG_RESTART_MIN_MS 100          // Delay before a log process that died is restarted
+#define LOG_RESTART_MAX_MS 10000        // The delay doubles while restarted log processes keep dying, up to this
+#define LOG_RESTART_STABLE_MS 30000     // A log process that ran this long starts the delay over
+
+// 1: fdatasync() the log file after every write of the buffer, so written lines survive a power loss
+#ifndef LOG_FDATASYNC
+#define LOG_FDATASYNC 0
+#endif
+
+// Message levels, lowest first
+#define LOG_LEVEL_DEBUG 0 // Per-reading tracing
+#define LOG_LEVEL_INFO 1
+#define LOG_LEVEL_WARN 2
+#define LOG_LEVEL_ERROR 3
+
+#define LOG_LEVEL_DEFAULT LOG_LEVEL_INFO // Runtime threshold unless the LOG_LEVEL environment variable is set
+
+// Calls below this level are compiled out (make LOG_MIN_LEVEL=1 for production builds)
+#ifndef LOG_MIN_LEVEL
+#define LOG_MIN_LEVEL LOG_LEVEL_DEBUG
+#endif
+
+// Runtime threshold: messages below it are discarded before any formatting
+extern int log_level;
+
+// Set up the shared rings. Call once before forking the log process; until
+// then, and in the log process itself, messages are written to stderr.
+// Returns -1 on error.
+int log_init(void);
 
-// Sends a log message to the FIFO
+// Set up the rings, start the log process writing to log_file, and a thread
+// that restarts it whenever it dies. Returns -1 on error.
+int log_start(const char *log_file);
+
+// Write the queued messages and stop the log process started by log_start()
+void log_stop(void);
+
+// Runs the log process instead of returning if argv is that of one started
+// by log_start(). Call first in main().
+void log_process_main(int argc, char *argv[]);
+
+// Runs the log process to drain the rings and write to log file. Exits on SIGTERM once
+// the queued messages are written.
+void log_process_run(const char *log_file);
+
+// Sends a log message to the log process, at LOG_LEVEL_INFO
 void log_event(const char *msg);
 
+// Sends a printf-style message, formatted by the log process. fmt should be
+// a string literal: only its position in the executable is queued. Other
+// formats, and %n, %m, wide characters and long double, are formatted here.
+void log_eventf(int level, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+// Set the runtime threshold by name: debug, info, warn or error. Returns -1 for an unknown name.
+int log_set_level(const char *name);
+
+// The first test is a constant, so calls below LOG_MIN_LEVEL leave no code
+#define LOG_AT(level, ...)                                    \
+    do                                                        \
+    {                                                         \
+        if ((level) >= LOG_MIN_LEVEL && (level) >= log_level) \
+            log_eventf((level), __VA_ARGS__);                 \
+    } while (0)
+
+#define log_debug(...) LOG_AT(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#define log_info(...) LOG_AT(LOG_LEVEL_INFO, __VA_ARGS__)
+#define log_warn(...) LOG_AT(LOG_LEVEL_WARN, __VA_ARGS__)
+#define log_error(...) LOG_AT(LOG_LEVEL_ERROR, __VA_ARGS__)
+
+// Wait until the messages logged so far were written by the log process, also run at exit
+void log_flush(void);
+
 #endif /* LOG_PROCESS_H */
@@ -0,0 +1,284 @@
+/** @file log_index.c
+ *  @brief Implementation of the log file index
+ *
+ *  The log process keeps two sets of counts: the lines in its output
+ *  buffer, and the block being filled, which only takes lines once they
+ *  were written. A block ends on a write, so it always ends on a line.
+ *
+ *  An entry is appended when its block is closed. On open, a torn last
+ *  entry is cut off, and the lines after the last block, left by a log
+ *  process that stopped before closing it, are read back from the log
+ *  file. An index that points past the end of its log file belongs to an
+ *  older file and is started over.
+ *
+ *  @author Phuc
+ *  @bug No known bugs.
+ */
+
+#define _GNU_SOURCE // strptime()
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "log_index.h"
+#include "clock_service.h"
+
+#define LINE_TIME_LEN (CLOCK_STR_SIZE - 2) // "Mon Apr 14 01:09:30 2025" in a line
+
+static int index_fd = -1;
+static log_index_entry_t block;   // Written lines not in an entry yet, open while bytes > 0
+static log_index_entry_t pending; // Lines in the output buffer of the log process
+
+// Add the counts of src to dst, leaving dst's place in the file
+static void merge_counts(log_index_entry_t *dst, const log_index_entry_t *src)
+{
+    if (src->lines == 0)
+        return;
+    if (dst->lines == 0)
+    {
+        dst->first_seq = src->first_seq;
+        dst->min_time = src->min_time;
+        dst->max_time = src->max_time;
+    }
+    dst->last_seq = src->last_seq;
+    dst->min_time = src->min_time < dst->min_time ? src->min_time : dst->min_time;
+    dst->max_time = src->max_time > dst->max_time ? src->max_time : dst->max_time;
+    dst->lines += src->lines;
+    for (size_t i = 0; i < sizeof(dst->sensors); i++)
+        dst->sensors[i] |= src->sensors[i];
+}
+
+static void write_block(void)
+{
+    if (block.bytes > 0 && write(index_fd, &block, sizeof(block)) != (ssize_t)sizeof(block))
+        perror("Failed to write log index");
+    memset(&block, 0, sizeof(block));
+}
+
+// Index the lines of the log file from start to size, written before the index was opened
+static void catch_up(const char *log_path, unsigned long long start, unsigned long long size)
+{
+    char buffer[65536];
+    size_t held = 0;
+    int fd = open(log_path, O_RDONLY);
+
+    if (fd == -1)
+        return;
+    while (start < size)
+    {
+        ssize_t n = pread(fd, buffer + held, sizeof(buffer) - held, (off_t)(start + held));
+        if (n <= 0)
+            break;
+        held += (size_t)n;
+
+        char *line = buffer;
+        char *nl;
+        while ((nl = memchr(line, '\n', held - (size_t)(line - buffer))) != NULL)
+        {
+            log_line_t parsed;
+            if (log_index_parse(line, (size_t)(nl - line), &parsed) == 0)
+                log_index_line(parsed.seq, parsed.time, parsed.text, parsed.len);
+            log_index_written(start, (unsigned long long)(nl - line) + 1);
+            start += (unsigned long long)(nl - line) + 1;
+            line = nl + 1;
+        }
+
+        // A line longer than the buffer is skipped
+        held -= (size_t)(line - buffer);
+        if (held == sizeof(buffer))
+        {
+            log_index_written(start, held);
+            start += held;
+            held = 0;
+        }
+        memmove(buffer, line, held);
+    }
+    close(fd);
+}
+
+int log_index_open(const char *log_path, unsigned long long size)
+{
+    char path[512];
+    struct stat st;
+    log_index_header_t header = {LOG_INDEX_MAGIC, LOG_INDEX_VERSION, sizeof(log_index_entry_t)};
+    log_index_header_t found = {0};
+    unsigned long long start = 0;
+
+    snprintf(path, sizeof(path), "%s%s", log_path, LOG_INDEX_SUFFIX);
+    index_fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0666);
+    if (index_fd == -1 || fstat(index_fd, &st) == -1)
+    {
+        perror("Failed to open log index");
+        if (index_fd != -1)
+            close(index_fd);
+        index_fd = -1;
+        return -1;
+    }
+    chmod(path, 0666);
+    memset(&block, 0, sizeof(block));
+
+    off_t entries = st.st_size >= (off_t)sizeof(header) ? (st.st_size - (off_t)sizeof(header)) / (off_t)sizeof(block) : 0;
+    if (pread(index_fd, &found, sizeof(found), 0) == (ssize_t)sizeof(found) && memcmp(&found, &header, sizeof(header)) == 0)
+    {
+        log_index_entry_t last;
+        if (entries > 0 && pread(index_fd, &last, sizeof(last), (off_t)sizeof(header) + (entries - 1) * (off_t)sizeof(last)) == (ssize_t)sizeof(last))
+            start = last.offset + last.bytes;
+        if (start > size)
+            entries = 0;
+    }
+    else
+    {
+        entries = -1;
+    }
+
+    if (entries <= 0)
+        start = 0;
+    if (ftruncate(index_fd, entries >= 0 ? (off_t)sizeof(header) + entries * (off_t)sizeof(block) : 0) == -1 ||
+        (entries < 0 && write(index_fd, &header, sizeof(header)) != (ssize_t)sizeof(header)))
+    {
+        perror("Failed to reset log index");
+        close(index_fd);
+        index_fd = -1;
+        return -1;
+    }
+
+    if (start < size)
+        catch_up(log_path, start, size);
+    return 0;
+}
+
+void log_index_line(unsigned int seq, long long time, const char *text, size_t len)
+{
+    int ids[LOG_INDEX_MAX_IDS];
+    int count = log_index_sensor_ids(text, len, ids);
+
+    if (pending.lines == 0)
+    {
+        pending.first_seq = seq;
+        pending.min_time = time;
+        pending.max_time = time;
+    }
+    pending.last_seq = seq;
+    if (time < pending.min_time)
+        pending.min_time = time;
+    if (time > pending.max_time)
+        pending.max_time = time;
+    pending.lines++;
+    for (int i = 0; i < count; i++)
+    {
+        unsigned int bit = (unsigned int)ids[i] % LOG_INDEX_SENSOR_BITS;
+        pending.sensors[bit / 8] |= (unsigned char)(1u << (bit % 8));
+    }
+}
+
+void log_index_written(unsigned long long offset, unsigned long long bytes)
+{
+    if (index_fd == -1)
+    {
+        memset(&pending, 0, sizeof(pending));
+        return;
+    }
+
+    if (block.bytes == 0)
+        block.offset = offset;
+    block.bytes = (unsigned int)(offset + bytes - block.offset);
+    merge_counts(&block, &pending);
+    memset(&pending, 0, sizeof(pending));
+
+    if (block.bytes >= LOG_INDEX_BLOCK_BYTES)
+        write_block();
+}
+
+void log_index_close(void)
+{
+    if (index_fd == -1)
+        return;
+    write_block();
+    close(index_fd);
+    index_fd = -1;
+}
+
+int log_index_sensor_ids(const char *text, size_t len, int *ids)
+{
+    const char *end = text + len;
+    const char *p = text;
+    int count = 0;
+
+    // On the 'n' of "sensor": memchr() is cheaper than memmem() on lines this short
+    while (count < LOG_INDEX_MAX_IDS && end - p >= 4 && (p = memchr(p, 'n', (size_t)(end - p) - 3)) != NULL)
+    {
+        int word = p - text >= 2 && memcmp(p - 1, "ensor", 5) == 0 && (p[-2] == 's' || p[-2] == 'S');
+        p += word ? 4 : 1;
+        if (!word)
+            continue;
+
+        // A few words may come between: "sensor_id=5", "sensor node with 5", "sensor ID 5"
+        const char *q = p;
+        while (q < end && q - p < 12 && (isalpha((unsigned char)*q) || *q == '_' || *q == '=' || *q == ' '))
+            q++;
+        if (q == end || !isdigit((unsigned char)*q))
+            continue;
+
+        long id = 0;
+        while (q < end && isdigit((unsigned char)*q) && id < 100000000)
+            id = id * 10 + (*q++ - '0');
+        ids[count++] = (int)id;
+        p = q;
+    }
+    return count;
+}
+
+int log_index_has_sensor(const log_index_entry_t *entry, int sensor)
+{
+    unsigned int bit = (unsigned int)sensor % LOG_INDEX_SENSOR_BITS;
+    return sensor >= 0 && (entry->sensors[bit / 8] >> (bit % 8)) & 1;
+}
+
+int log_index_parse(const char *line, size_t len, log_line_t *out)
+{
+    // Lines of a second share their timestamp, it is converted once
+    static char cached_str[LINE_TIME_LEN + 1];
+    static long long cached_time;
+    const char *end = line + len;
+    const char *p = line;
+    unsigned int seq = 0;
+
+    if (p == end || !isdigit((unsigned char)*p))
+        return -1;
+    while (p < end && isdigit((unsigned char)*p))
+        seq = seq * 10 + (unsigned int)(*p++ - '0');
+    if (end - p < LINE_TIME_LEN + 2 || *p++ != ' ' || p[LINE_TIME_LEN] != ' ')
+        return -1;
+
+    if (memcmp(p, cached_str, LINE_TIME_LEN) != 0)
+    {
+        char str[LINE_TIME_LEN + 1];
+        struct tm tm = {0};
+        memcpy(str, p, LINE_TIME_LEN);
+        str[LINE_TIME_LEN] = '\0';
+        char *rest = strptime(str, "%a %b %e %H:%M:%S %Y", &tm);
+        if (rest == NULL || *rest != '\0')
+            return -1;
+        tm.tm_isdst = -1;
+        cached_time = (long long)mktime(&tm);
+        memcpy(cached_str, str, sizeof(cached_str));
+    }
+    p += LINE_TIME_LEN + 1;
+
+    // The level, then the message
+    while (p < end && *p != ' ')
+        p++;
+    if (p < end)
+        p++;
+
+    out->seq = seq;
+    out->time = cached_time;
+    out->text = p;
+    out->len = (size_t)(end - p);
+    return 0;
+}
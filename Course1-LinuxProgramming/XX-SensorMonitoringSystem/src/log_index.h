@@ -0,0 +1,91 @@
+/** @file log_index.h
+ *  @brief Sidecar index of the log file
+ *
+ *  The log process indexes gateway.log in gateway.log.idx: the lines are
+ *  grouped in blocks of about LOG_INDEX_BLOCK_BYTES, and each block gets
+ *  one fixed-size entry with its place in the file, the range of its
+ *  line numbers and timestamps, and a bitmap of the sensor IDs its lines
+ *  mention. A search reads the entries, and only the blocks that can
+ *  match: "sensor 17 between 10:00 and 10:05" costs a few seeks.
+ *
+ *  An index follows its log file through rotation. When the file is
+ *  compressed, each block becomes a gzip member of its own and the
+ *  entries of <name>.gz.idx give the members' places in the .gz file,
+ *  so compressed files are searched the same way.
+ *
+ *  The lines of the block being filled are not in the index yet, a
+ *  search reads them from the end of the last block.
+ *
+ *  @author Phuc
+ *  @bug No known bugs.
+ */
+
+#ifndef LOG_INDEX_H
+#define LOG_INDEX_H
+
+#include <stddef.h>
+
+#define LOG_INDEX_SUFFIX ".idx"
+#define LOG_INDEX_BLOCK_BYTES 65536 // A block is closed once it holds this many bytes of lines
+#define LOG_INDEX_SENSOR_BITS 256   // Sensor ID n sets bit n % LOG_INDEX_SENSOR_BITS of its block
+#define LOG_INDEX_MAX_IDS 8         // Sensor IDs taken from one line
+#define LOG_INDEX_MAGIC 0x494c4753u // "SGLI"
+#define LOG_INDEX_VERSION 1
+
+// First bytes of an index file, followed by the entries
+typedef struct
+{
+    unsigned int magic;
+    unsigned short version;
+    unsigned short entry_size; // sizeof(log_index_entry_t)
+} log_index_header_t;
+
+// One block of lines
+typedef struct
+{
+    unsigned long long offset; // Of the block in the log file, or of its gzip member in a .gz file
+    unsigned int bytes;        // Length of the block, or of its gzip member
+    unsigned int lines;
+    unsigned int first_seq;
+    unsigned int last_seq;
+    long long min_time;        // Wall-clock seconds of the lines
+    long long max_time;
+    unsigned char sensors[LOG_INDEX_SENSOR_BITS / 8];
+} log_index_entry_t;
+
+// A line of the log file, split
+typedef struct
+{
+    unsigned int seq;
+    long long time;
+    const char *text;          // Past the level
+    size_t len;
+} log_line_t;
+
+// Open the index of the log file at log_path, which holds size bytes, and
+// index its lines that are not in it yet. Called by the log process.
+// Returns -1 on error: lines are then not indexed.
+int log_index_open(const char *log_path, unsigned long long size);
+
+// Account a line added to the output buffer of the log process
+void log_index_line(unsigned int seq, long long time, const char *text, size_t len);
+
+// The buffered lines were written to the log file at offset, a new block
+// is started once the current one holds LOG_INDEX_BLOCK_BYTES
+void log_index_written(unsigned long long offset, unsigned long long bytes);
+
+// Write the entry of the current block and close the index, before the log file is rotated
+void log_index_close(void);
+
+// Sensor IDs mentioned in a message: the numbers after "sensor", "sensor_id=",
+// "sensor node with"... Fills ids with at most LOG_INDEX_MAX_IDS. Returns their count.
+int log_index_sensor_ids(const char *text, size_t len, int *ids);
+
+// 1 if the block may hold a line about the sensor
+int log_index_has_sensor(const log_index_entry_t *entry, int sensor);
+
+// Split a line of the log file, without its newline. Returns -1 if it is not
+// one. Not thread-safe: the last timestamp converted is cached.
+int log_index_parse(const char *line, size_t len, log_line_t *out);
+
+#endif /* LOG_INDEX_H */
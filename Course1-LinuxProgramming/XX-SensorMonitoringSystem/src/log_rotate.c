@@ -0,0 +1,469 @@
+/** @file log_rotate.c
+ *  @brief Implementation of log file rotation
+ *
+ *  A rotated file is renamed to <log>.<YYYYMMDD-HHMMSS>, with -2, -3...
+ *  appended when the second is taken, so that rotated files sort by age
+ *  in version order. rename() is atomic: a reader opening the log path
+ *  gets the old file or the new one, never a partial file.
+ *
+ *  The compressor writes <name>.gz.tmp, syncs it, renames it to
+ *  <name>.gz and only then removes <name>. A crash at any point leaves
+ *  the plain file, which is compressed again on the next start. It runs
+ *  under SCHED_IDLE, so it only takes CPU time nothing else wants.
+ *
+ *  The index <name>.idx is renamed with its file. When it covers the
+ *  whole file, each block is compressed as a gzip member of its own and
+ *  <name>.gz.idx, written before <name>.gz, gives the members' places.
+ *  Concatenated members are still one gzip file to zcat.
+ *
+ *  @author Phuc
+ *  @bug No known bugs.
+ */
+
+#define _GNU_SOURCE // strverscmp(), SCHED_IDLE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#include "log_rotate.h"
+#include "log_index.h"
+#include "clock_service.h"
+
+static char log_path[256];
+static char log_dir[256];
+static const char *log_base;  // File name part of log_path
+static time_t next_daily;     // Local midnight of the current file's day
+
+static pthread_mutex_t rotate_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t rotate_cond = PTHREAD_COND_INITIALIZER;
+static int rotate_pending;    // Files were rotated since the compressor last looked
+
+// Next local midnight after now
+static time_t next_midnight(time_t now)
+{
+    struct tm tm;
+    localtime_r(&now, &tm);
+    tm.tm_mday++;
+    tm.tm_hour = 0;
+    tm.tm_min = 0;
+    tm.tm_sec = 0;
+    tm.tm_isdst = -1;
+    return mktime(&tm);
+}
+
+// 1 if name is a rotated file of the log, its index, or one being compressed
+static int is_rotated(const char *name)
+{
+    size_t base_len = strlen(log_base);
+
+    return strncmp(name, log_base, base_len) == 0 && name[base_len] == '.' &&
+           name[base_len + 1] >= '0' && name[base_len + 1] <= '9';
+}
+
+static int has_suffix(const char *name, const char *suffix)
+{
+    size_t len = strlen(name);
+    size_t suffix_len = strlen(suffix);
+    return len > suffix_len && strcmp(name + len - suffix_len, suffix) == 0;
+}
+
+// Oldest first: compare the names without their ".gz"
+static int compare_rotated(const void *a, const void *b)
+{
+    char x[256];
+    char y[256];
+    snprintf(x, sizeof(x), "%s", *(char *const *)a);
+    snprintf(y, sizeof(y), "%s", *(char *const *)b);
+    char *gz = strstr(x, ".gz");
+    if (gz != NULL)
+        *gz = '\0';
+    gz = strstr(y, ".gz");
+    if (gz != NULL)
+        *gz = '\0';
+    return strverscmp(x, y);
+}
+
+// Rotated files of the log, oldest first. Returns their number, -1 on error.
+static int list_rotated(char ***names_out)
+{
+    DIR *dir = opendir(log_dir);
+    struct dirent *entry;
+    char **names = NULL;
+    int count = 0;
+    int capacity = 0;
+
+    if (dir == NULL)
+        return -1;
+    while ((entry = readdir(dir)) != NULL)
+    {
+        if (!is_rotated(entry->d_name))
+            continue;
+        // Only this thread compresses, so a .tmp was left by a stopped log process.
+        // An index goes with its file, and is deleted once the file is gone.
+        char path[512];
+        snprintf(path, sizeof(path), "%s/%s", log_dir, entry->d_name);
+        if (has_suffix(entry->d_name, ".tmp"))
+        {
+            unlink(path);
+            continue;
+        }
+        if (has_suffix(entry->d_name, LOG_INDEX_SUFFIX))
+        {
+            path[strlen(path) - strlen(LOG_INDEX_SUFFIX)] = '\0';
+            if (access(path, F_OK) == -1 && errno == ENOENT)
+            {
+                strcat(path, LOG_INDEX_SUFFIX);
+                unlink(path);
+            }
+            continue;
+        }
+        if (count == capacity)
+        {
+            capacity = capacity == 0 ? 16 : capacity * 2;
+            char **grown = realloc(names, sizeof(char *) * capacity);
+            if (grown == NULL)
+                break;
+            names = grown;
+        }
+        names[count] = strdup(entry->d_name);
+        if (names[count] != NULL)
+            count++;
+    }
+    closedir(dir);
+
+    if (count > 1)
+        qsort(names, count, sizeof(char *), compare_rotated);
+    *names_out = names;
+    return count;
+}
+
+static int write_all(int fd, const void *data, size_t len)
+{
+    const char *p = data;
+    while (len > 0)
+    {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        p += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+// Append len bytes of in, from offset, to out as one gzip member. Returns its length, -1 on error.
+static long long compress_member(int in, unsigned long long offset, unsigned long long len, int out)
+{
+    unsigned char in_buf[65536];
+    unsigned char out_buf[65536];
+    z_stream zs = {0};
+    long long written = 0;
+    int flush = Z_NO_FLUSH;
+    int rc = Z_OK;
+
+    if (deflateInit2(&zs, LOG_ROTATE_GZIP_LEVEL, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        return -1;
+    while (rc != Z_STREAM_END)
+    {
+        if (zs.avail_in == 0 && flush == Z_NO_FLUSH)
+        {
+            size_t want = len < sizeof(in_buf) ? (size_t)len : sizeof(in_buf);
+            ssize_t n = want > 0 ? pread(in, in_buf, want, (off_t)offset) : 0;
+            if (n < 0 || (n == 0 && want > 0))
+                break;
+            offset += (unsigned long long)n;
+            len -= (unsigned long long)n;
+            zs.next_in = in_buf;
+            zs.avail_in = (unsigned int)n;
+            flush = len == 0 ? Z_FINISH : Z_NO_FLUSH;
+        }
+        zs.next_out = out_buf;
+        zs.avail_out = sizeof(out_buf);
+        rc = deflate(&zs, flush);
+        size_t have = sizeof(out_buf) - zs.avail_out;
+        if (rc == Z_STREAM_ERROR || (have > 0 && write_all(out, out_buf, have) != 0))
+            break;
+        written += (long long)have;
+    }
+    deflateEnd(&zs);
+    return rc == Z_STREAM_END ? written : -1;
+}
+
+// Entries of the index at path if they cover the size bytes of its file, block after block.
+// Returns their number, -1 if there is no such index.
+static int load_index(const char *path, unsigned long long size, log_index_entry_t **entries_out)
+{
+    log_index_header_t header;
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+    log_index_entry_t *entries = NULL;
+    int count = -1;
+
+    if (fd == -1)
+        return -1;
+    if (fstat(fd, &st) == 0 && read(fd, &header, sizeof(header)) == (ssize_t)sizeof(header) &&
+        header.magic == LOG_INDEX_MAGIC && header.version == LOG_INDEX_VERSION &&
+        header.entry_size == sizeof(log_index_entry_t))
+    {
+        count = (int)((st.st_size - (off_t)sizeof(header)) / (off_t)sizeof(log_index_entry_t));
+        entries = malloc(sizeof(log_index_entry_t) * (count > 0 ? count : 1));
+        if (entries == NULL || read(fd, entries, sizeof(log_index_entry_t) * count) != (ssize_t)(sizeof(log_index_entry_t) * count))
+            count = -1;
+        unsigned long long end = 0;
+        for (int i = 0; i < count; i++)
+        {
+            if (entries[i].offset != end)
+                count = -1;
+            else
+                end += entries[i].bytes;
+        }
+        if (end != size)
+            count = -1;
+    }
+    close(fd);
+
+    if (count < 0)
+    {
+        free(entries);
+        return -1;
+    }
+    *entries_out = entries;
+    return count;
+}
+
+// Write an index of the compressed file: synced to tmp, then renamed to path
+static int write_index(const char *tmp, const char *path, const log_index_entry_t *entries, int count)
+{
+    log_index_header_t header = {LOG_INDEX_MAGIC, LOG_INDEX_VERSION, sizeof(log_index_entry_t)};
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+
+    if (fd == -1)
+        return -1;
+    int rc = write_all(fd, &header, sizeof(header)) == 0 &&
+                     write_all(fd, entries, sizeof(log_index_entry_t) * count) == 0 && fsync(fd) == 0
+                 ? 0
+                 : -1;
+    close(fd);
+    if (rc != 0 || rename(tmp, path) == -1)
+    {
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+// Compress dir/name to dir/name.gz, a gzip member per block of its index,
+// then remove it. Returns -1 on error, the plain file is kept then.
+static int compress_file(const char *name)
+{
+    char src[512];
+    char tmp[sizeof(src) + 8];
+    char dst[sizeof(src) + 8];
+    char src_index[sizeof(src) + 8];
+    char tmp_index[sizeof(src) + 16];
+    char dst_index[sizeof(src) + 16];
+    struct stat st;
+    log_index_entry_t *entries = NULL;
+
+    snprintf(src, sizeof(src), "%s/%s", log_dir, name);
+    snprintf(tmp, sizeof(tmp), "%s.gz.tmp", src);
+    snprintf(dst, sizeof(dst), "%s.gz", src);
+    snprintf(src_index, sizeof(src_index), "%s%s", src, LOG_INDEX_SUFFIX);
+    snprintf(tmp_index, sizeof(tmp_index), "%s%s.tmp", dst, LOG_INDEX_SUFFIX);
+    snprintf(dst_index, sizeof(dst_index), "%s%s", dst, LOG_INDEX_SUFFIX);
+
+    int in = open(src, O_RDONLY);
+    if (in == -1)
+        return -1;
+    int out = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (out == -1 || fstat(in, &st) == -1)
+    {
+        fprintf(stderr, "Failed to create %s\n", tmp);
+        if (out != -1)
+            close(out);
+        close(in);
+        return -1;
+    }
+
+    // Without an index covering it, the file is one member
+    int count = load_index(src_index, (unsigned long long)st.st_size, &entries);
+    long long pos = 0;
+    int rc = 0;
+    if (count < 0)
+    {
+        rc = compress_member(in, 0, (unsigned long long)st.st_size, out) < 0 ? -1 : 0;
+    }
+    for (int i = 0; i < count && rc == 0; i++)
+    {
+        long long len = compress_member(in, entries[i].offset, entries[i].bytes, out);
+        entries[i].offset = (unsigned long long)pos;
+        entries[i].bytes = (unsigned int)len;
+        pos += len;
+        rc = len < 0 ? -1 : 0;
+    }
+    close(in);
+
+    // The compressed file and its index are on disk before the plain one goes away
+    rc = rc == 0 && fsync(out) == 0 ? 0 : -1;
+    close(out);
+    if (rc == 0 && count >= 0)
+        rc = write_index(tmp_index, dst_index, entries, count);
+    free(entries);
+    if (rc != 0 || rename(tmp, dst) == -1)
+    {
+        fprintf(stderr, "Failed to compress %s\n", src);
+        unlink(tmp);
+        return -1;
+    }
+    unlink(src);
+    unlink(src_index);
+    return 0;
+}
+
+// Delete the rotated files beyond LOG_ROTATE_KEEP, then compress the plain ones, oldest first
+static void housekeep(void)
+{
+    char **names = NULL;
+    int count = list_rotated(&names);
+    char path[512 + sizeof(LOG_INDEX_SUFFIX)];
+
+    for (int i = 0; i < count; i++)
+    {
+        size_t len = strlen(names[i]);
+        int compressed = len > 3 && strcmp(names[i] + len - 3, ".gz") == 0;
+
+        if (i < count - LOG_ROTATE_KEEP)
+        {
+            snprintf(path, sizeof(path), "%s/%s", log_dir, names[i]);
+            if (unlink(path) == -1 && errno != ENOENT)
+                perror("Failed to delete rotated log file");
+            strcat(path, LOG_INDEX_SUFFIX);
+            unlink(path);
+        }
+        else if (!compressed)
+        {
+            compress_file(names[i]);
+        }
+        free(names[i]);
+    }
+    free(names);
+}
+
+// Compressor thread: looks at the rotated files at start and after each rotation
+static void *log_compressor(void *arg)
+{
+    (void)arg;
+    struct sched_param param = {0};
+    pthread_setschedparam(pthread_self(), SCHED_IDLE, &param);
+
+    pthread_mutex_lock(&rotate_mutex);
+    while (1)
+    {
+        rotate_pending = 0;
+        pthread_mutex_unlock(&rotate_mutex);
+        housekeep();
+        pthread_mutex_lock(&rotate_mutex);
+        while (!rotate_pending)
+            pthread_cond_wait(&rotate_cond, &rotate_mutex);
+    }
+    return NULL;
+}
+
+int log_rotate_start(const char *path)
+{
+    pthread_t thread;
+
+    snprintf(log_path, sizeof(log_path), "%s", path);
+    snprintf(log_dir, sizeof(log_dir), "%s", path);
+    char *slash = strrchr(log_dir, '/');
+    if (slash != NULL)
+    {
+        *slash = '\0';
+        log_base = log_path + (slash - log_dir) + 1;
+    }
+    else
+    {
+        snprintf(log_dir, sizeof(log_dir), ".");
+        log_base = log_path;
+    }
+
+    // The day of an existing file is the day of its last line
+    struct stat st;
+    time_t now = clock_now();
+    next_daily = next_midnight(stat(log_path, &st) == 0 && st.st_size > 0 ? st.st_mtime : now);
+
+    if (pthread_create(&thread, NULL, log_compressor, NULL) != 0)
+    {
+        perror("Failed to start log compressor");
+        return -1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
+
+int log_rotate_due(unsigned long long size, unsigned long long more)
+{
+    if (size == 0)
+        return 0;
+    return size + more > LOG_ROTATE_BYTES || (LOG_ROTATE_DAILY && clock_now() >= next_daily);
+}
+
+// 1 if a rotated file, compressed or not, already has this name
+static int name_taken(const char *name)
+{
+    char gz[512 + 4];
+    snprintf(gz, sizeof(gz), "%s.gz", name);
+    return access(name, F_OK) == 0 || access(gz, F_OK) == 0;
+}
+
+int log_rotate(void)
+{
+    char stamp[32];
+    char name[512];
+    struct tm tm;
+    time_t now = clock_now();
+
+    localtime_r(&now, &tm);
+    strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", &tm);
+    snprintf(name, sizeof(name), "%s.%s", log_path, stamp);
+    for (int n = 2; name_taken(name); n++)
+        snprintf(name, sizeof(name), "%s.%s-%d", log_path, stamp, n);
+
+    if (rename(log_path, name) == -1)
+    {
+        perror("Failed to rotate log file");
+        return -1;
+    }
+    char index_from[sizeof(log_path) + sizeof(LOG_INDEX_SUFFIX)];
+    char index_to[sizeof(name) + sizeof(LOG_INDEX_SUFFIX)];
+    snprintf(index_from, sizeof(index_from), "%s%s", log_path, LOG_INDEX_SUFFIX);
+    snprintf(index_to, sizeof(index_to), "%s%s", name, LOG_INDEX_SUFFIX);
+    rename(index_from, index_to);
+
+    int fd = open(log_path, O_WRONLY | O_CREAT | O_APPEND, 0666);
+    if (fd == -1)
+    {
+        perror("Failed to create log file after rotation");
+        rename(name, log_path);
+        rename(index_to, index_from);
+        return -1;
+    }
+    chmod(log_path, 0666);
+    next_daily = next_midnight(now);
+
+    pthread_mutex_lock(&rotate_mutex);
+    rotate_pending = 1;
+    pthread_cond_signal(&rotate_cond);
+    pthread_mutex_unlock(&rotate_mutex);
+    return fd;
+}
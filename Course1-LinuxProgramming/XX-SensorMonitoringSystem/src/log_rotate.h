@@ -0,0 +1,35 @@
+/** @file log_rotate.h
+ *  @brief Log file rotation declarations
+ *
+ *  The log process rotates the log file when it reaches LOG_ROTATE_BYTES
+ *  and at local midnight. A rotated file is renamed aside and compressed
+ *  with zlib by a background thread of the log process, and only the
+ *  newest LOG_ROTATE_KEEP rotated files are kept.
+ *
+ *  All functions are called from the log process only.
+ *
+ *  @author Phuc
+ *  @bug No known bugs.
+ */
+
+#ifndef LOG_ROTATE_H
+#define LOG_ROTATE_H
+
+#define LOG_ROTATE_BYTES (16ULL * 1024 * 1024) // The log file is rotated before it grows past this size
+#define LOG_ROTATE_DAILY 1                     // 1: also rotate at local midnight
+#define LOG_ROTATE_KEEP 7                      // Rotated files kept, the oldest are deleted
+#define LOG_ROTATE_GZIP_LEVEL 6                // zlib level of rotated files
+
+// Start rotating the log file at path, and the compressor thread. Files left
+// uncompressed by an earlier run are compressed. Returns -1 if the thread
+// could not start: files are still rotated, but not compressed or expired.
+int log_rotate_start(const char *path);
+
+// 1 if the log file, holding size bytes, must be rotated before more bytes are appended
+int log_rotate_due(unsigned long long size, unsigned long long more);
+
+// Rename the log file aside and create a new one. Returns the descriptor of
+// the new file, -1 on error, in which case the old file is still in place.
+int log_rotate(void);
+
+#endif /* LOG_ROTATE_H */
@@ -1,7 +1,7 @@
 /** @file main.c
  *  @brief Implementation of the main process
  *
- *  Initializing the main process, forking the log process,
+ *  Initializing the main process, starting the log process,
  *  and creating the three required threads
  *  (connection manager, data manager, and storage manager)
  *
@@ -15,7 +15,6 @@
 #include <unistd.h>
 #include <errno.h>
 #include <sys/socket.h>
-#include <sys/wait.h>
 #include <pthread.h>
 #include <ctype.h>
 #include <time.h>
@@ -24,14 +23,23 @@
 #include "../include/common.h"
 #include "threads.h"
 #include "keep_alive.h"
+#include "store_queue.h"
+#include "metrics.h"
+#include "alert.h"
+#include "clock_service.h"
+#include "storage_manager.h"
+#include "spool.h"
 
 volatile sig_atomic_t shutdown_flag = 0;
 
 int main(int argc, char *argv[])
 {
+    // A log process started by the gateway runs this executable again
+    log_process_main(argc, argv);
+
     if (argc < 2)
     {
-        fprintf(stderr, "No port provided\nUsage: %s <port number>\n", argv[0]);
+        fprintf(stderr, "No port provided\nUsage: %s <port number> [sqlite|columnar]\n", argv[0]);
         exit(EXIT_FAILURE);
     }
 
@@ -45,121 +53,168 @@ int main(int argc, char *argv[])
         exit(EXIT_FAILURE);
     }
 
-    time_t now = time(NULL);
-    char time_str[26];
-    ctime_r(&now, time_str);
-    time_str[strlen(time_str) - 1] = '\0';
-    printf("%s: Sensor gateway started on port %ld\n", time_str, portNum);
-
-    pid_t log_pid = fork();
-    if (log_pid >= 0)
-    {
-        if (0 == log_pid)
-        {
-            log_process_run(LOG_FIFO, LOG_FIFO_PATH);
-            exit(EXIT_SUCCESS);
-        }
-        else
-        {
-            char msg[256];
-            snprintf(msg, sizeof(msg), "Sensor gateway started on port %d", (int)portNum);
-            log_event(msg);
-
-            sbuffer_t *sb = malloc(sizeof(sbuffer_t));
-            if (sb == NULL)
-            {
-                log_event("Failed to allocate memory for sensor buffer in main");
-                exit(EXIT_FAILURE);
-            }
-
-            if (sbuffer_init(sb, MAX_SENSORS) == -1)
-            {
-                log_event("Failed to initialize sensor buffer in main");
-                free(sb);
-                exit(EXIT_FAILURE);
-            }
-
-            init_threads(sb, (int)portNum);
-
-            if (init_keep_alive() != 0)
-            {
-                log_event("Failed to init_keep_alive in main");
-                sbuffer_free(sb);
-                free(sb);
-                exit(EXIT_FAILURE);
-            }
-
-            if (run_keep_alive() != 0)
-            {
-                log_event("Failed to run_keep_alive in main");
-                sbuffer_free(sb);
-                free(sb);
-                exit(EXIT_FAILURE);
-            }
-
-            log_event("Shutdown");
-
-            pthread_mutex_lock(&conn_mutex);
-            shutdown_flag = 1;
-            pthread_mutex_unlock(&conn_mutex);
-
-            pthread_mutex_lock(&sb->mutex);
-            pthread_cond_broadcast(&sb->not_empty);
-            pthread_cond_broadcast(&sb->not_full);
-            pthread_mutex_unlock(&sb->mutex);
-
-            // Wait longer for threads to exit
-            int max_wait = 10; // Increased to 10 seconds
-            for (int i = 0; i < max_wait * 10; i++)
-            {
-                usleep(100000);
-                int buffer_count = 0;
-                if (sbuffer_count(sb, &buffer_count) == 0 && buffer_count == 0)
-                {
-                    break;
-                }
-            }
-
-            if (pthread_mutex_destroy(&conn_mutex) != 0)
-            {
-                log_event("Failed to destroy conn_mutex in main");
-            }
-
-            if (sbuffer_free(sb) != 0)
-            {
-                log_event("Failed to free sbuffer in main");
-            }
-
-            free(sb);
-
-            if (log_pid > 0)
-            {
-                kill(log_pid, SIGTERM);
-                int status;
-                if (waitpid(log_pid, &status, 0) == -1)
-                {
-                    perror("Failed to wait for log process");
-                    log_event("Failed to wait for log process");
-                }
-                else
-                {
-                    log_event("Log process terminated");
-                }
-            }
-
-            now = time(NULL);
-            ctime_r(&now, time_str);
-            time_str[strlen(time_str) - 1] = '\0';
-            printf("%s: Sensor gateway shut down successfully\n", time_str);
-
-            log_event("Sensor gateway shut down successfully");
-            exit(EXIT_SUCCESS);
-        }
-    }
-    else
-    {
-        perror("fork() failed");
-        log_event("Failed to fork log process");
+    if (storage_set_backend(argc > 2 ? argv[2] : STORE_BACKEND_DEFAULT) != 0)
+    {
+        fprintf(stderr, "Unknown storage backend: %s\n", argv[2]);
+        exit(EXIT_FAILURE);
+    }
+
+    // Messages below the threshold are discarded in the calling thread
+    const char *level = getenv("LOG_LEVEL");
+    if (level != NULL && *level != '\0' && log_set_level(level) != 0)
+    {
+        fprintf(stderr, "Unknown log level: %s (debug, info, warn or error)\n", level);
         exit(EXIT_FAILURE);
     }
-}
\ No newline at end of file
+
+    printf("%s: Sensor gateway started on port %ld\n", clock_now_str(), portNum);
+
+    // The log process is started again whenever it dies, messages wait in the rings meanwhile
+    if (log_start(LOG_FIFO_PATH) != 0)
+    {
+        fprintf(stderr, "Failed to start the log process\n");
+        exit(EXIT_FAILURE);
+    }
+
+    log_info("Sensor gateway started on port %d", (int)portNum);
+
+    sbuffer_t *sb = malloc(sizeof(sbuffer_t));
+    if (sb == NULL)
+    {
+        log_error("Failed to allocate memory for sensor buffer in main");
+        exit(EXIT_FAILURE);
+    }
+
+    if (sbuffer_init(sb, MAX_SENSORS) == -1)
+    {
+        log_error("Failed to initialize sensor buffer in main");
+        free(sb);
+        exit(EXIT_FAILURE);
+    }
+
+    store_queue_t *sq = malloc(sizeof(store_queue_t));
+    if (sq == NULL)
+    {
+        log_error("Failed to allocate memory for storage queue in main");
+        sbuffer_free(sb);
+        free(sb);
+        exit(EXIT_FAILURE);
+    }
+
+    if (store_queue_init(sq, STORE_QUEUE_SIZE) == -1)
+    {
+        log_error("Failed to initialize storage queue in main");
+        free(sq);
+        sbuffer_free(sb);
+        free(sb);
+        exit(EXIT_FAILURE);
+    }
+
+    if (alert_init() != 0)
+    {
+        log_error("Failed to initialize alert dispatch in main");
+        store_queue_free(sq);
+        free(sq);
+        sbuffer_free(sb);
+        free(sb);
+        exit(EXIT_FAILURE);
+    }
+
+    // Readings left over by a crash are replayed by the connection manager
+    if (spool_open(SPOOL_PATH) < 0)
+    {
+        log_error("Failed to open the spool, readings are not protected against crashes");
+    }
+    else if (storage_get_backend()->recover_spool != NULL)
+    {
+        storage_get_backend()->recover_spool();
+    }
+
+    // Before the connection manager tracks its first connection
+    if (init_keep_alive() != 0)
+    {
+        log_error("Failed to init_keep_alive in main");
+        sbuffer_free(sb);
+        free(sb);
+        exit(EXIT_FAILURE);
+    }
+
+    init_threads(sb, sq, (int)portNum);
+
+    if (run_keep_alive() != 0)
+    {
+        log_error("Failed to run_keep_alive in main");
+        sbuffer_free(sb);
+        free(sb);
+        exit(EXIT_FAILURE);
+    }
+
+    log_info("Shutdown");
+
+    pthread_mutex_lock(&conn_mutex);
+    shutdown_flag = 1;
+    pthread_mutex_unlock(&conn_mutex);
+
+    pthread_mutex_lock(&sb->mutex);
+    pthread_cond_broadcast(&sb->not_empty);
+    pthread_cond_broadcast(&sb->not_full);
+    pthread_mutex_unlock(&sb->mutex);
+
+    pthread_mutex_lock(&sq->mutex);
+    pthread_cond_broadcast(&sq->not_empty);
+    pthread_cond_broadcast(&sq->not_full);
+    pthread_mutex_unlock(&sq->mutex);
+
+    alert_wakeup();
+    keep_alive_wakeup();
+
+    // Wait for the connection manager, data manager, storage manager, alert dispatcher
+    // and query server to drain and exit
+    int max_wait = 10; // Increased to 10 seconds
+    for (int i = 0; i < max_wait * 10 && threads_running() > 0; i++)
+    {
+        usleep(100000);
+    }
+
+    if (threads_running() > 0)
+    {
+        // Whatever did not reach storage is still in the spool for the next start.
+        // The threads left may still use the buffers and mutexes, nothing is freed.
+        log_warn("Timed out waiting for threads to drain in main");
+        spool_sync();
+        metrics_report();
+        log_stop();
+
+        printf("%s: Sensor gateway shut down with threads still running\n", clock_now_str());
+        exit(EXIT_FAILURE);
+    }
+
+    spool_close();
+
+    if (pthread_mutex_destroy(&conn_mutex) != 0)
+    {
+        log_error("Failed to destroy conn_mutex in main");
+    }
+
+    if (sbuffer_free(sb) != 0)
+    {
+        log_error("Failed to free sbuffer in main");
+    }
+
+    free(sb);
+
+    if (store_queue_free(sq) != 0)
+    {
+        log_error("Failed to free storage queue in main");
+    }
+
+    free(sq);
+
+    metrics_report();
+
+    // Queued messages reach the log file before the log process is stopped
+    log_stop();
+
+    printf("%s: Sensor gateway shut down successfully\n", clock_now_str());
+    exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,160 @@
+/** @file metrics.c
+ *  @brief Implementation of runtime metrics
+ *
+ *  Counters are plain atomics so that hot paths never take a lock
+ *  to account for their work.
+ *
+ *  @author Phuc
+ *  @bug No known bugs.
+ */
+
+#include <stdio.h>
+#include <stdatomic.h>
+#include "metrics.h"
+#include "log.h"
+
+static atomic_ullong counters[METRIC_COUNT];
+static atomic_ullong histograms[HIST_COUNT][HIST_BUCKETS];
+
+static const char *metric_names[METRIC_COUNT] = {
+    [METRIC_ANOMALY_BATCHES] = "anomaly_batches",
+    [METRIC_ANOMALY_READINGS] = "anomaly_readings",
+    [METRIC_ANOMALY_FLAGGED] = "anomaly_flagged",
+    [METRIC_ANOMALY_NS] = "anomaly_ns",
+    [METRIC_ALERTS_RAISED] = "alerts_raised",
+    [METRIC_ALERTS_COALESCED] = "alerts_coalesced",
+    [METRIC_ALERTS_DROPPED] = "alerts_dropped",
+    [METRIC_STORE_ROWS] = "store_rows",
+    [METRIC_STORE_LATENCY_NS] = "store_latency_ns",
+    [METRIC_STORE_COMMITS] = "store_commits",
+    [METRIC_CHECKPOINTS] = "checkpoints",
+    [METRIC_CHECKPOINT_PAGES] = "checkpoint_pages",
+    [METRIC_CHECKPOINT_NS] = "checkpoint_ns",
+    [METRIC_REORDER_LATE] = "reorder_late",
+    [METRIC_REORDER_DROPPED] = "reorder_dropped",
+    [METRIC_SPOOL_REPLAYED] = "spool_replayed",
+    [METRIC_SPOOL_UNPROTECTED] = "spool_unprotected",
+    [METRIC_COMPACT_ROWS] = "compact_rows",
+    [METRIC_VACUUM_PAGES] = "vacuum_pages",
+    [METRIC_LOG_DROPPED] = "log_dropped",
+    [METRIC_LOG_RESTARTS] = "log_restarts",
+    [METRIC_KEEPALIVE_TIMEOUTS] = "keepalive_timeouts",
+};
+
+static const char *histogram_names[HIST_COUNT] = {
+    [HIST_COMMIT_ROWS] = "commit_rows",
+    [HIST_COMMIT_US] = "commit_us",
+};
+
+// Add a value to a counter
+void metrics_add(metric_id_t id, unsigned long long value)
+{
+    if (id < 0 || id >= METRIC_COUNT)
+        return;
+    atomic_fetch_add_explicit(&counters[id], value, memory_order_relaxed);
+}
+
+// Read the current value of a counter
+unsigned long long metrics_get(metric_id_t id)
+{
+    if (id < 0 || id >= METRIC_COUNT)
+        return 0;
+    return atomic_load_explicit(&counters[id], memory_order_relaxed);
+}
+
+// Record one value in a histogram
+void metrics_observe(histogram_id_t id, unsigned long long value)
+{
+    if (id < 0 || id >= HIST_COUNT)
+        return;
+    int bucket = value == 0 ? 0 : 64 - __builtin_clzll(value);
+    if (bucket >= HIST_BUCKETS)
+        bucket = HIST_BUCKETS - 1;
+    atomic_fetch_add_explicit(&histograms[id][bucket], 1, memory_order_relaxed);
+}
+
+// Upper bound of the bucket holding the given fraction of the samples
+static unsigned long long histogram_quantile(const unsigned long long *buckets, unsigned long long total, double q)
+{
+    unsigned long long seen = 0;
+    for (int b = 0; b < HIST_BUCKETS; b++)
+    {
+        seen += buckets[b];
+        if (seen >= q * total)
+            return b == 0 ? 0 : (1ULL << b) - 1;
+    }
+    return (1ULL << (HIST_BUCKETS - 1)) - 1;
+}
+
+// Log one histogram as "<upper bound>:<count>" for its non-empty buckets
+static void report_histogram(histogram_id_t id)
+{
+    unsigned long long buckets[HIST_BUCKETS];
+    unsigned long long total = 0;
+    char msg[200];
+
+    for (int b = 0; b < HIST_BUCKETS; b++)
+    {
+        buckets[b] = atomic_load_explicit(&histograms[id][b], memory_order_relaxed);
+        total += buckets[b];
+    }
+    if (total == 0)
+        return;
+
+    int len = snprintf(msg, sizeof(msg), "Histogram %s: n=%llu p50<=%llu p99<=%llu", histogram_names[id], total,
+                       histogram_quantile(buckets, total, 0.50), histogram_quantile(buckets, total, 0.99));
+    log_event(msg);
+
+    len = snprintf(msg, sizeof(msg), "Histogram %s:", histogram_names[id]);
+    for (int b = 0; b < HIST_BUCKETS; b++)
+    {
+        if (buckets[b] == 0)
+            continue;
+
+        char entry[48];
+        int entry_len = snprintf(entry, sizeof(entry), " <=%llu:%llu", b == 0 ? 0 : (1ULL << b) - 1, buckets[b]);
+        if (len + entry_len >= (int)sizeof(msg))
+        {
+            log_event(msg);
+            len = snprintf(msg, sizeof(msg), "Histogram %s:", histogram_names[id]);
+        }
+        len += snprintf(msg + len, sizeof(msg) - len, "%s", entry);
+    }
+    log_event(msg);
+}
+
+// Write a summary of all counters and histograms to the log
+void metrics_report(void)
+{
+    // log_event() truncates long messages, so the summary is split over several lines
+    char msg[200];
+    int len = snprintf(msg, sizeof(msg), "Metrics:");
+
+    for (int i = 0; i < METRIC_COUNT; i++)
+    {
+        char entry[64];
+        int entry_len = snprintf(entry, sizeof(entry), " %s=%llu", metric_names[i], metrics_get(i));
+
+        if (len + entry_len >= (int)sizeof(msg))
+        {
+            log_event(msg);
+            len = snprintf(msg, sizeof(msg), "Metrics:");
+        }
+        len += snprintf(msg + len, sizeof(msg) - len, "%s", entry);
+    }
+    log_event(msg);
+
+    // Derived values: average cost of one anomaly batch, average storage latency of one row
+    unsigned long long batches = metrics_get(METRIC_ANOMALY_BATCHES);
+    unsigned long long rows = metrics_get(METRIC_STORE_ROWS);
+    if (batches > 0 || rows > 0)
+    {
+        snprintf(msg, sizeof(msg), "Metrics: anomaly_ns_per_batch=%llu store_latency_ns_per_row=%llu",
+                 batches ? metrics_get(METRIC_ANOMALY_NS) / batches : 0,
+                 rows ? metrics_get(METRIC_STORE_LATENCY_NS) / rows : 0);
+        log_event(msg);
+    }
+
+    for (int h = 0; h < HIST_COUNT; h++)
+        report_histogram(h);
+}
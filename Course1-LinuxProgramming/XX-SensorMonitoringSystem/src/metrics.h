@@ -0,0 +1,63 @@
+/** @file metrics.h
+ *  @brief Runtime metrics declarations
+ *
+ *  Lock-free counters and histograms shared by the pipeline stages
+ *  and periodically reported to the log.
+ *
+ *  @author Phuc
+ *  @bug No known bugs.
+ */
+
+#ifndef METRICS_H
+#define METRICS_H
+
+typedef enum
+{
+    METRIC_ANOMALY_BATCHES,  // Batches processed by the anomaly stage
+    METRIC_ANOMALY_READINGS, // Readings processed by the anomaly stage
+    METRIC_ANOMALY_FLAGGED,  // Readings flagged as anomalous
+    METRIC_ANOMALY_NS,       // Total time spent in the anomaly stage (ns)
+    METRIC_ALERTS_RAISED,    // Alerts queued for dispatch
+    METRIC_ALERTS_COALESCED, // Alerts merged into one already pending
+    METRIC_ALERTS_DROPPED,   // Alerts lost because the alert queue was full
+    METRIC_STORE_ROWS,       // Rows inserted by the storage manager
+    METRIC_STORE_LATENCY_NS, // Total time from storage queue push to commit (ns)
+    METRIC_STORE_COMMITS,    // Transactions committed by the storage manager
+    METRIC_CHECKPOINTS,      // WAL checkpoints run by the checkpoint thread
+    METRIC_CHECKPOINT_PAGES, // Pages copied from the WAL into the database
+    METRIC_CHECKPOINT_NS,    // Total time spent checkpointing (ns)
+    METRIC_REORDER_LATE,     // Readings that arrived out of order and were reordered
+    METRIC_REORDER_DROPPED,  // Readings dropped as too late or stamped in the future
+    METRIC_SPOOL_REPLAYED,   // Readings replayed from the spool at startup
+    METRIC_SPOOL_UNPROTECTED, // Readings accepted without a spool slot
+    METRIC_COMPACT_ROWS,     // Readings moved from partitions into archive blocks
+    METRIC_VACUUM_PAGES,     // Free pages returned by incremental vacuum
+    METRIC_LOG_DROPPED,      // Log messages lost because a thread's log ring was full
+    METRIC_LOG_RESTARTS,     // Log processes restarted after the previous one died
+    METRIC_KEEPALIVE_TIMEOUTS, // Connections that sent nothing for TIMEOUT_SECONDS
+    METRIC_COUNT
+} metric_id_t;
+
+typedef enum
+{
+    HIST_COMMIT_ROWS, // Rows per storage commit (group size)
+    HIST_COMMIT_US,   // Duration of a storage commit, including fsync (us)
+    HIST_COUNT
+} histogram_id_t;
+
+// Power-of-two buckets: bucket 0 counts zeros, bucket b values in [2^(b-1), 2^b)
+#define HIST_BUCKETS 32
+
+// Add a value to a counter
+void metrics_add(metric_id_t id, unsigned long long value);
+
+// Read the current value of a counter
+unsigned long long metrics_get(metric_id_t id);
+
+// Record one value in a histogram
+void metrics_observe(histogram_id_t id, unsigned long long value);
+
+// Write a summary of all counters and histograms to the log
+void metrics_report(void);
+
+#endif /* METRICS_H */
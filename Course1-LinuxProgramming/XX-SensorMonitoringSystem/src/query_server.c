@@ -0,0 +1,498 @@
+/** @file query_server.c
+ *  @brief Implementation of the historical data query server
+ *
+ *  Clients are served one at a time on a read-only connection of their
+ *  own, so queries never block the storage writer (WAL mode). Results
+ *  are formatted into a QUERY_CHUNK_BYTES buffer that is sent whenever
+ *  it fills: no result set is held in memory.
+ *
+ *  With the SQLite backend a query only reads the partitions overlapping
+ *  its range, each through its (id, time) primary key. Aggregates take
+ *  whole buckets from the rollup tables when the step matches a rollup
+ *  width (and whole hours for a plain AGG), and read raw readings only
+ *  for the rest. Readings compacted into the archive table are decoded
+ *  from the blocks overlapping the range. With the columnar backend the
+ *  block index skips blocks outside the range.
+ *
+ *  @author Phuc
+ *  @bug No known bugs.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/time.h>
+#include <sqlite3.h>
+#include "query_server.h"
+#include "../include/common.h"
+#include "log.h"
+#include "threads.h"
+#include "rollup.h"
+#include "storage_manager.h"
+#include "storage_columnar.h"
+
+// Result stream to a client
+typedef struct
+{
+    int fd;
+    size_t len;
+    long long lines;
+    int failed;            // Client gone or too slow, stop producing
+    char buf[QUERY_CHUNK_BYTES];
+} query_out_t;
+
+// Aggregate of the bucket being built
+typedef struct
+{
+    query_out_t *out;
+    int open;
+    time_t start;
+    float min;
+    float max;
+    double sum;
+    long long count;
+} agg_stream_t;
+
+static int send_all(int fd, const char *buf, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t n = send(fd, buf, len, MSG_NOSIGNAL);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        buf += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+static void out_flush(query_out_t *o)
+{
+    if (!o->failed && o->len > 0 && send_all(o->fd, o->buf, o->len) != 0)
+        o->failed = 1;
+    o->len = 0;
+}
+
+static void out_line(query_out_t *o, const char *fmt, ...)
+{
+    char line[160];
+    va_list ap;
+
+    va_start(ap, fmt);
+    int n = vsnprintf(line, sizeof(line), fmt, ap);
+    va_end(ap);
+    if (n < 0 || o->failed)
+        return;
+    if ((size_t)n >= sizeof(line))
+        n = sizeof(line) - 1;
+
+    if (o->len + (size_t)n > sizeof(o->buf))
+        out_flush(o);
+    memcpy(o->buf + o->len, line, (size_t)n);
+    o->len += (size_t)n;
+    o->lines++;
+}
+
+static void agg_emit(agg_stream_t *a)
+{
+    if (a->open && a->count > 0)
+        out_line(a->out, "%ld %.2f %.2f %.3f %lld\n", (long)a->start, a->min, a->max, a->sum / a->count, a->count);
+    a->open = 0;
+}
+
+// Merge a partial aggregate into the stream. Parts arrive in bucket order,
+// so a new bucket start closes the previous bucket.
+static void agg_feed(agg_stream_t *a, time_t start, float min, float max, double sum, long long count)
+{
+    if (count <= 0)
+        return;
+    if (a->open && a->start != start)
+        agg_emit(a);
+    if (!a->open)
+    {
+        a->open = 1;
+        a->start = start;
+        a->min = min;
+        a->max = max;
+        a->sum = 0;
+        a->count = 0;
+    }
+    if (min < a->min)
+        a->min = min;
+    if (max > a->max)
+        a->max = max;
+    a->sum += sum;
+    a->count += count;
+}
+
+// Prepare fmt (%s is the partition name) for each partition overlapping [from, to],
+// oldest first, and pass its rows to row_fn
+static int for_each_partition(sqlite3 *db, time_t from, time_t to, const char *fmt,
+                              int (*bind_fn)(sqlite3_stmt *, void *), void (*row_fn)(sqlite3_stmt *, void *),
+                              void *ctx, query_out_t *out)
+{
+    sqlite3_stmt *parts = NULL;
+    int rc = 0;
+
+    if (sqlite3_prepare_v2(db, "SELECT name FROM partitions WHERE stop > ? AND start <= ? ORDER BY start;",
+                           -1, &parts, NULL) != SQLITE_OK)
+        return -1;
+    sqlite3_bind_int64(parts, 1, (sqlite3_int64)from);
+    sqlite3_bind_int64(parts, 2, (sqlite3_int64)to);
+
+    while (!out->failed && sqlite3_step(parts) == SQLITE_ROW)
+    {
+        const char *name = (const char *)sqlite3_column_text(parts, 0);
+        sqlite3_stmt *stmt = NULL;
+        char *sql = sqlite3_mprintf(fmt, name, name);
+
+        if (sql == NULL || sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK || bind_fn(stmt, ctx) != 0)
+        {
+            sqlite3_free(sql);
+            sqlite3_finalize(stmt);
+            rc = -1;
+            break;
+        }
+        sqlite3_free(sql);
+
+        while (!out->failed && sqlite3_step(stmt) == SQLITE_ROW)
+            row_fn(stmt, ctx);
+        sqlite3_finalize(stmt);
+    }
+
+    sqlite3_finalize(parts);
+    return rc;
+}
+
+// Parameters shared by the per-partition statements
+typedef struct
+{
+    int sensor;
+    time_t from;
+    time_t to;
+    time_t step;           // 0 for a single bucket starting at from
+    query_out_t *out;
+    agg_stream_t *agg;
+} query_t;
+
+static int bind_query(sqlite3_stmt *stmt, void *ctx)
+{
+    query_t *q = ctx;
+    if (sqlite3_bind_int(stmt, 1, q->sensor) != SQLITE_OK ||
+        sqlite3_bind_int64(stmt, 2, (sqlite3_int64)q->from) != SQLITE_OK ||
+        sqlite3_bind_int64(stmt, 3, (sqlite3_int64)q->to) != SQLITE_OK)
+        return -1;
+    if (sqlite3_bind_parameter_count(stmt) >= 4 && sqlite3_bind_int64(stmt, 4, (sqlite3_int64)q->step) != SQLITE_OK)
+        return -1;
+    return 0;
+}
+
+static void range_row(sqlite3_stmt *stmt, void *ctx)
+{
+    query_t *q = ctx;
+    out_line(q->out, "%lld %.2f %d\n", (long long)sqlite3_column_int64(stmt, 0),
+             sqlite3_column_double(stmt, 1), sqlite3_column_int(stmt, 2));
+}
+
+static void agg_row(sqlite3_stmt *stmt, void *ctx)
+{
+    query_t *q = ctx;
+    agg_feed(q->agg, q->step ? (time_t)sqlite3_column_int64(stmt, 0) : q->agg->start,
+             (float)sqlite3_column_double(stmt, 1), (float)sqlite3_column_double(stmt, 2),
+             sqlite3_column_double(stmt, 3), sqlite3_column_int64(stmt, 4));
+}
+
+static int columnar_range_point(const columnar_point_t *p, void *ctx)
+{
+    query_t *q = ctx;
+    out_line(q->out, "%lld %.2f %u\n", (long long)p->timestamp, p->temperature, p->flags);
+    return q->out->failed;
+}
+
+static int columnar_agg_point(const columnar_point_t *p, void *ctx)
+{
+    query_t *q = ctx;
+    time_t start = q->step ? p->timestamp - p->timestamp % q->step : q->agg->start;
+    agg_feed(q->agg, start, p->temperature, p->temperature, p->temperature, 1);
+    return q->out->failed;
+}
+
+// Pass the archived readings of [from, to] to fn, oldest block first
+static int archive_scan(sqlite3 *db, query_t *q, time_t from, time_t to, columnar_scan_fn fn)
+{
+    sqlite3_stmt *stmt = NULL;
+    int rc = 0;
+
+    if (sqlite3_prepare_v2(db, "SELECT block FROM archive WHERE id = ?1 AND stop >= ?2 AND start <= ?3 ORDER BY start;",
+                           -1, &stmt, NULL) != SQLITE_OK)
+        return -1;
+    sqlite3_bind_int(stmt, 1, q->sensor);
+    sqlite3_bind_int64(stmt, 2, (sqlite3_int64)from);
+    sqlite3_bind_int64(stmt, 3, (sqlite3_int64)to);
+
+    while (!q->out->failed && sqlite3_step(stmt) == SQLITE_ROW)
+    {
+        if (columnar_decode_block(sqlite3_column_blob(stmt, 0), (size_t)sqlite3_column_bytes(stmt, 0),
+                                  from, to, fn, q) < 0)
+        {
+            rc = -1;
+            break;
+        }
+    }
+    sqlite3_finalize(stmt);
+    return rc;
+}
+
+static int sqlite_range(sqlite3 *db, query_t *q)
+{
+    // Archived readings are older than the partitions left.
+    // The primary key already orders each partition by time.
+    if (archive_scan(db, q, q->from, q->to, columnar_range_point) != 0)
+        return -1;
+    return for_each_partition(db, q->from, q->to,
+                              "SELECT time, temp, flags FROM %s WHERE id = ?1 AND time BETWEEN ?2 AND ?3 ORDER BY time, seq;",
+                              bind_query, range_row, q, q->out);
+}
+
+// Aggregate raw readings of [from, to]
+static int sqlite_raw_agg(sqlite3 *db, query_t *q, time_t from, time_t to)
+{
+    query_t part = *q;
+    part.from = from;
+    part.to = to;
+    if (from > to)
+        return 0;
+
+    if (archive_scan(db, &part, from, to, columnar_agg_point) != 0)
+        return -1;
+    if (q->step == 0)
+        return for_each_partition(db, from, to,
+                                  "SELECT 0, MIN(temp), MAX(temp), SUM(temp), COUNT(*) FROM %s "
+                                  "WHERE id = ?1 AND time BETWEEN ?2 AND ?3;",
+                                  bind_query, agg_row, &part, q->out);
+    return for_each_partition(db, from, to,
+                              "SELECT time - time %% ?4 AS bucket, MIN(temp), MAX(temp), SUM(temp), COUNT(*) FROM %s "
+                              "WHERE id = ?1 AND time BETWEEN ?2 AND ?3 GROUP BY bucket ORDER BY bucket;",
+                              bind_query, agg_row, &part, q->out);
+}
+
+// Feed rollup buckets starting in [from, to] and return where they stop covering
+static int sqlite_rollup_agg(sqlite3 *db, query_t *q, int resolution, time_t from, time_t to, time_t *covered_until)
+{
+    sqlite3_stmt *stmt = NULL;
+    char *sql = sqlite3_mprintf("SELECT start, min, max, avg, count FROM %s "
+                                "WHERE id = ?1 AND start BETWEEN ?2 AND ?3 ORDER BY start;",
+                                rollup_table(resolution));
+    int rc = sql ? sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) : SQLITE_NOMEM;
+    sqlite3_free(sql);
+    if (rc != SQLITE_OK)
+        return -1;
+
+    *covered_until = from;
+    sqlite3_bind_int(stmt, 1, q->sensor);
+    sqlite3_bind_int64(stmt, 2, (sqlite3_int64)from);
+    sqlite3_bind_int64(stmt, 3, (sqlite3_int64)to);
+    while (!q->out->failed && sqlite3_step(stmt) == SQLITE_ROW)
+    {
+        time_t start = (time_t)sqlite3_column_int64(stmt, 0);
+        long long count = sqlite3_column_int64(stmt, 4);
+        agg_feed(q->agg, q->step ? start : q->agg->start,
+                 (float)sqlite3_column_double(stmt, 1), (float)sqlite3_column_double(stmt, 2),
+                 sqlite3_column_double(stmt, 3) * count, count);
+        *covered_until = start + rollup_width(resolution);
+    }
+    sqlite3_finalize(stmt);
+    return 0;
+}
+
+static int sqlite_agg(sqlite3 *db, query_t *q)
+{
+    time_t covered;
+
+    // Single bucket: whole hours from rollup_1h, the edges from raw readings
+    if (q->step == 0)
+    {
+        time_t width = rollup_width(ROLLUP_1H);
+        time_t first = q->from + (width - q->from % width) % width;
+        time_t end = (q->to + 1) - (q->to + 1) % width;
+        if (first >= end)
+            return sqlite_raw_agg(db, q, q->from, q->to);
+        if (sqlite_raw_agg(db, q, q->from, first - 1) != 0 ||
+            sqlite_rollup_agg(db, q, ROLLUP_1H, first, end - width, &covered) != 0)
+            return -1;
+        // Buckets still open in the data manager are not in the rollup table yet
+        return sqlite_raw_agg(db, q, covered, q->to);
+    }
+
+    for (int r = 0; r < ROLLUP_RESOLUTION_COUNT; r++)
+    {
+        if (rollup_width(r) != q->step)
+            continue;
+        if (sqlite_rollup_agg(db, q, r, q->from, q->to, &covered) != 0)
+            return -1;
+        return sqlite_raw_agg(db, q, covered, q->to);
+    }
+    return sqlite_raw_agg(db, q, q->from, q->to);
+}
+
+static void run_query(sqlite3 **db, query_out_t *out, const char *line)
+{
+    char op[8];
+    int sensor;
+    long long from, to, step = 0;
+    int fields = sscanf(line, "%7s %d %lld %lld %lld", op, &sensor, &from, &to, &step);
+    int is_range = fields >= 4 && strcmp(op, "RANGE") == 0;
+    int is_agg = fields >= 4 && strcmp(op, "AGG") == 0;
+
+    if (!is_range && !is_agg)
+    {
+        out_line(out, "ERR usage: RANGE <sensor> <from> <to> | AGG <sensor> <from> <to> [step]\n");
+        return;
+    }
+    // Rounding an aggregate's end up to a whole bucket must not overflow
+    if (sensor < 0 || sensor >= MAX_SENSORS || from > to || step < 0 || (is_agg && to >= LLONG_MAX - step))
+    {
+        out_line(out, "ERR invalid sensor, range or step\n");
+        return;
+    }
+
+    agg_stream_t agg = {out, 0, (time_t)from, 0, 0, 0, 0};
+    query_t q = {sensor, (time_t)from, (time_t)to, (time_t)step, out, &agg};
+
+    // Bucketed aggregates cover whole buckets
+    if (is_agg && step > 0)
+    {
+        q.from = q.from - q.from % q.step;
+        q.to = q.to - q.to % q.step + q.step - 1;
+    }
+
+    int rc;
+    if (storage_get_backend() == &columnar_backend)
+    {
+        rc = columnar_scan(COLUMNAR_DIR, sensor, q.from, q.to,
+                           is_range ? columnar_range_point : columnar_agg_point, &q) < 0 ? -1 : 0;
+    }
+    else
+    {
+        if (*db == NULL && sqlite3_open_v2(QUERY_DB_PATH, db, SQLITE_OPEN_READONLY, NULL) != SQLITE_OK)
+        {
+            out_line(out, "ERR cannot open database: %s\n", sqlite3_errmsg(*db));
+            sqlite3_close(*db);
+            *db = NULL;
+            return;
+        }
+
+        // One snapshot for all partitions and rollups read by the query
+        sqlite3_exec(*db, "BEGIN;", NULL, NULL, NULL);
+        rc = is_range ? sqlite_range(*db, &q) : sqlite_agg(*db, &q);
+        sqlite3_exec(*db, "COMMIT;", NULL, NULL, NULL);
+        if (rc != 0)
+        {
+            out_line(out, "ERR query failed: %s\n", sqlite3_errmsg(*db));
+            return;
+        }
+    }
+
+    if (rc != 0)
+    {
+        out_line(out, "ERR query failed\n");
+        return;
+    }
+    if (is_agg)
+        agg_emit(&agg);
+    out_line(out, "END %lld\n", out->lines);
+}
+
+// Read the request line of a client
+static int read_request(int fd, char *line, size_t size)
+{
+    size_t len = 0;
+    while (len + 1 < size)
+    {
+        ssize_t n = recv(fd, line + len, size - 1 - len, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        len += (size_t)n;
+        if (memchr(line, '\n', len))
+            break;
+    }
+    line[len] = '\0';
+    line[strcspn(line, "\r\n")] = '\0';
+    return len > 0 ? 0 : -1;
+}
+
+void *query_server(void *arg)
+{
+    sqlite3 *db = NULL;
+    query_out_t *out = malloc(sizeof(query_out_t));
+
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", QUERY_SOCKET_PATH);
+    unlink(QUERY_SOCKET_PATH);
+
+    if (out == NULL || listen_fd < 0 ||
+        bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+        listen(listen_fd, 8) != 0)
+    {
+        log_error("Failed to start query server on %s: %s", QUERY_SOCKET_PATH, strerror(errno));
+        if (listen_fd >= 0)
+            close(listen_fd);
+        free(out);
+        threads_mark_exit();
+        return NULL;
+    }
+
+    log_info("Query server listening on %s", QUERY_SOCKET_PATH);
+
+    while (!shutdown_flag)
+    {
+        struct pollfd pfd = {listen_fd, POLLIN, 0};
+        if (poll(&pfd, 1, QUERY_POLL_MS) <= 0)
+            continue;
+
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd < 0)
+            continue;
+
+        struct timeval tv = {QUERY_SEND_TIMEOUT_MS / 1000, (QUERY_SEND_TIMEOUT_MS % 1000) * 1000};
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+        char line[256];
+        if (read_request(fd, line, sizeof(line)) == 0)
+        {
+            out->fd = fd;
+            out->len = 0;
+            out->lines = 0;
+            out->failed = 0;
+            run_query(&db, out, line);
+            out_flush(out);
+
+            log_info("Query \"%.64s\": %lld lines%s", line, out->lines,
+                     out->failed ? ", client gone" : "");
+        }
+        close(fd);
+    }
+
+    sqlite3_close(db);
+    close(listen_fd);
+    unlink(QUERY_SOCKET_PATH);
+    free(out);
+    log_info("Query server shutting down");
+    threads_mark_exit();
+    return NULL;
+}
@@ -0,0 +1,30 @@
+/** @file query_server.h
+ *  @brief Historical data query server declarations
+ *
+ *  Serves stored readings over a local UNIX stream socket. A client
+ *  sends one request line and reads the answer until the END line:
+ *
+ *    RANGE <sensor> <from> <to>         time temp flags, one reading per line
+ *    AGG <sensor> <from> <to> [step]    start min max avg count, one bucket per line
+ *
+ *  Times are UNIX timestamps, both bounds included. Without a step, AGG
+ *  returns a single line for the whole range. Errors are answered with
+ *  a single "ERR <reason>" line.
+ *
+ *  @author Phuc
+ *  @bug No known bugs.
+ */
+
+#ifndef QUERY_SERVER_H
+#define QUERY_SERVER_H
+
+#define QUERY_SOCKET_PATH "/tmp/sensorQuery"
+#define QUERY_DB_PATH "db/sensors.db"
+#define QUERY_CHUNK_BYTES 65536      // Results are sent in chunks of this size
+#define QUERY_SEND_TIMEOUT_MS 5000   // Drop clients that stop reading
+#define QUERY_POLL_MS 500            // How often the idle server checks for shutdown
+
+// Query server thread
+void *query_server(void *arg);
+
+#endif /* QUERY_SERVER_H */
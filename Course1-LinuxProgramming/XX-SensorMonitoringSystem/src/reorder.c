@@ -0,0 +1,157 @@
+/** @file reorder.c
+ *  @brief Implementation of the event-time reordering window
+ *
+ *  A reading is released when a reading at least REORDER_LATENESS_SECONDS
+ *  newer has been seen for the same sensor, or when it has waited that long
+ *  on the gateway clock (so a sensor that goes quiet is not held back).
+ *  Readings older than what was already released cannot be put in order
+ *  any more and are dropped.
+ *
+ *  Only the data manager thread calls into the window, so it needs no locking.
+ *
+ *  @author Phuc
+ *  @bug No known bugs.
+ */
+
+#include <stdio.h>
+#include "reorder.h"
+#include "log.h"
+#include "metrics.h"
+
+typedef struct
+{
+    sensor_data_t data;
+    unsigned long long seq; // Spool sequence number, passed through
+    time_t arrival;         // Gateway time the reading entered the window
+} reorder_entry_t;
+
+typedef struct
+{
+    reorder_entry_t heap[REORDER_WINDOW_SIZE]; // Min-heap on data.timestamp
+    int count;
+    time_t max_seen;     // Newest timestamp received
+    time_t last_emitted; // Timestamp of the last released reading
+    int emitted_any;
+} reorder_window_t;
+
+static reorder_window_t windows[MAX_SENSORS];
+
+static void heap_push(reorder_window_t *w, const reorder_entry_t *e)
+{
+    int i = w->count++;
+    while (i > 0)
+    {
+        int parent = (i - 1) / 2;
+        if (w->heap[parent].data.timestamp <= e->data.timestamp)
+            break;
+        w->heap[i] = w->heap[parent];
+        i = parent;
+    }
+    w->heap[i] = *e;
+}
+
+static reorder_entry_t heap_pop(reorder_window_t *w)
+{
+    reorder_entry_t top = w->heap[0];
+    reorder_entry_t last = w->heap[--w->count];
+    int i = 0;
+    while (1)
+    {
+        int child = 2 * i + 1;
+        if (child >= w->count)
+            break;
+        if (child + 1 < w->count && w->heap[child + 1].data.timestamp < w->heap[child].data.timestamp)
+            child++;
+        if (last.data.timestamp <= w->heap[child].data.timestamp)
+            break;
+        w->heap[i] = w->heap[child];
+        i = child;
+    }
+    w->heap[i] = last;
+    return top;
+}
+
+static void emit_top(reorder_window_t *w, reorder_emit_fn emit, void *ctx)
+{
+    reorder_entry_t e = heap_pop(w);
+    w->last_emitted = e.data.timestamp;
+    w->emitted_any = 1;
+    emit(&e.data, e.seq, ctx);
+}
+
+// Release the readings of one window that are ready at time now
+static void release_ready(reorder_window_t *w, time_t now, reorder_emit_fn emit, void *ctx)
+{
+    while (w->count > 0 &&
+           (w->heap[0].data.timestamp <= w->max_seen - REORDER_LATENESS_SECONDS ||
+            w->heap[0].arrival <= now - REORDER_LATENESS_SECONDS))
+    {
+        emit_top(w, emit, ctx);
+    }
+}
+
+// Add a reading (valid sensor ID) and release whatever it makes ready
+int reorder_push(const sensor_data_t *data, unsigned long long seq, time_t now, reorder_emit_fn emit, void *ctx)
+{
+    reorder_window_t *w = &windows[data->sensor_id];
+
+    if (data->timestamp > now + REORDER_MAX_FUTURE_SECONDS)
+    {
+        log_warn("Dropped sensor %d reading stamped %ld s in the future",
+                 data->sensor_id, (long)(data->timestamp - now));
+        metrics_add(METRIC_REORDER_DROPPED, 1);
+        return -1;
+    }
+
+    if (w->emitted_any && data->timestamp < w->last_emitted)
+    {
+        log_warn("Dropped sensor %d reading at %ld, older than released %ld",
+                 data->sensor_id, (long)data->timestamp, (long)w->last_emitted);
+        metrics_add(METRIC_REORDER_DROPPED, 1);
+        return -1;
+    }
+
+    if (data->timestamp < w->max_seen)
+        metrics_add(METRIC_REORDER_LATE, 1); // Out of order but still within the window
+    else
+        w->max_seen = data->timestamp;
+
+    // A full window releases its oldest reading, which may be the new one
+    if (w->count == REORDER_WINDOW_SIZE)
+    {
+        if (data->timestamp < w->heap[0].data.timestamp)
+        {
+            w->last_emitted = data->timestamp;
+            w->emitted_any = 1;
+            emit(data, seq, ctx);
+            return 0;
+        }
+        emit_top(w, emit, ctx);
+    }
+
+    reorder_entry_t e = {.data = *data, .seq = seq, .arrival = now};
+    heap_push(w, &e);
+
+    release_ready(w, now, emit, ctx);
+    return 0;
+}
+
+// Release readings that have been held longer than the lateness allowance
+void reorder_flush_expired(time_t now, reorder_emit_fn emit, void *ctx)
+{
+    for (int i = 0; i < MAX_SENSORS; i++)
+    {
+        if (windows[i].count > 0)
+            release_ready(&windows[i], now, emit, ctx);
+    }
+}
+
+// Release everything, used on shutdown
+void reorder_flush_all(reorder_emit_fn emit, void *ctx)
+{
+    for (int i = 0; i < MAX_SENSORS; i++)
+    {
+        while (windows[i].count > 0)
+            emit_top(&windows[i], emit, ctx);
+    }
+}
@@ -0,0 +1,37 @@
+/** @file reorder.h
+ *  @brief Event-time reordering window declarations
+ *
+ *  Holds each sensor's readings in a small min-heap keyed on the node
+ *  timestamp and releases them in timestamp order once they are older
+ *  than the lateness allowance.
+ *
+ *  @author Phuc
+ *  @bug No known bugs.
+ */
+
+#ifndef REORDER_H
+#define REORDER_H
+
+#include <time.h>
+#include "../include/common.h"
+#include "sbuffer.h"
+
+// Define configurable limits (could be passed via config)
+#define REORDER_WINDOW_SIZE 16        // Readings held per sensor before the oldest is forced out
+#define REORDER_LATENESS_SECONDS 2    // How late a reading may arrive and still be put in order
+#define REORDER_MAX_FUTURE_SECONDS 60 // Readings stamped further ahead of the gateway clock are rejected
+
+// Called for each released reading with its spool sequence number, in event-time order per sensor
+typedef void (*reorder_emit_fn)(const sensor_data_t *data, unsigned long long seq, void *ctx);
+
+// Add a reading (valid sensor ID) and release whatever it makes ready.
+// Returns 0 if accepted, -1 if dropped.
+int reorder_push(const sensor_data_t *data, unsigned long long seq, time_t now, reorder_emit_fn emit, void *ctx);
+
+// Release readings that have been held longer than the lateness allowance
+void reorder_flush_expired(time_t now, reorder_emit_fn emit, void *ctx);
+
+// Release everything, used on shutdown
+void reorder_flush_all(reorder_emit_fn emit, void *ctx);
+
+#endif /* REORDER_H */
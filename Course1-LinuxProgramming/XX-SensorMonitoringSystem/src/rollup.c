@@ -0,0 +1,106 @@
+/** @file rollup.c
+ *  @brief Implementation of the rollup stage
+ *
+ *  One open bucket per sensor and resolution. A bucket is closed when a
+ *  reading for a later bucket arrives or when the gateway clock passes
+ *  its end plus ROLLUP_GRACE_SECONDS. A reading arriving after its bucket
+ *  was closed opens it again; the storage manager merges both parts.
+ *
+ *  Only the data manager thread calls into this stage, so it needs no locking.
+ *
+ *  @author Phuc
+ *  @bug No known bugs.
+ */
+
+#include <stdio.h>
+#include "rollup.h"
+#include "log.h"
+#include "clock_service.h"
+
+static const int rollup_widths[ROLLUP_RESOLUTION_COUNT] = {
+    [ROLLUP_1M] = 60,
+    [ROLLUP_1H] = 3600,
+};
+
+static const char *rollup_tables[ROLLUP_RESOLUTION_COUNT] = {
+    [ROLLUP_1M] = "rollup_1m",
+    [ROLLUP_1H] = "rollup_1h",
+};
+
+static rollup_bucket_t open_buckets[MAX_SENSORS][ROLLUP_RESOLUTION_COUNT];
+
+// Width of a bucket in seconds
+int rollup_width(rollup_resolution_t res)
+{
+    return rollup_widths[res];
+}
+
+// Table holding buckets of a resolution
+const char *rollup_table(rollup_resolution_t res)
+{
+    return rollup_tables[res];
+}
+
+static void close_bucket(rollup_bucket_t *b, store_queue_t *sq)
+{
+    store_record_t rec = {.type = STORE_ROLLUP, .rollup = *b, .enqueue_ns = clock_mono_ns()};
+    if (store_queue_push(sq, &rec) != 0)
+    {
+        log_error("Failed to queue %s bucket %ld of sensor %d for storage",
+                  rollup_tables[b->resolution], (long)b->start, b->sensor_id);
+    }
+    b->count = 0;
+}
+
+// Fold a reading into its buckets, queueing any bucket it closes
+void rollup_add(const sensor_data_t *data, store_queue_t *sq)
+{
+    for (int r = 0; r < ROLLUP_RESOLUTION_COUNT; r++)
+    {
+        rollup_bucket_t *b = &open_buckets[data->sensor_id][r];
+        time_t start = data->timestamp - data->timestamp % rollup_widths[r];
+
+        if (b->count > 0 && b->start != start)
+            close_bucket(b, sq);
+
+        if (b->count == 0)
+        {
+            *b = (rollup_bucket_t){.sensor_id = data->sensor_id, .resolution = r, .start = start,
+                                   .min = data->temperature, .max = data->temperature};
+        }
+
+        if (data->temperature < b->min)
+            b->min = data->temperature;
+        if (data->temperature > b->max)
+            b->max = data->temperature;
+        b->sum += data->temperature;
+        b->count++;
+    }
+}
+
+// Queue buckets whose end plus grace period has passed
+void rollup_flush_expired(time_t now, store_queue_t *sq)
+{
+    for (int i = 0; i < MAX_SENSORS; i++)
+    {
+        for (int r = 0; r < ROLLUP_RESOLUTION_COUNT; r++)
+        {
+            rollup_bucket_t *b = &open_buckets[i][r];
+            if (b->count > 0 && b->start + rollup_widths[r] + ROLLUP_GRACE_SECONDS <= now)
+                close_bucket(b, sq);
+        }
+    }
+}
+
+// Queue all open buckets, used on shutdown
+void rollup_flush_all(store_queue_t *sq)
+{
+    for (int i = 0; i < MAX_SENSORS; i++)
+    {
+        for (int r = 0; r < ROLLUP_RESOLUTION_COUNT; r++)
+        {
+            if (open_buckets[i][r].count > 0)
+                close_bucket(&open_buckets[i][r], sq);
+        }
+    }
+}
@@ -0,0 +1,47 @@
+/** @file rollup.h
+ *  @brief Time-bucketed rollup stage declarations
+ *
+ *  Aggregates each sensor's readings into fixed time buckets
+ *  (min/max/avg/count) as they flow, and hands closed buckets
+ *  to the storage manager.
+ *
+ *  @author Phuc
+ *  @bug No known bugs.
+ */
+
+#ifndef ROLLUP_H
+#define ROLLUP_H
+
+#include <time.h>
+#include "../include/common.h"
+#include "sbuffer.h"
+#include "store_queue.h"
+
+// Bucket resolutions, each stored in its own table
+typedef enum
+{
+    ROLLUP_1M,
+    ROLLUP_1H,
+    ROLLUP_RESOLUTION_COUNT
+} rollup_resolution_t;
+
+// Extra time a bucket stays open past its end, on the gateway clock, for late readings
+#define ROLLUP_GRACE_SECONDS 5
+
+// Width of a bucket in seconds
+int rollup_width(rollup_resolution_t res);
+
+// Table holding buckets of a resolution
+const char *rollup_table(rollup_resolution_t res);
+
+// Fold a reading (valid sensor ID, event-time order) into its buckets,
+// queueing any bucket it closes
+void rollup_add(const sensor_data_t *data, store_queue_t *sq);
+
+// Queue buckets whose end plus grace period has passed
+void rollup_flush_expired(time_t now, store_queue_t *sq);
+
+// Queue all open buckets, used on shutdown
+void rollup_flush_all(store_queue_t *sq);
+
+#endif /* ROLLUP_H */
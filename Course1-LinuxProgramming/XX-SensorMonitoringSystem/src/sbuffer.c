@@ -10,8 +10,10 @@
 
 #include "sbuffer.h"
 #include <error.h>
+#include <errno.h>
 #include <unistd.h>
 #include "log.h"
+#include "spool.h"
 #include "../include/common.h"
 
 // Initializes the shared data structure sbuffer
@@ -24,8 +26,11 @@ int sbuffer_init(sbuffer_t *sb, int size)
     }
 
     sb->buffer = (sensor_data_t *)malloc(size * sizeof(sensor_data_t));
-    if (sb->buffer == NULL)
+    sb->seqs = (unsigned long long *)malloc(size * sizeof(unsigned long long));
+    if (sb->buffer == NULL || sb->seqs == NULL)
     {
+        free(sb->buffer);
+        free(sb->seqs);
         perror("Memory allocation failed");
         return -1;
     }
@@ -38,6 +43,7 @@ int sbuffer_init(sbuffer_t *sb, int size)
     if (pthread_mutex_init(&sb->mutex, NULL) != 0)
     {
         free(sb->buffer);
+        free(sb->seqs);
         perror("Init mutex failed");
         return -1;
     }
@@ -46,6 +52,7 @@ int sbuffer_init(sbuffer_t *sb, int size)
     {
         pthread_mutex_destroy(&sb->mutex);
         free(sb->buffer);
+        free(sb->seqs);
         perror("Init mutex condition for buffer fullness failed");
         return -1;
     }
@@ -54,6 +61,7 @@ int sbuffer_init(sbuffer_t *sb, int size)
     {
         pthread_mutex_destroy(&sb->mutex);
         free(sb->buffer);
+        free(sb->seqs);
         perror("Init mutex condition for buffer emptiness failed");
         return -1;
     }
@@ -62,7 +70,7 @@ int sbuffer_init(sbuffer_t *sb, int size)
 }
 
 // Add a new sensor data node to buffer
-int sbuffer_push(sbuffer_t *sb, sensor_data_t data)
+int sbuffer_push(sbuffer_t *sb, sensor_data_t data, unsigned long long seq)
 {
     if (sb == NULL)
     {
@@ -79,19 +87,20 @@ int sbuffer_push(sbuffer_t *sb, sensor_data_t data)
     if (sb->count == sb->size)
     {
         printf("Warning: Buffer full, overwriting oldest data (sensor %d)\n", data.sensor_id);
+        // The dropped reading will never be stored, so the spool must not replay it
+        spool_release(&sb->seqs[sb->tail], 1);
         sb->tail = (sb->tail + 1) % sb->size;
         sb->count--;
 
-        char msg[256];
-        snprintf(msg, sizeof(msg), "Dropped oldest data from sensor %d due to buffer full", sb->buffer[sb->tail].sensor_id);
-        log_event(msg);
+        log_warn("Dropped oldest data from sensor %d due to buffer full", sb->buffer[sb->tail].sensor_id);
     }
 
     sb->buffer[sb->head] = data;
+    sb->seqs[sb->head] = seq;
     sb->head = (sb->head + 1) % sb->size;
     sb->count++;
 
-    log_event("Data pushed to buffer");
+    log_debug("Data pushed to buffer");
 
     if (pthread_cond_signal(&sb->not_empty) != 0)
     {
@@ -109,8 +118,45 @@ int sbuffer_push(sbuffer_t *sb, sensor_data_t data)
     return 0;
 }
 
+// Add a new sensor data node to buffer, waiting while it is full
+int sbuffer_push_wait(sbuffer_t *sb, sensor_data_t data, unsigned long long seq)
+{
+    if (sb == NULL)
+    {
+        perror("Invalid sensor buffer, push failed");
+        return -1;
+    }
+
+    if (pthread_mutex_lock(&sb->mutex) != 0)
+    {
+        perror("Mutex lock failed in push");
+        return -1;
+    }
+
+    while (sb->count == sb->size && !shutdown_flag)
+    {
+        if (pthread_cond_wait(&sb->not_full, &sb->mutex) != 0)
+        {
+            pthread_mutex_unlock(&sb->mutex);
+            perror("Condition wait failed in push");
+            return -1;
+        }
+    }
+
+    if (sb->count == sb->size)
+    {
+        pthread_mutex_unlock(&sb->mutex);
+        return -1; // Shutting down, the reading stays in the spool
+    }
+
+    pthread_mutex_unlock(&sb->mutex);
+
+    // Only the connection manager pushes, so the room cannot be taken meanwhile
+    return sbuffer_push(sb, data, seq);
+}
+
 // Remove a sensor data node from buffer
-int sbuffer_pop(sbuffer_t *sb, sensor_data_t *data)
+int sbuffer_pop(sbuffer_t *sb, sensor_data_t *data, unsigned long long *seq)
 {
     if (sb == NULL || data == NULL)
     {
@@ -142,10 +188,12 @@ int sbuffer_pop(sbuffer_t *sb, sensor_data_t *data)
     }
 
     *data = sb->buffer[sb->tail];
+    if (seq != NULL)
+        *seq = sb->seqs[sb->tail];
     sb->tail = (sb->tail + 1) % sb->size;
     sb->count--;
 
-    log_event("Data popped from buffer");
+    log_debug("Data popped from buffer");
 
     if (pthread_cond_signal(&sb->not_full) != 0)
     {
@@ -163,6 +211,85 @@ int sbuffer_pop(sbuffer_t *sb, sensor_data_t *data)
     return 0;
 }
 
+// Remove up to max sensor data nodes from buffer in one go, waiting at most timeout_ms
+int sbuffer_pop_batch(sbuffer_t *sb, sensor_data_t *data, unsigned long long *seqs, int max, int timeout_ms)
+{
+    if (sb == NULL || data == NULL || max <= 0)
+    {
+        perror("Invalid sensor buffer or data pointer, batch pop failed");
+        return -1;
+    }
+
+    if (pthread_mutex_lock(&sb->mutex) != 0)
+    {
+        perror("Mutex lock failed in batch pop");
+        return -1;
+    }
+
+    struct timespec deadline;
+    if (timeout_ms >= 0)
+    {
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += timeout_ms / 1000;
+        deadline.tv_nsec += (long)(timeout_ms % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L)
+        {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+    }
+
+    while (sb->count == 0 && !shutdown_flag)
+    {
+        int rc = timeout_ms >= 0 ? pthread_cond_timedwait(&sb->not_empty, &sb->mutex, &deadline)
+                                 : pthread_cond_wait(&sb->not_empty, &sb->mutex);
+        if (rc == ETIMEDOUT)
+        {
+            pthread_mutex_unlock(&sb->mutex);
+            return 0;
+        }
+        if (rc != 0)
+        {
+            pthread_mutex_unlock(&sb->mutex);
+            perror("Condition wait failed in batch pop");
+            return -1;
+        }
+    }
+
+    if (sb->count == 0)
+    {
+        pthread_mutex_unlock(&sb->mutex);
+        return -1; // Exit if buffer is empty (including during shutdown)
+    }
+
+    int n = 0;
+    while (n < max && sb->count > 0)
+    {
+        if (seqs != NULL)
+            seqs[n] = sb->seqs[sb->tail];
+        data[n++] = sb->buffer[sb->tail];
+        sb->tail = (sb->tail + 1) % sb->size;
+        sb->count--;
+    }
+
+    log_debug("%d data popped from buffer", n);
+
+    if (pthread_cond_broadcast(&sb->not_full) != 0)
+    {
+        perror("Broadcast not_full failed in batch pop");
+        pthread_mutex_unlock(&sb->mutex);
+        return -1;
+    }
+
+    if (pthread_mutex_unlock(&sb->mutex) != 0)
+    {
+        perror("Mutex unlock failed in batch pop");
+        return -1;
+    }
+
+    return n;
+}
+
 // Free all nodes in buffer
 int sbuffer_free(sbuffer_t *sb)
 {
@@ -184,12 +311,14 @@ int sbuffer_free(sbuffer_t *sb)
 
     if (lock_retries == MAX_RETRIES)
     {
-        log_event("Failed to lock mutex in sbuffer_free after retries");
+        log_error("Failed to lock mutex in sbuffer_free after retries");
         return -1;
     }
 
     free(sb->buffer);
+    free(sb->seqs);
     sb->buffer = NULL;
+    sb->seqs = NULL;
     sb->size = 0;
     sb->head = 0;
     sb->tail = 0;
@@ -197,7 +326,7 @@ int sbuffer_free(sbuffer_t *sb)
 
     if (pthread_mutex_unlock(&sb->mutex) != 0)
     {
-        log_event("Mutex unlock failed in sbuffer_free");
+        log_error("Mutex unlock failed in sbuffer_free");
     }
 
     int destroy_retries = 0;
@@ -206,28 +335,28 @@ int sbuffer_free(sbuffer_t *sb)
         if (pthread_mutex_destroy(&sb->mutex) == 0)
             break;
         perror("Mutex destroy failed in sbuffer_free");
-        log_event("Mutex destroy failed in sbuffer_free");
+        log_error("Mutex destroy failed in sbuffer_free");
         usleep(100000);
         destroy_retries++;
     }
 
     if (destroy_retries == MAX_RETRIES)
     {
-        log_event("Failed to destroy mutex in sbuffer_free after retries");
+        log_error("Failed to destroy mutex in sbuffer_free after retries");
         return -1;
     }
 
     if (pthread_cond_destroy(&sb->not_full) != 0)
     {
         perror("Not_full condition destroy failed in sbuffer_free");
-        log_event("Not_full condition destroy failed in sbuffer_free");
+        log_error("Not_full condition destroy failed in sbuffer_free");
         return -1;
     }
 
     if (pthread_cond_destroy(&sb->not_empty) != 0)
     {
         perror("Not_empty condition destroy failed in sbuffer_free");
-        log_event("Not_empty condition destroy failed in sbuffer_free");
+        log_error("Not_empty condition destroy failed in sbuffer_free");
         return -1;
     }
 
@@ -26,6 +26,7 @@ typedef struct
 typedef struct
 {
     sensor_data_t *buffer;    // Array for circular buffer
+    unsigned long long *seqs; // Spool sequence number of each element (0 if not spooled)
     int size;                 // Maximum number of elements
     int head;                 // Index where next data will be added
     int tail;                 // Index where next data will be removed
@@ -38,11 +39,18 @@ typedef struct
 // Initializes the shared data structure sbuffer
 int sbuffer_init(sbuffer_t *sb, int size);
 
-// Add a new sensor data to buffer
-int sbuffer_push(sbuffer_t *sb, sensor_data_t data);
+// Add a new sensor data to buffer, overwriting the oldest when full
+int sbuffer_push(sbuffer_t *sb, sensor_data_t data, unsigned long long seq);
+
+// Add a new sensor data to buffer, waiting while it is full (used for spool replay)
+int sbuffer_push_wait(sbuffer_t *sb, sensor_data_t data, unsigned long long seq);
 
 // Remove a sensor data from buffer
-int sbuffer_pop(sbuffer_t *sb, sensor_data_t *data);
+int sbuffer_pop(sbuffer_t *sb, sensor_data_t *data, unsigned long long *seq);
+
+// Remove up to max sensor data from buffer in one go, waiting at most timeout_ms
+// (forever if negative). Returns the number removed, 0 on timeout.
+int sbuffer_pop_batch(sbuffer_t *sb, sensor_data_t *data, unsigned long long *seqs, int max, int timeout_ms);
 
 // Free all data element in buffer
 int sbuffer_free(sbuffer_t *sb);
@@ -0,0 +1,197 @@
+/** @file schema.c
+ *  @brief Implementation of database schema versioning
+ *
+ *  Migrations are history: once released, a migration's SQL must not
+ *  change. Schema changes are made by appending a new migration.
+ *
+ *  Databases created before schema_version existed are recognized by
+ *  their tables: measurements without flags is version 1, with flags
+ *  version 2, and with the rollup tables as well version 3.
+ *
+ *  @author Phuc
+ *  @bug No known bugs.
+ */
+
+#include <stdio.h>
+#include "schema.h"
+#include "log.h"
+#include "clock_service.h"
+
+typedef struct
+{
+    int version;
+    const char *description;
+    const char *sql;
+} migration_t;
+
+static const migration_t migrations[] = {
+    {1, "measurements table",
+     "CREATE TABLE IF NOT EXISTS measurements ("
+     "id INTEGER NOT NULL, "
+     "temp REAL NOT NULL, "
+     "time INTEGER NOT NULL"
+     ");"},
+
+    {2, "anomaly flags",
+     "ALTER TABLE measurements ADD COLUMN flags INTEGER NOT NULL DEFAULT 0;"
+     "CREATE INDEX IF NOT EXISTS idx_measurements_flagged ON measurements(id, time) WHERE flags != 0;"},
+
+    {3, "rollup tables",
+     "CREATE TABLE IF NOT EXISTS rollup_1m ("
+     "id INTEGER NOT NULL, start INTEGER NOT NULL, min REAL NOT NULL, max REAL NOT NULL, "
+     "avg REAL NOT NULL, count INTEGER NOT NULL, PRIMARY KEY (id, start)) WITHOUT ROWID;"
+     "CREATE TABLE IF NOT EXISTS rollup_1h ("
+     "id INTEGER NOT NULL, start INTEGER NOT NULL, min REAL NOT NULL, max REAL NOT NULL, "
+     "avg REAL NOT NULL, count INTEGER NOT NULL, PRIMARY KEY (id, start)) WITHOUT ROWID;"},
+
+    // Cluster readings by sensor and time. seq tells apart readings of one sensor within the same second.
+    {4, "clustered, typed measurements",
+     "CREATE TABLE measurements_v3 ("
+     "id INTEGER NOT NULL, "
+     "time INTEGER NOT NULL, "
+     "seq INTEGER NOT NULL, "
+     "temp REAL NOT NULL, "
+     "flags INTEGER NOT NULL DEFAULT 0, "
+     "PRIMARY KEY (id, time, seq)"
+     ") WITHOUT ROWID, STRICT;"
+     "INSERT INTO measurements_v3 (id, time, seq, temp, flags) "
+     "SELECT id, time, ROW_NUMBER() OVER (PARTITION BY id, time ORDER BY rowid) - 1, temp, flags "
+     "FROM measurements;"
+     "DROP TABLE measurements;"
+     "ALTER TABLE measurements_v3 RENAME TO measurements;"
+     "CREATE INDEX idx_measurements_flagged ON measurements(id, time) WHERE flags != 0;"},
+
+    // Readings move to per-period partition tables (storage_partition.c). The existing
+    // table becomes the first partition and measurements a view over all of them.
+    {5, "time-partitioned measurements",
+     "CREATE TABLE partitions ("
+     "name TEXT PRIMARY KEY, "
+     "start INTEGER NOT NULL, "
+     "stop INTEGER NOT NULL"
+     ") STRICT;"
+     "ALTER TABLE measurements RENAME TO measurements_legacy;"
+     "INSERT INTO partitions (name, start, stop) "
+     "SELECT 'measurements_legacy', COALESCE(MIN(time), 0), COALESCE(MAX(time) + 1, 0) FROM measurements_legacy;"
+     "CREATE VIEW measurements AS SELECT id, time, seq, temp, flags FROM measurements_legacy;"},
+
+    // Spool sequence numbers of the last committed group, written in the same transaction
+    // so that a crash between the commit and the spool release does not replay them (spool.c)
+    {6, "spool commit marker",
+     "CREATE TABLE spool_commit ("
+     "id INTEGER PRIMARY KEY CHECK (id = 0), "
+     "seqs BLOB NOT NULL"
+     ") STRICT;"},
+
+    // Old readings compacted into columnar blocks of up to 1024 readings (storage_compact.c)
+    {7, "archive of compacted readings",
+     "CREATE TABLE archive ("
+     "id INTEGER NOT NULL, "
+     "start INTEGER NOT NULL, "
+     "stop INTEGER NOT NULL, "
+     "count INTEGER NOT NULL, "
+     "min REAL NOT NULL, "
+     "max REAL NOT NULL, "
+     "block BLOB NOT NULL"
+     ") STRICT;"
+     "CREATE INDEX idx_archive_range ON archive(id, stop);"},
+};
+
+#define MIGRATION_COUNT ((int)(sizeof(migrations) / sizeof(migrations[0])))
+
+// Return 1 if the query prepares and yields a row, 0 otherwise
+static int query_has_row(sqlite3 *db, const char *sql)
+{
+    sqlite3_stmt *stmt = NULL;
+    int found = 0;
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) == SQLITE_OK)
+        found = sqlite3_step(stmt) == SQLITE_ROW;
+    sqlite3_finalize(stmt);
+    return found;
+}
+
+// Current schema version of a database (0 for an empty one), -1 on error
+int schema_current_version(sqlite3 *db)
+{
+    if (query_has_row(db, "SELECT 1 FROM sqlite_master WHERE type = 'table' AND name = 'schema_version';"))
+    {
+        sqlite3_stmt *stmt = NULL;
+        int version = -1;
+        if (sqlite3_prepare_v2(db, "SELECT COALESCE(MAX(version), 0) FROM schema_version;", -1, &stmt, NULL) == SQLITE_OK &&
+            sqlite3_step(stmt) == SQLITE_ROW)
+        {
+            version = sqlite3_column_int(stmt, 0);
+        }
+        sqlite3_finalize(stmt);
+        return version;
+    }
+
+    // Database from before schema versioning
+    if (!query_has_row(db, "SELECT 1 FROM sqlite_master WHERE type = 'table' AND name = 'measurements';"))
+        return 0;
+    if (!query_has_row(db, "SELECT 1 FROM pragma_table_info('measurements') WHERE name = 'flags';"))
+        return 1;
+    if (!query_has_row(db, "SELECT 1 FROM sqlite_master WHERE type = 'table' AND name = 'rollup_1h';"))
+        return 2;
+    return 3;
+}
+
+// Apply all pending migrations, each in its own transaction; returns the resulting version
+int schema_migrate(sqlite3 *db)
+{
+    char *err_msg = NULL;
+
+    int version = schema_current_version(db);
+    if (version < 0)
+    {
+        log_error("Failed to read database schema version");
+        return -1;
+    }
+
+    if (version > SCHEMA_VERSION)
+    {
+        log_error("Database schema version %d is newer than supported version %d",
+                  version, SCHEMA_VERSION);
+        return -1;
+    }
+
+    if (sqlite3_exec(db,
+                     "CREATE TABLE IF NOT EXISTS schema_version ("
+                     "version INTEGER PRIMARY KEY, "
+                     "applied_at INTEGER NOT NULL, "
+                     "description TEXT NOT NULL"
+                     ");",
+                     NULL, NULL, &err_msg) != SQLITE_OK)
+    {
+        log_error("Failed to create schema_version table: %s", err_msg);
+        sqlite3_free(err_msg);
+        return -1;
+    }
+
+    for (int i = 0; i < MIGRATION_COUNT; i++)
+    {
+        const migration_t *m = &migrations[i];
+        if (m->version <= version)
+            continue;
+
+        char record[256];
+        snprintf(record, sizeof(record),
+                 "INSERT INTO schema_version (version, applied_at, description) VALUES (%d, %ld, '%s');",
+                 m->version, (long)clock_now(), m->description);
+
+        if (sqlite3_exec(db, "BEGIN IMMEDIATE;", NULL, NULL, &err_msg) != SQLITE_OK ||
+            sqlite3_exec(db, m->sql, NULL, NULL, &err_msg) != SQLITE_OK ||
+            sqlite3_exec(db, record, NULL, NULL, &err_msg) != SQLITE_OK ||
+            sqlite3_exec(db, "COMMIT;", NULL, NULL, &err_msg) != SQLITE_OK)
+        {
+            log_error("Schema migration to version %d failed: %s", m->version, err_msg);
+            sqlite3_free(err_msg);
+            sqlite3_exec(db, "ROLLBACK;", NULL, NULL, NULL);
+            return -1;
+        }
+
+        log_info("Migrated database schema to version %d (%s)", m->version, m->description);
+        version = m->version;
+    }
+
+    return version;
+}
@@ -0,0 +1,27 @@
+/** @file schema.h
+ *  @brief Database schema versioning declarations
+ *
+ *  The sensors.db schema is defined as an ordered list of migrations.
+ *  On startup the storage manager brings any existing database up to
+ *  the latest version; the applied versions are recorded in schema_version.
+ *
+ *  @author Phuc
+ *  @bug No known bugs.
+ */
+
+#ifndef SCHEMA_H
+#define SCHEMA_H
+
+#include <sqlite3.h>
+
+// Latest schema version known to this build
+#define SCHEMA_VERSION 7
+
+// Current schema version of a database (0 for an empty one), -1 on error
+int schema_current_version(sqlite3 *db);
+
+// Apply all pending migrations, each in its own transaction.
+// Returns the resulting schema version, -1 on error
+int schema_migrate(sqlite3 *db);
+
+#endif /* SCHEMA_H */
@@ -0,0 +1,338 @@
+/** @file spool.c
+ *  @brief Implementation of the write-ahead spool
+ *
+ *  The spool file is a header page followed by a ring of SPOOL_RECORDS
+ *  fixed-size slots, mapped shared so that a reading copied into it
+ *  survives a crash of the gateway process. Sequence number s lives in
+ *  slot s % SPOOL_RECORDS, and a slot is live while its checksum is
+ *  valid: a release clears the checksum, and a torn write never gets
+ *  a valid one.
+ *
+ *  Slots are reused a chunk at a time, once every reading of the oldest
+ *  chunk was released. Appends are sequential memory writes; the file
+ *  reaches the disk through the page cache and spool_sync(), which the
+ *  storage writer calls once per group commit.
+ *
+ *  Releasing happens after the commit. A crash in between would replay
+ *  that group again, unless the backend recorded its sequence numbers
+ *  with the commit (recover_spool in storage_backend_t). Sequence
+ *  numbers are never reused, so such a record cannot match a newer
+ *  reading.
+ *
+ *  @author Phuc
+ *  @bug No known bugs.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "spool.h"
+#include "log.h"
+#include "metrics.h"
+
+#define SPOOL_MAGIC 0x53504f4fU // "SPOO"
+#define SPOOL_VERSION 1
+#define SPOOL_HEADER_BYTES 4096
+#define SPOOL_CHUNKS (SPOOL_RECORDS / SPOOL_CHUNK_RECORDS)
+
+typedef struct
+{
+    unsigned int magic;
+    unsigned int version;
+    unsigned int records;     // Slots in the ring
+    unsigned int record_size; // sizeof(spool_record_t)
+    unsigned long long next_seq; // Sequence numbers are never reused, even across restarts
+} spool_header_t;
+
+typedef struct
+{
+    unsigned long long seq;
+    sensor_data_t data;
+    unsigned int checksum; // Over the fields above, 0 once released
+    unsigned int reserved;
+} spool_record_t;
+
+static pthread_mutex_t spool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static spool_header_t *header;                // NULL while the spool is not mapped
+static spool_record_t *records;
+static size_t map_bytes;
+static unsigned long long head = 1;           // Next sequence number
+static unsigned long long tail = 1;           // Oldest sequence number whose slot is not free yet
+static int inflight[SPOOL_CHUNKS];            // Live readings per chunk
+static int full_logged;
+
+static spool_record_t *pending_replay;        // Readings found by spool_open
+static int pending_count;
+
+// FNV-1a over the record up to its checksum, never 0 for a live record
+static unsigned int record_checksum(const spool_record_t *rec)
+{
+    const unsigned char *p = (const unsigned char *)rec;
+    unsigned int h = 2166136261U;
+
+    for (size_t i = 0; i < offsetof(spool_record_t, checksum); i++)
+    {
+        h ^= p[i];
+        h *= 16777619U;
+    }
+    return h == 0 ? 1 : h;
+}
+
+static int chunk_of(unsigned long long seq)
+{
+    return (int)((seq / SPOOL_CHUNK_RECORDS) % SPOOL_CHUNKS);
+}
+
+static int compare_seq(const void *a, const void *b)
+{
+    const spool_record_t *x = a;
+    const spool_record_t *y = b;
+    return x->seq < y->seq ? -1 : x->seq > y->seq;
+}
+
+// Move the tail past chunks whose readings were all released. Called with spool_mutex held.
+static void advance_tail(void)
+{
+    while (tail < head && inflight[chunk_of(tail)] == 0)
+    {
+        unsigned long long chunk_end = (tail / SPOOL_CHUNK_RECORDS + 1) * SPOOL_CHUNK_RECORDS;
+        tail = chunk_end < head ? chunk_end : head;
+    }
+}
+
+// Map the spool file, creating it if needed, and collect the readings left in it
+int spool_open(const char *path)
+{
+    char dir[128];
+    struct stat st = {0};
+
+    // The spool lives next to the database, which may not exist yet
+    snprintf(dir, sizeof(dir), "%s", path);
+    char *slash = strrchr(dir, '/');
+    if (slash != NULL)
+    {
+        *slash = '\0';
+        if (mkdir(dir, 0777) == -1 && errno != EEXIST)
+        {
+            log_error("Failed to create spool directory %s: %s", dir, strerror(errno));
+            return -1;
+        }
+    }
+
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd == -1)
+    {
+        log_error("Failed to open spool %s: %s", path, strerror(errno));
+        return -1;
+    }
+
+    map_bytes = SPOOL_HEADER_BYTES + (size_t)SPOOL_RECORDS * sizeof(spool_record_t);
+    if (fstat(fd, &st) == -1 || (size_t)st.st_size != map_bytes)
+    {
+        if (st.st_size != 0)
+            log_warn("Spool file has an unexpected size, starting with an empty spool");
+        if (ftruncate(fd, 0) == -1 || ftruncate(fd, map_bytes) == -1)
+        {
+            log_error("Failed to size spool %s: %s", path, strerror(errno));
+            close(fd);
+            return -1;
+        }
+    }
+
+    void *map = mmap(NULL, map_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+    {
+        log_error("Failed to map spool %s: %s", path, strerror(errno));
+        return -1;
+    }
+
+    spool_header_t *hdr = map;
+    spool_record_t *recs = (spool_record_t *)((char *)map + SPOOL_HEADER_BYTES);
+
+    if (hdr->magic != SPOOL_MAGIC || hdr->version != SPOOL_VERSION ||
+        hdr->records != SPOOL_RECORDS || hdr->record_size != sizeof(spool_record_t))
+    {
+        memset(map, 0, map_bytes);
+        hdr->magic = SPOOL_MAGIC;
+        hdr->version = SPOOL_VERSION;
+        hdr->records = SPOOL_RECORDS;
+        hdr->record_size = sizeof(spool_record_t);
+        hdr->next_seq = 1;
+    }
+
+    // Live slots are the readings that were never released
+    int live = 0;
+    for (int i = 0; i < SPOOL_RECORDS; i++)
+    {
+        if (recs[i].seq != 0 && recs[i].seq % SPOOL_RECORDS == (unsigned long long)i &&
+            recs[i].checksum == record_checksum(&recs[i]))
+            live++;
+        else
+            recs[i].checksum = 0;
+    }
+
+    pending_replay = live > 0 ? malloc(sizeof(spool_record_t) * live) : NULL;
+    if (live > 0 && pending_replay == NULL)
+    {
+        log_error("Failed to allocate spool replay list");
+        munmap(map, map_bytes);
+        return -1;
+    }
+
+    pthread_mutex_lock(&spool_mutex);
+    memset(inflight, 0, sizeof(inflight));
+    pending_count = 0;
+    for (int i = 0; i < SPOOL_RECORDS; i++)
+    {
+        if (recs[i].checksum != 0)
+        {
+            pending_replay[pending_count++] = recs[i];
+            inflight[chunk_of(recs[i].seq)]++;
+        }
+    }
+    if (pending_count > 1)
+        qsort(pending_replay, pending_count, sizeof(spool_record_t), compare_seq);
+
+    // Replayed readings keep their slots; new ones continue after them
+    head = hdr->next_seq > 0 ? hdr->next_seq : 1;
+    if (pending_count > 0 && pending_replay[pending_count - 1].seq >= head)
+        head = pending_replay[pending_count - 1].seq + 1;
+    tail = pending_count > 0 ? pending_replay[0].seq : head;
+    hdr->next_seq = head;
+    header = hdr;
+    records = recs;
+    full_logged = 0;
+    pthread_mutex_unlock(&spool_mutex);
+
+    if (pending_count > 0)
+    {
+        log_info("Spool holds %d readings not yet stored", pending_count);
+    }
+
+    return pending_count;
+}
+
+// Hand the readings collected by spool_open to fn, once
+void spool_replay(spool_replay_fn fn, void *ctx)
+{
+    spool_record_t *list = pending_replay;
+    int count = pending_count;
+
+    pending_replay = NULL;
+    pending_count = 0;
+
+    int replayed = 0;
+    for (int i = 0; i < count; i++)
+    {
+        // Skip readings released since spool_open (already committed before the crash)
+        pthread_mutex_lock(&spool_mutex);
+        const spool_record_t *rec = &records[list[i].seq % SPOOL_RECORDS];
+        int live = header != NULL && rec->seq == list[i].seq && rec->checksum != 0;
+        pthread_mutex_unlock(&spool_mutex);
+
+        if (live)
+        {
+            fn(&list[i].data, list[i].seq, ctx);
+            replayed++;
+        }
+    }
+
+    metrics_add(METRIC_SPOOL_REPLAYED, replayed);
+    free(list);
+}
+
+// Copy a reading to the spool
+unsigned long long spool_append(const sensor_data_t *data)
+{
+    pthread_mutex_lock(&spool_mutex);
+
+    if (header == NULL || head - tail >= SPOOL_RECORDS)
+    {
+        int log_full = header != NULL && !full_logged;
+        full_logged |= log_full;
+        pthread_mutex_unlock(&spool_mutex);
+
+        metrics_add(METRIC_SPOOL_UNPROTECTED, 1);
+        if (log_full)
+            log_warn("Spool full, new readings are not protected until storage catches up");
+        return 0;
+    }
+
+    unsigned long long seq = head++;
+    spool_record_t *rec = &records[seq % SPOOL_RECORDS];
+    header->next_seq = head;
+
+    rec->checksum = 0;
+    rec->seq = seq;
+    rec->data = *data;
+    rec->checksum = record_checksum(rec);
+    inflight[chunk_of(seq)]++;
+
+    pthread_mutex_unlock(&spool_mutex);
+    return seq;
+}
+
+// Forget readings that are durable in storage or were discarded
+void spool_release(const unsigned long long *seqs, int n)
+{
+    pthread_mutex_lock(&spool_mutex);
+
+    if (header == NULL)
+    {
+        pthread_mutex_unlock(&spool_mutex);
+        return;
+    }
+
+    for (int i = 0; i < n; i++)
+    {
+        if (seqs[i] == 0)
+            continue;
+
+        spool_record_t *rec = &records[seqs[i] % SPOOL_RECORDS];
+        if (rec->seq != seqs[i] || rec->checksum == 0)
+            continue; // Already released
+
+        rec->checksum = 0;
+        inflight[chunk_of(seqs[i])]--;
+    }
+
+    advance_tail();
+    if (head - tail < SPOOL_RECORDS)
+        full_logged = 0;
+
+    pthread_mutex_unlock(&spool_mutex);
+}
+
+// Flush the spool to disk
+void spool_sync(void)
+{
+    if (header != NULL && msync(header, map_bytes, MS_SYNC) == -1)
+        perror("Failed to sync spool");
+}
+
+// Flush and unmap the spool
+void spool_close(void)
+{
+    pthread_mutex_lock(&spool_mutex);
+
+    if (header != NULL)
+    {
+        msync(header, map_bytes, MS_SYNC);
+        munmap(header, map_bytes);
+        header = NULL;
+        records = NULL;
+    }
+    free(pending_replay);
+    pending_replay = NULL;
+    pending_count = 0;
+
+    pthread_mutex_unlock(&spool_mutex);
+}
@@ -0,0 +1,49 @@
+/** @file spool.h
+ *  @brief Write-ahead spool declarations
+ *
+ *  Every reading received from a sensor node is copied to a memory-mapped
+ *  spool file before it enters the pipeline, and released once the
+ *  storage backend has made it durable (or the pipeline discarded it).
+ *  Readings still in the spool at startup were lost in a crash or an
+ *  interrupted shutdown, and are fed through the pipeline again.
+ *
+ *  Each spooled reading carries a sequence number through sbuffer, the
+ *  reordering window and the storage queue. Sequence 0 means the reading
+ *  is not spooled (the spool was full or could not be opened).
+ *
+ *  @author Phuc
+ *  @bug No known bugs.
+ */
+
+#ifndef SPOOL_H
+#define SPOOL_H
+
+#include "sbuffer.h"
+
+#define SPOOL_PATH "db/spool.bin"
+#define SPOOL_RECORDS 65536      // Readings the spool holds before new ones go unprotected
+#define SPOOL_CHUNK_RECORDS 1024 // Space is reclaimed a chunk at a time, oldest first
+
+// Called for each reading left in the spool, in arrival order
+typedef void (*spool_replay_fn)(const sensor_data_t *data, unsigned long long seq, void *ctx);
+
+// Map the spool file, creating it if needed, and collect the readings left in it.
+// Returns the number of readings to replay, -1 on error.
+int spool_open(const char *path);
+
+// Hand the readings collected by spool_open to fn, once
+void spool_replay(spool_replay_fn fn, void *ctx);
+
+// Copy a reading to the spool. Returns its sequence number, 0 if it could not be spooled.
+unsigned long long spool_append(const sensor_data_t *data);
+
+// Forget readings that are durable in storage or were discarded (0 entries are skipped)
+void spool_release(const unsigned long long *seqs, int n);
+
+// Flush the spool to disk
+void spool_sync(void);
+
+// Flush and unmap the spool
+void spool_close(void);
+
+#endif /* SPOOL_H */
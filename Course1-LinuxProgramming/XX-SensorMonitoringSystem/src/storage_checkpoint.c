@@ -0,0 +1,165 @@
+/** @file storage_checkpoint.c
+ *  @brief Implementation of the background WAL checkpointer
+ *
+ *  Runs a PASSIVE checkpoint every STORE_CHECKPOINT_INTERVAL_MS, or as soon
+ *  as the WAL holds STORE_CHECKPOINT_PAGES pages. PASSIVE never waits for
+ *  readers or the writer. If the WAL still grows past
+ *  STORE_WAL_TRUNCATE_PAGES, a TRUNCATE checkpoint resets the file.
+ *
+ *  @author Phuc
+ *  @bug No known bugs.
+ */
+
+#include <stdio.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <errno.h>
+#include "storage_checkpoint.h"
+#include "storage_manager.h"
+#include "log.h"
+#include "metrics.h"
+#include "clock_service.h"
+
+static pthread_t checkpoint_thread;
+static pthread_mutex_t checkpoint_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t checkpoint_cond = PTHREAD_COND_INITIALIZER;
+static int checkpoint_running = 0;
+static int checkpoint_stopping = 0;
+static atomic_int wal_pages = 0;
+static char checkpoint_db_path[256];
+
+// Called by SQLite on the writer connection after each commit
+static int wal_hook(void *arg, sqlite3 *db, const char *db_name, int pages)
+{
+    atomic_store(&wal_pages, pages);
+    if (pages >= STORE_CHECKPOINT_PAGES)
+    {
+        pthread_mutex_lock(&checkpoint_mutex);
+        pthread_cond_signal(&checkpoint_cond);
+        pthread_mutex_unlock(&checkpoint_mutex);
+    }
+    return SQLITE_OK;
+}
+
+static void run_checkpoint(sqlite3 *db, int mode)
+{
+    int log_pages = 0, ckpt_pages = 0;
+    unsigned long long start = clock_mono_ns();
+
+    int rc = sqlite3_wal_checkpoint_v2(db, NULL, mode, &log_pages, &ckpt_pages);
+    if (rc != SQLITE_OK && rc != SQLITE_BUSY)
+    {
+        log_error("WAL checkpoint failed: %s", sqlite3_errmsg(db));
+        return;
+    }
+
+    metrics_add(METRIC_CHECKPOINTS, 1);
+    metrics_add(METRIC_CHECKPOINT_PAGES, ckpt_pages > 0 ? ckpt_pages : 0);
+    metrics_add(METRIC_CHECKPOINT_NS, clock_mono_ns() - start);
+
+    if (mode == SQLITE_CHECKPOINT_TRUNCATE)
+    {
+        log_info("WAL truncated after checkpointing %d pages", ckpt_pages);
+    }
+}
+
+static void *checkpoint_main(void *arg)
+{
+    sqlite3 *db = NULL;
+
+    if (sqlite3_open_v2(checkpoint_db_path, &db, SQLITE_OPEN_READWRITE, NULL) != SQLITE_OK)
+    {
+        log_error("Checkpoint thread failed to open %s: %s", checkpoint_db_path, sqlite3_errmsg(db));
+        sqlite3_close(db);
+        return NULL;
+    }
+    sqlite3_busy_timeout(db, STORE_BUSY_TIMEOUT_MS);
+
+    // A fresh connection only notices WAL mode once it has read the database header
+    if (sqlite3_exec(db, "PRAGMA journal_mode;", NULL, NULL, NULL) != SQLITE_OK)
+    {
+        log_error("Checkpoint thread failed to read %s: %s", checkpoint_db_path, sqlite3_errmsg(db));
+    }
+
+    log_info("WAL checkpoint thread started");
+
+    pthread_mutex_lock(&checkpoint_mutex);
+    while (!checkpoint_stopping)
+    {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += STORE_CHECKPOINT_INTERVAL_MS / 1000;
+        deadline.tv_nsec += (long)(STORE_CHECKPOINT_INTERVAL_MS % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L)
+        {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+
+        while (!checkpoint_stopping && atomic_load(&wal_pages) < STORE_CHECKPOINT_PAGES)
+        {
+            if (pthread_cond_timedwait(&checkpoint_cond, &checkpoint_mutex, &deadline) == ETIMEDOUT)
+                break;
+        }
+
+        if (checkpoint_stopping)
+            break;
+
+        // Nothing committed since the last checkpoint
+        int pages = atomic_exchange(&wal_pages, 0);
+        if (pages == 0)
+            continue;
+
+        pthread_mutex_unlock(&checkpoint_mutex);
+
+        run_checkpoint(db, pages >= STORE_WAL_TRUNCATE_PAGES ? SQLITE_CHECKPOINT_TRUNCATE : SQLITE_CHECKPOINT_PASSIVE);
+
+        pthread_mutex_lock(&checkpoint_mutex);
+    }
+    pthread_mutex_unlock(&checkpoint_mutex);
+
+    // Leave the WAL empty so the database file is complete on its own
+    run_checkpoint(db, SQLITE_CHECKPOINT_TRUNCATE);
+    sqlite3_close(db);
+
+    log_info("WAL checkpoint thread shutting down");
+    return NULL;
+}
+
+// Start the checkpoint thread for the database at db_path
+int checkpoint_start(const char *db_path, sqlite3 *writer)
+{
+    snprintf(checkpoint_db_path, sizeof(checkpoint_db_path), "%s", db_path);
+    checkpoint_stopping = 0;
+    atomic_store(&wal_pages, 0);
+
+    sqlite3_wal_hook(writer, wal_hook, NULL);
+
+    int ret = pthread_create(&checkpoint_thread, NULL, checkpoint_main, NULL);
+    if (ret != 0)
+    {
+        printf("pthread_create() WAL checkpoint error number=%d\n", ret);
+        log_error("pthread_create() WAL checkpoint failed");
+        sqlite3_wal_hook(writer, NULL, NULL);
+        return -1;
+    }
+
+    checkpoint_running = 1;
+    return 0;
+}
+
+// Stop the checkpoint thread and wait for it
+void checkpoint_stop(void)
+{
+    if (!checkpoint_running)
+        return;
+
+    pthread_mutex_lock(&checkpoint_mutex);
+    checkpoint_stopping = 1;
+    pthread_cond_signal(&checkpoint_cond);
+    pthread_mutex_unlock(&checkpoint_mutex);
+
+    pthread_join(checkpoint_thread, NULL);
+    checkpoint_running = 0;
+}
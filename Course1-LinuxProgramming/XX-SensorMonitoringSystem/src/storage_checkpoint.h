@@ -0,0 +1,25 @@
+/** @file storage_checkpoint.h
+ *  @brief Background WAL checkpoint declarations
+ *
+ *  With the database in WAL mode, commits only append to the WAL file.
+ *  A background thread copies the WAL back into the database on its own
+ *  connection, so the ingest writer never pays for checkpoints.
+ *
+ *  @author Phuc
+ *  @bug No known bugs.
+ */
+
+#ifndef STORAGE_CHECKPOINT_H
+#define STORAGE_CHECKPOINT_H
+
+#include <sqlite3.h>
+
+// Start the checkpoint thread for the database at db_path. The writer
+// connection reports the WAL size after each commit so the thread can
+// checkpoint early when the WAL grows quickly.
+int checkpoint_start(const char *db_path, sqlite3 *writer);
+
+// Stop the checkpoint thread and wait for it
+void checkpoint_stop(void);
+
+#endif /* STORAGE_CHECKPOINT_H */
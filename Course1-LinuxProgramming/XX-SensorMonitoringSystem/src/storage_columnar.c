@@ -0,0 +1,712 @@
+/** @file storage_columnar.c
+ *  @brief Implementation of the append-only columnar time-series store
+ *
+ *  Block layout: a block_header_t followed by a bit stream. For every
+ *  point, in order:
+ *   - timestamp: the first comes from the header. Then the
+ *     delta-of-delta is '0' when zero, '10' + 7 bits, '110' + 9 bits,
+ *     '1110' + 12 bits, or '1111' + 64 bits.
+ *   - temperature: the first is 32 raw bits. Then the XOR with the
+ *     previous value is '0' when zero. '10' + bits reuses the previous
+ *     leading/trailing zero window. Otherwise '11' + 5 bits of leading
+ *     zeros, 5 bits of length - 1, and the meaningful bits.
+ *   - flags: '0' when unchanged, '1' + 8 bits otherwise.
+ *
+ *  A block is written to the segment before its index entry. On open,
+ *  a segment is cut back to the end of the last indexed block, so a
+ *  torn write loses at most that block.
+ *
+ *  Sealed blocks are written with write() and left to the page cache
+ *  like SQLite's synchronous=NORMAL; open blocks live in memory for up
+ *  to COLUMNAR_SEAL_MS.
+ *
+ *  @author Phuc
+ *  @bug No known bugs.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "storage_columnar.h"
+#include "storage_manager.h"
+#include "../include/common.h"
+#include "log.h"
+#include "clock_service.h"
+
+#define BLOCK_MAGIC 0x31425347u // "GSB1"
+
+typedef struct
+{
+    uint32_t magic;
+    uint32_t count;
+    int64_t first_ts;      // Timestamp of the first point, the base of the delta chain
+    uint32_t payload_bytes;
+    uint32_t reserved;
+} block_header_t;
+
+typedef struct
+{
+    int64_t min_ts;
+    int64_t max_ts;
+    uint64_t offset;       // Block position in the segment file
+    uint32_t length;       // Header and payload
+    uint32_t count;
+    float min;
+    float max;
+} index_entry_t;
+
+// Worst case per point: 68 timestamp + 44 value + 9 flag bits
+#define POINT_MAX_BYTES 16
+#define BLOCK_MAX_BYTES (sizeof(block_header_t) + COLUMNAR_BLOCK_POINTS * POINT_MAX_BYTES)
+
+_Static_assert(BLOCK_MAX_BYTES == COLUMNAR_BLOCK_MAX_BYTES, "COLUMNAR_BLOCK_MAX_BYTES out of date");
+
+// Delta chain state, shared by the encoder and decoder
+typedef struct
+{
+    int64_t prev_ts;
+    int64_t prev_delta;
+    uint32_t prev_bits;
+    int prev_lead;         // Leading zeros of the last stored XOR, -1 before the first one
+    int prev_trail;
+    unsigned int prev_flags;
+} chain_t;
+
+typedef struct
+{
+    int seg_fd;
+    int idx_fd;
+    uint64_t seg_size;
+    uint8_t *block;        // Header space followed by the payload
+    uint64_t bit_pos;      // Bits written to the payload
+    uint32_t count;
+    int64_t first_ts;
+    chain_t chain;
+    index_entry_t entry;   // Ranges of the open block
+    unsigned long long opened_ns;
+} series_t;
+
+static series_t series[MAX_SENSORS];
+static char series_dir[256];
+
+static void put_bits(series_t *s, uint64_t value, int nbits)
+{
+    uint8_t *payload = s->block + sizeof(block_header_t);
+    while (nbits > 0)
+    {
+        int free_bits = 8 - (int)(s->bit_pos & 7);
+        int take = nbits < free_bits ? nbits : free_bits;
+        uint8_t chunk = (uint8_t)((value >> (nbits - take)) & ((1u << take) - 1));
+        payload[s->bit_pos >> 3] |= (uint8_t)(chunk << (free_bits - take));
+        s->bit_pos += take;
+        nbits -= take;
+    }
+}
+
+typedef struct
+{
+    const uint8_t *data;
+    uint64_t size_bits;
+    uint64_t pos;
+} bit_reader_t;
+
+static int get_bits(bit_reader_t *r, int nbits, uint64_t *value)
+{
+    if (r->pos + nbits > r->size_bits)
+        return -1;
+
+    uint64_t v = 0;
+    while (nbits > 0)
+    {
+        int avail = 8 - (int)(r->pos & 7);
+        int take = nbits < avail ? nbits : avail;
+        uint8_t byte = r->data[r->pos >> 3];
+        v = (v << take) | ((byte >> (avail - take)) & ((1u << take) - 1));
+        r->pos += take;
+        nbits -= take;
+    }
+    *value = v;
+    return 0;
+}
+
+// Count the leading 1 bits of a prefix code, up to max
+static int get_prefix(bit_reader_t *r, int max, int *ones)
+{
+    uint64_t bit = 1;
+    *ones = 0;
+    while (*ones < max)
+    {
+        if (get_bits(r, 1, &bit) != 0)
+            return -1;
+        if (bit == 0)
+            break;
+        (*ones)++;
+    }
+    return 0;
+}
+
+static int64_t sign_extend(uint64_t v, int nbits)
+{
+    uint64_t sign = 1ULL << (nbits - 1);
+    return (int64_t)((v ^ sign) - sign);
+}
+
+static uint32_t float_bits(float f)
+{
+    uint32_t u;
+    memcpy(&u, &f, sizeof(u));
+    return u;
+}
+
+static float bits_float(uint32_t u)
+{
+    float f;
+    memcpy(&f, &u, sizeof(f));
+    return f;
+}
+
+static void encode_timestamp(series_t *s, int64_t ts)
+{
+    int64_t delta = ts - s->chain.prev_ts;
+    int64_t dod = delta - s->chain.prev_delta;
+
+    if (dod == 0)
+        put_bits(s, 0x0, 1);
+    else if (dod >= -64 && dod <= 63)
+    {
+        put_bits(s, 0x2, 2);
+        put_bits(s, (uint64_t)dod, 7);
+    }
+    else if (dod >= -256 && dod <= 255)
+    {
+        put_bits(s, 0x6, 3);
+        put_bits(s, (uint64_t)dod, 9);
+    }
+    else if (dod >= -2048 && dod <= 2047)
+    {
+        put_bits(s, 0xE, 4);
+        put_bits(s, (uint64_t)dod, 12);
+    }
+    else
+    {
+        put_bits(s, 0xF, 4);
+        put_bits(s, (uint64_t)dod, 64);
+    }
+
+    s->chain.prev_delta = delta;
+    s->chain.prev_ts = ts;
+}
+
+static void encode_value(series_t *s, uint32_t bits)
+{
+    uint32_t x = bits ^ s->chain.prev_bits;
+    s->chain.prev_bits = bits;
+
+    if (x == 0)
+    {
+        put_bits(s, 0x0, 1);
+        return;
+    }
+
+    int lead = __builtin_clz(x);
+    int trail = __builtin_ctz(x);
+
+    if (s->chain.prev_lead >= 0 && lead >= s->chain.prev_lead && trail >= s->chain.prev_trail)
+    {
+        int len = 32 - s->chain.prev_lead - s->chain.prev_trail;
+        put_bits(s, 0x2, 2);
+        put_bits(s, x >> s->chain.prev_trail, len);
+        return;
+    }
+
+    int len = 32 - lead - trail;
+    put_bits(s, 0x3, 2);
+    put_bits(s, (uint64_t)lead, 5);
+    put_bits(s, (uint64_t)(len - 1), 5);
+    put_bits(s, x >> trail, len);
+    s->chain.prev_lead = lead;
+    s->chain.prev_trail = trail;
+}
+
+static void encode_flags(series_t *s, unsigned int flags)
+{
+    if (flags == s->chain.prev_flags)
+    {
+        put_bits(s, 0x0, 1);
+        return;
+    }
+    put_bits(s, 0x1, 1);
+    put_bits(s, flags & 0xFF, 8);
+    s->chain.prev_flags = flags & 0xFF;
+}
+
+static int decode_timestamp(bit_reader_t *r, chain_t *c, int64_t *ts)
+{
+    static const int widths[] = {0, 7, 9, 12, 64};
+    uint64_t v = 0;
+    int ones;
+    int64_t dod = 0;
+
+    if (get_prefix(r, 4, &ones) != 0)
+        return -1;
+    if (ones > 0)
+    {
+        if (get_bits(r, widths[ones], &v) != 0)
+            return -1;
+        dod = widths[ones] == 64 ? (int64_t)v : sign_extend(v, widths[ones]);
+    }
+
+    c->prev_delta += dod;
+    c->prev_ts += c->prev_delta;
+    *ts = c->prev_ts;
+    return 0;
+}
+
+static int decode_value(bit_reader_t *r, chain_t *c, uint32_t *bits)
+{
+    uint64_t v = 0;
+    int ones;
+
+    if (get_prefix(r, 2, &ones) != 0)
+        return -1;
+    if (ones == 2)
+    {
+        uint64_t lead, len;
+        if (get_bits(r, 5, &lead) != 0 || get_bits(r, 5, &len) != 0)
+            return -1;
+        c->prev_lead = (int)lead;
+        c->prev_trail = 32 - (int)lead - (int)(len + 1);
+        if (c->prev_trail < 0)
+            return -1;
+    }
+    if (ones > 0)
+    {
+        if (c->prev_lead < 0 || get_bits(r, 32 - c->prev_lead - c->prev_trail, &v) != 0)
+            return -1;
+        c->prev_bits ^= (uint32_t)(v << c->prev_trail);
+    }
+    *bits = c->prev_bits;
+    return 0;
+}
+
+static int decode_flags(bit_reader_t *r, chain_t *c, unsigned int *flags)
+{
+    uint64_t v = 0;
+    if (get_bits(r, 1, &v) != 0)
+        return -1;
+    if (v == 1)
+    {
+        if (get_bits(r, 8, &v) != 0)
+            return -1;
+        c->prev_flags = (unsigned int)v;
+    }
+    *flags = c->prev_flags;
+    return 0;
+}
+
+// Decode a block, passing points within [from, to] to fn.
+// Returns 1 if fn asked to stop, 0 when done, -1 if the block is corrupt.
+static int scan_block(const uint8_t *data, uint64_t length, time_t from, time_t to,
+                      columnar_scan_fn fn, void *ctx, long long *visited)
+{
+    block_header_t h;
+    if (length < sizeof(h))
+        return -1;
+    memcpy(&h, data, sizeof(h));
+    if (h.magic != BLOCK_MAGIC || sizeof(h) + h.payload_bytes > length || h.count == 0)
+        return -1;
+
+    bit_reader_t r = {data + sizeof(h), (uint64_t)h.payload_bytes * 8, 0};
+    chain_t c = {h.first_ts, 0, 0, -1, 0, 0};
+    uint64_t raw = 0;
+
+    for (uint32_t i = 0; i < h.count; i++)
+    {
+        columnar_point_t p;
+        int64_t ts = h.first_ts;
+        uint32_t bits;
+
+        if (i == 0)
+        {
+            if (get_bits(&r, 32, &raw) != 0)
+                return -1;
+            c.prev_bits = (uint32_t)raw;
+            bits = c.prev_bits;
+        }
+        else if (decode_timestamp(&r, &c, &ts) != 0 || decode_value(&r, &c, &bits) != 0)
+            return -1;
+
+        if (decode_flags(&r, &c, &p.flags) != 0)
+            return -1;
+
+        if (ts < from || ts > to)
+            continue;
+
+        p.timestamp = (time_t)ts;
+        p.temperature = bits_float(bits);
+        (*visited)++;
+        if (fn && fn(&p, ctx) != 0)
+            return 1;
+    }
+    return 0;
+}
+
+// Add a point to the open block of s
+static void encode_point(series_t *s, int64_t ts, float temperature, unsigned int flags)
+{
+    uint32_t bits = float_bits(temperature);
+
+    if (s->count == 0)
+    {
+        s->first_ts = ts;
+        s->chain = (chain_t){ts, 0, bits, -1, 0, 0};
+        s->entry = (index_entry_t){ts, ts, 0, 0, 0, temperature, temperature};
+        s->opened_ns = clock_mono_ns();
+        put_bits(s, bits, 32);
+    }
+    else
+    {
+        encode_timestamp(s, ts);
+        encode_value(s, bits);
+    }
+    encode_flags(s, flags);
+
+    if (ts < s->entry.min_ts)
+        s->entry.min_ts = ts;
+    if (ts > s->entry.max_ts)
+        s->entry.max_ts = ts;
+    if (temperature < s->entry.min)
+        s->entry.min = temperature;
+    if (temperature > s->entry.max)
+        s->entry.max = temperature;
+    s->count++;
+}
+
+// Write the header of the open block of s, returns the block length
+static uint32_t finish_block(series_t *s)
+{
+    block_header_t h = {BLOCK_MAGIC, s->count, s->first_ts, (uint32_t)((s->bit_pos + 7) / 8), 0};
+    memcpy(s->block, &h, sizeof(h));
+    return (uint32_t)(sizeof(h) + h.payload_bytes);
+}
+
+static void reset_block(series_t *s)
+{
+    memset(s->block, 0, BLOCK_MAX_BYTES);
+    s->bit_pos = 0;
+    s->count = 0;
+}
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+    const uint8_t *p = buf;
+    while (len > 0)
+    {
+        ssize_t n = write(fd, p, len);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        p += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+// Write the open block of a sensor and its index entry
+static int seal_block(int sensor_id)
+{
+    series_t *s = &series[sensor_id];
+
+    if (s->count == 0)
+        return 0;
+
+    s->entry.offset = s->seg_size;
+    s->entry.length = finish_block(s);
+    s->entry.count = s->count;
+
+    if (write_all(s->seg_fd, s->block, s->entry.length) != 0 ||
+        write_all(s->idx_fd, &s->entry, sizeof(s->entry)) != 0)
+    {
+        log_error("Failed to write block of sensor %d: %s, %u points lost",
+                  sensor_id, strerror(errno), s->count);
+        // Drop whatever part of the block reached the segment
+        if (ftruncate(s->seg_fd, (off_t)s->seg_size) != 0)
+            perror("Failed to truncate segment");
+        reset_block(s);
+        return -1;
+    }
+
+    s->seg_size += s->entry.length;
+    reset_block(s);
+    return 0;
+}
+
+// Open the files of a sensor, cutting off a block whose write was interrupted
+static int open_series(int sensor_id)
+{
+    series_t *s = &series[sensor_id];
+    char path[320];
+    struct stat st;
+
+    s->block = calloc(1, BLOCK_MAX_BYTES);
+    if (s->block == NULL)
+        return -1;
+
+    snprintf(path, sizeof(path), "%s/%d.idx", series_dir, sensor_id);
+    s->idx_fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0644);
+    snprintf(path, sizeof(path), "%s/%d.seg", series_dir, sensor_id);
+    s->seg_fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0644);
+    if (s->idx_fd < 0 || s->seg_fd < 0 || fstat(s->idx_fd, &st) != 0)
+        goto fail;
+
+    // Keep whole index entries whose block is fully in the segment
+    uint64_t entries = (uint64_t)st.st_size / sizeof(index_entry_t);
+    uint64_t seg_end = 0;
+    struct stat seg_st;
+    if (fstat(s->seg_fd, &seg_st) != 0)
+        goto fail;
+    while (entries > 0)
+    {
+        index_entry_t last;
+        if (pread(s->idx_fd, &last, sizeof(last), (off_t)((entries - 1) * sizeof(last))) != (ssize_t)sizeof(last))
+            goto fail;
+        if (last.offset + last.length <= (uint64_t)seg_st.st_size)
+        {
+            seg_end = last.offset + last.length;
+            break;
+        }
+        entries--;
+    }
+
+    if ((uint64_t)st.st_size != entries * sizeof(index_entry_t) || (uint64_t)seg_st.st_size != seg_end)
+    {
+        if (ftruncate(s->idx_fd, (off_t)(entries * sizeof(index_entry_t))) != 0 ||
+            ftruncate(s->seg_fd, (off_t)seg_end) != 0)
+            goto fail;
+        log_warn("Recovered series %d: dropped %lld bytes of unindexed data",
+                 sensor_id, (long long)seg_st.st_size - (long long)seg_end);
+    }
+
+    s->seg_size = seg_end;
+    reset_block(s);
+    return 0;
+
+fail:
+    log_error("Failed to open series %d in %s: %s", sensor_id, series_dir, strerror(errno));
+    if (s->idx_fd >= 0)
+        close(s->idx_fd);
+    if (s->seg_fd >= 0)
+        close(s->seg_fd);
+    free(s->block);
+    s->block = NULL;
+    s->idx_fd = s->seg_fd = -1;
+    return -1;
+}
+
+int columnar_open(const char *dir)
+{
+    snprintf(series_dir, sizeof(series_dir), "%s", dir);
+    for (int i = 0; i < MAX_SENSORS; i++)
+    {
+        memset(&series[i], 0, sizeof(series[i]));
+        series[i].seg_fd = series[i].idx_fd = -1;
+    }
+
+    // Create each missing level of the path
+    char path[256];
+    snprintf(path, sizeof(path), "%s", dir);
+    for (char *p = path + 1; ; p++)
+    {
+        if (*p != '/' && *p != '\0')
+            continue;
+        char c = *p;
+        *p = '\0';
+        if (mkdir(path, 0777) == -1 && errno != EEXIST)
+        {
+            log_error("Failed to create directory %s: %s", path, strerror(errno));
+            return -1;
+        }
+        *p = c;
+        if (c == '\0')
+            break;
+    }
+
+    log_info("Columnar store ready in %s", dir);
+    return 0;
+}
+
+int columnar_append(int sensor_id, time_t timestamp, float temperature, unsigned int flags)
+{
+    if (sensor_id < 0 || sensor_id >= MAX_SENSORS)
+        return -1;
+
+    series_t *s = &series[sensor_id];
+    if (s->block == NULL && open_series(sensor_id) != 0)
+        return -1;
+
+    encode_point(s, (int64_t)timestamp, temperature, flags);
+    if (s->count == COLUMNAR_BLOCK_POINTS)
+        return seal_block(sensor_id);
+    return 0;
+}
+
+int columnar_encode_block(const columnar_point_t *points, int n, uint8_t *buf)
+{
+    series_t s;
+
+    if (n <= 0 || n > COLUMNAR_BLOCK_POINTS)
+        return -1;
+
+    memset(&s, 0, sizeof(s));
+    memset(buf, 0, COLUMNAR_BLOCK_MAX_BYTES);
+    s.block = buf;
+    for (int i = 0; i < n; i++)
+        encode_point(&s, (int64_t)points[i].timestamp, points[i].temperature, points[i].flags);
+    return (int)finish_block(&s);
+}
+
+long long columnar_decode_block(const void *block, size_t length, time_t from, time_t to,
+                                columnar_scan_fn fn, void *ctx)
+{
+    long long visited = 0;
+    return scan_block(block, length, from, to, fn, ctx, &visited) < 0 ? -1 : visited;
+}
+
+int columnar_commit(void)
+{
+    unsigned long long now_ns = clock_mono_ns();
+    int rc = 0;
+
+    for (int i = 0; i < MAX_SENSORS; i++)
+    {
+        if (series[i].count > 0 && now_ns - series[i].opened_ns >= COLUMNAR_SEAL_MS * 1000000ULL)
+        {
+            if (seal_block(i) != 0)
+                rc = -1;
+        }
+    }
+    return rc;
+}
+
+int columnar_unsealed(int sensor_id)
+{
+    if (sensor_id < 0 || sensor_id >= MAX_SENSORS)
+        return 0;
+    return (int)series[sensor_id].count;
+}
+
+void columnar_close(void)
+{
+    for (int i = 0; i < MAX_SENSORS; i++)
+    {
+        series_t *s = &series[i];
+        if (s->block == NULL)
+            continue;
+        seal_block(i);
+        close(s->seg_fd);
+        close(s->idx_fd);
+        free(s->block);
+        memset(s, 0, sizeof(*s));
+        s->seg_fd = s->idx_fd = -1;
+    }
+}
+
+// Map a whole file read-only, *size 0 and NULL for an empty or missing file
+static const uint8_t *map_file(const char *path, uint64_t *size)
+{
+    struct stat st;
+    *size = 0;
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+    if (fstat(fd, &st) != 0 || st.st_size == 0)
+    {
+        close(fd);
+        return NULL;
+    }
+
+    void *p = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED)
+        return NULL;
+    *size = (uint64_t)st.st_size;
+    return p;
+}
+
+long long columnar_scan(const char *dir, int sensor_id, time_t from, time_t to,
+                        columnar_scan_fn fn, void *ctx)
+{
+    char path[320];
+    uint64_t idx_size, seg_size;
+    long long visited = 0;
+
+    // Index first: every block it lists is already complete in the segment
+    snprintf(path, sizeof(path), "%s/%d.idx", dir, sensor_id);
+    const uint8_t *idx = map_file(path, &idx_size);
+    if (idx == NULL)
+        return 0;
+    snprintf(path, sizeof(path), "%s/%d.seg", dir, sensor_id);
+    const uint8_t *seg = map_file(path, &seg_size);
+
+    uint64_t entries = idx_size / sizeof(index_entry_t);
+    for (uint64_t i = 0; i < entries; i++)
+    {
+        index_entry_t e;
+        memcpy(&e, idx + i * sizeof(e), sizeof(e));
+
+        // The index alone rules out blocks outside the range
+        if (e.max_ts < (int64_t)from || e.min_ts > (int64_t)to)
+            continue;
+        if (seg == NULL || e.offset + e.length > seg_size)
+        {
+            visited = -1;
+            break;
+        }
+
+        int rc = scan_block(seg + e.offset, e.length, from, to, fn, ctx, &visited);
+        if (rc < 0)
+            visited = -1;
+        if (rc != 0)
+            break;
+    }
+
+    munmap((void *)idx, idx_size);
+    if (seg)
+        munmap((void *)seg, seg_size);
+    return visited;
+}
+
+static int columnar_backend_open(void)
+{
+    if (columnar_open(COLUMNAR_DIR) != 0)
+        return -1;
+    log_warn("Columnar backend stores raw readings only, rollup buckets are not persisted");
+    return 0;
+}
+
+static int columnar_backend_append(const store_record_t *rec)
+{
+    if (rec->type != STORE_MEASUREMENT)
+        return -1;
+    return columnar_append(rec->data.sensor_id, rec->data.timestamp, rec->data.temperature, rec->flags);
+}
+
+const storage_backend_t columnar_backend = {
+    .name = "columnar",
+    .open = columnar_backend_open,
+    .append = columnar_backend_append,
+    .commit = columnar_commit,
+    .close = columnar_close,
+    .idle_ms = COLUMNAR_SEAL_MS,
+    .in_memory = columnar_unsealed,
+};
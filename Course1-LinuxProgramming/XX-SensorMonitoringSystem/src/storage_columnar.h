@@ -0,0 +1,69 @@
+/** @file storage_columnar.h
+ *  @brief Append-only columnar time-series store declarations
+ *
+ *  Alternative to SQLite for raw readings. Each sensor has a segment
+ *  file of compressed blocks and an index file with one fixed-size
+ *  entry per block (time range, value range, location). Blocks use
+ *  delta-of-delta timestamps and XOR-compressed values (Gorilla).
+ *
+ *  Writes come from the storage manager thread only. Scans open the
+ *  files read-only and may run from any thread or process; they see
+ *  the blocks sealed so far.
+ *
+ *  @author Phuc
+ *  @bug No known bugs.
+ */
+
+#ifndef STORAGE_COLUMNAR_H
+#define STORAGE_COLUMNAR_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#define COLUMNAR_DIR "db/series"   // <sensor_id>.seg and <sensor_id>.idx per sensor
+#define COLUMNAR_BLOCK_POINTS 1024 // Points per block
+#define COLUMNAR_SEAL_MS 5000      // Seal a partial block once its first point is this old
+// Largest encoded block: 24-byte header, at most 16 bytes per point
+#define COLUMNAR_BLOCK_MAX_BYTES (24 + COLUMNAR_BLOCK_POINTS * 16)
+
+typedef struct
+{
+    time_t timestamp;
+    float temperature;
+    unsigned int flags;
+} columnar_point_t;
+
+// Called for each point of a scan, in storage order. Return nonzero to stop.
+typedef int (*columnar_scan_fn)(const columnar_point_t *point, void *ctx);
+
+// Prepare dir for writing, creating it if needed
+int columnar_open(const char *dir);
+
+// Add a point to the open block of its sensor, sealing the block when full
+int columnar_append(int sensor_id, time_t timestamp, float temperature, unsigned int flags);
+
+// Seal blocks open for longer than COLUMNAR_SEAL_MS, -1 if a block could not be written
+int columnar_commit(void);
+
+// Points of sensor_id appended to its open block, not written yet
+int columnar_unsealed(int sensor_id);
+
+// Seal all open blocks and close the files
+void columnar_close(void);
+
+// Visit the points of sensor_id with from <= timestamp <= to.
+// Returns the number of points visited, -1 on error.
+long long columnar_scan(const char *dir, int sensor_id, time_t from, time_t to,
+                        columnar_scan_fn fn, void *ctx);
+
+// Encode n points (1 to COLUMNAR_BLOCK_POINTS, in time order) into a standalone block
+// in buf, which holds COLUMNAR_BLOCK_MAX_BYTES. Returns the block length, -1 on error.
+int columnar_encode_block(const columnar_point_t *points, int n, uint8_t *buf);
+
+// Visit the points of a block from columnar_encode_block with from <= timestamp <= to.
+// Returns the number of points visited, -1 if the block is corrupt.
+long long columnar_decode_block(const void *block, size_t length, time_t from, time_t to,
+                                columnar_scan_fn fn, void *ctx);
+
+#endif /* STORAGE_COLUMNAR_H */
@@ -0,0 +1,299 @@
+/** @file storage_compact.c
+ *  @brief Implementation of the compaction of old measurements
+ *
+ *  A step reads the oldest partition due in primary key order (sensor,
+ *  time, seq), cuts it into blocks of one sensor, inserts the blocks
+ *  into the archive table and deletes the archived rows, all in one
+ *  transaction. A block cut short by the row budget is left for the
+ *  next step, so blocks are only partial at the end of a sensor.
+ *
+ *  Archive rows keep the time and value range of their block, for
+ *  queries and retention; seq is not kept, the block order replaces it.
+ *
+ *  @author Phuc
+ *  @bug No known bugs.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include "storage_compact.h"
+#include "storage_manager.h"
+#include "storage_partition.h"
+#include "storage_columnar.h"
+#include "log.h"
+#include "metrics.h"
+#include "clock_service.h"
+
+// Expired archive blocks are looked for this often (s), a scan of the archive table
+#define ARCHIVE_EXPIRY_INTERVAL 3600
+
+_Static_assert(STORE_COMPACT_ROWS_PER_STEP >= COLUMNAR_BLOCK_POINTS, "a step must fill at least one block");
+
+static const char *INSERT_ARCHIVE_STMT =
+    "INSERT INTO archive (id, start, stop, count, min, max, block) VALUES (?, ?, ?, ?, ?, ?, ?);";
+
+// Block being filled, and the primary key of the last row archived so far
+typedef struct
+{
+    columnar_point_t points[COLUMNAR_BLOCK_POINTS];
+    int count;
+    int sensor_id;
+    float min;
+    float max;
+    sqlite3_int64 last_time;  // Key of the last row added
+    sqlite3_int64 last_seq;
+    int done_id;              // Key of the last row of the last flushed block
+    sqlite3_int64 done_time;
+    sqlite3_int64 done_seq;
+    uint8_t encoded[COLUMNAR_BLOCK_MAX_BYTES];
+} archive_block_t;
+
+static archive_block_t block;
+static time_t next_expiry = 0;
+
+// First column of the first row of sql, -1 on error
+static long long query_int(sqlite3 *db, const char *sql)
+{
+    sqlite3_stmt *stmt = NULL;
+    long long value = -1;
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) == SQLITE_OK && sqlite3_step(stmt) == SQLITE_ROW)
+        value = sqlite3_column_int64(stmt, 0);
+    sqlite3_finalize(stmt);
+    return value;
+}
+
+// Run SQL, logging failures
+static int exec_sql(sqlite3 *db, const char *sql, const char *what)
+{
+    char *err_msg = NULL;
+
+    if (sqlite3_exec(db, sql, NULL, NULL, &err_msg) != SQLITE_OK)
+    {
+        log_error("Failed to %s: %s", what, err_msg);
+        sqlite3_free(err_msg);
+        return -1;
+    }
+    return 0;
+}
+
+int compact_prepare(sqlite3 *db)
+{
+    long long mode = query_int(db, "PRAGMA auto_vacuum;");
+
+    if (mode == 2) // INCREMENTAL
+        return 0;
+    if (mode < 0 || exec_sql(db, "PRAGMA auto_vacuum=INCREMENTAL;", "enable incremental vacuum") != 0)
+        return -1;
+
+    // A new database picks the mode up with its first table, and FULL switches
+    // freely; only a database created without auto-vacuum has to be rebuilt
+    if (mode == 1 || query_int(db, "SELECT COUNT(*) FROM sqlite_master;") == 0)
+        return 0;
+
+    log_info("Converting database to incremental auto-vacuum (one-time VACUUM)");
+    unsigned long long start_ns = clock_mono_ns();
+    if (exec_sql(db, "VACUUM;", "convert database to incremental auto-vacuum") != 0)
+        return -1;
+
+    log_info("Converted database to incremental auto-vacuum in %.1f s",
+             (clock_mono_ns() - start_ns) / 1e9);
+    return 0;
+}
+
+// Encode the block and insert it into the archive
+static int flush_block(sqlite3_stmt *insert)
+{
+    archive_block_t *b = &block;
+    int length = columnar_encode_block(b->points, b->count, b->encoded);
+
+    if (length < 0 ||
+        sqlite3_bind_int(insert, 1, b->sensor_id) != SQLITE_OK ||
+        sqlite3_bind_int64(insert, 2, (sqlite3_int64)b->points[0].timestamp) != SQLITE_OK ||
+        sqlite3_bind_int64(insert, 3, (sqlite3_int64)b->points[b->count - 1].timestamp) != SQLITE_OK ||
+        sqlite3_bind_int(insert, 4, b->count) != SQLITE_OK ||
+        sqlite3_bind_double(insert, 5, b->min) != SQLITE_OK ||
+        sqlite3_bind_double(insert, 6, b->max) != SQLITE_OK ||
+        sqlite3_bind_blob(insert, 7, b->encoded, length, SQLITE_STATIC) != SQLITE_OK)
+    {
+        sqlite3_reset(insert);
+        return -1;
+    }
+
+    int rc = sqlite3_step(insert);
+    sqlite3_reset(insert);
+    b->count = 0;
+    b->done_id = b->sensor_id;
+    b->done_time = b->last_time;
+    b->done_seq = b->last_seq;
+    return rc == SQLITE_DONE ? 0 : -1;
+}
+
+// Move up to STORE_COMPACT_ROWS_PER_STEP readings of a partition into the archive.
+// Sets *emptied once the partition holds no more readings. Returns the readings moved, -1 on error.
+static int archive_partition(sqlite3 *db, const char *name, int *emptied)
+{
+    archive_block_t *b = &block;
+    sqlite3_stmt *select = NULL;
+    sqlite3_stmt *insert = NULL;
+    sqlite3_stmt *delete = NULL;
+    int rows = 0;
+    int archived = 0; // Rows in flushed blocks, the ones to delete
+    int rc = -1;
+
+    char *sql = sqlite3_mprintf("SELECT id, time, seq, temp, flags FROM %s ORDER BY id, time, seq LIMIT %d;",
+                                name, STORE_COMPACT_ROWS_PER_STEP);
+    if (sql == NULL || sqlite3_prepare_v2(db, sql, -1, &select, NULL) != SQLITE_OK ||
+        sqlite3_prepare_v2(db, INSERT_ARCHIVE_STMT, -1, &insert, NULL) != SQLITE_OK)
+        goto done;
+
+    b->count = 0;
+    int step;
+    while ((step = sqlite3_step(select)) == SQLITE_ROW)
+    {
+        int id = sqlite3_column_int(select, 0);
+
+        // A block holds one sensor
+        if (b->count > 0 && id != b->sensor_id)
+        {
+            if (flush_block(insert) != 0)
+                goto done;
+            archived = rows;
+        }
+
+        columnar_point_t *p = &b->points[b->count];
+        p->timestamp = (time_t)sqlite3_column_int64(select, 1);
+        p->temperature = (float)sqlite3_column_double(select, 3);
+        p->flags = (unsigned int)sqlite3_column_int(select, 4);
+        if (b->count == 0 || p->temperature < b->min)
+            b->min = p->temperature;
+        if (b->count == 0 || p->temperature > b->max)
+            b->max = p->temperature;
+        b->sensor_id = id;
+        b->last_time = sqlite3_column_int64(select, 1);
+        b->last_seq = sqlite3_column_int64(select, 2);
+        b->count++;
+        rows++;
+
+        if (b->count == COLUMNAR_BLOCK_POINTS)
+        {
+            if (flush_block(insert) != 0)
+                goto done;
+            archived = rows;
+        }
+    }
+    if (step != SQLITE_DONE)
+        goto done;
+
+    // Everything left was read, so the last block is complete as well.
+    // Otherwise it may continue past the budget: the next step reads it again.
+    *emptied = rows < STORE_COMPACT_ROWS_PER_STEP;
+    if (*emptied && b->count > 0)
+    {
+        if (flush_block(insert) != 0)
+            goto done;
+        archived = rows;
+    }
+    b->count = 0;
+    sqlite3_finalize(select);
+    select = NULL;
+
+    rc = 0;
+    if (archived == 0)
+        goto done;
+
+    // Rows are archived in key order, so one range covers them
+    sqlite3_free(sql);
+    sql = sqlite3_mprintf("DELETE FROM %s WHERE (id, time, seq) <= (?1, ?2, ?3);", name);
+    if (sql == NULL || sqlite3_prepare_v2(db, sql, -1, &delete, NULL) != SQLITE_OK)
+    {
+        rc = -1;
+        goto done;
+    }
+    sqlite3_bind_int(delete, 1, b->done_id);
+    sqlite3_bind_int64(delete, 2, b->done_time);
+    sqlite3_bind_int64(delete, 3, b->done_seq);
+    if (sqlite3_step(delete) != SQLITE_DONE || sqlite3_changes(db) != archived)
+        rc = -1;
+    else
+        rc = archived;
+
+done:
+    b->count = 0;
+    sqlite3_free(sql);
+    sqlite3_finalize(select);
+    sqlite3_finalize(insert);
+    sqlite3_finalize(delete);
+    return rc;
+}
+
+// Archive a step's worth of the oldest partition due. Returns 1 if one was found, 0 if none, -1 on error.
+static int compact_partition(sqlite3 *db, time_t now)
+{
+    char name[64];
+    sqlite3_stmt *stmt = NULL;
+    int emptied = 0;
+
+    if (sqlite3_prepare_v2(db, "SELECT name FROM partitions WHERE stop <= ? ORDER BY start LIMIT 1;",
+                           -1, &stmt, NULL) != SQLITE_OK)
+        return -1;
+    sqlite3_bind_int64(stmt, 1, (sqlite3_int64)(now - STORE_COMPACT_AFTER_SECONDS));
+    int found = sqlite3_step(stmt) == SQLITE_ROW;
+    if (found)
+        snprintf(name, sizeof(name), "%s", (const char *)sqlite3_column_text(stmt, 0));
+    sqlite3_finalize(stmt);
+    if (!found)
+        return 0;
+
+    if (exec_sql(db, "BEGIN IMMEDIATE;", "begin compaction") != 0)
+        return -1;
+
+    int moved = archive_partition(db, name, &emptied);
+    if (moved < 0 || (emptied && partition_drop(db, name) != 0) ||
+        exec_sql(db, "COMMIT;", "commit compaction") != 0)
+    {
+        log_error("Failed to compact partition %s: %s", name, sqlite3_errmsg(db));
+        sqlite3_exec(db, "ROLLBACK;", NULL, NULL, NULL);
+        // The rollback may have restored a partition forgotten by partition_drop
+        partition_reset();
+        return -1;
+    }
+
+    metrics_add(METRIC_COMPACT_ROWS, moved);
+    if (emptied)
+    {
+        log_info("Archived partition %s", name);
+    }
+    return 1;
+}
+
+int compact_step(sqlite3 *db, time_t now)
+{
+    char sql[128];
+    int rc = compact_partition(db, now);
+    int pending = rc > 0;
+
+    // Archive blocks expire with the retention window, like partitions
+    if (now >= next_expiry)
+    {
+        snprintf(sql, sizeof(sql), "DELETE FROM archive WHERE stop < %lld;", (long long)(now - STORE_RETENTION_SECONDS));
+        if (exec_sql(db, sql, "expire archive blocks") == 0)
+            next_expiry = now + ARCHIVE_EXPIRY_INTERVAL;
+    }
+
+    // Return free pages to the file system a few at a time
+    long long free_pages = query_int(db, "PRAGMA freelist_count;");
+    if (free_pages > 0)
+    {
+        snprintf(sql, sizeof(sql), "PRAGMA incremental_vacuum(%d);", STORE_VACUUM_PAGES_PER_STEP);
+        if (exec_sql(db, sql, "vacuum free pages") != 0)
+            return -1;
+        long long left = query_int(db, "PRAGMA freelist_count;");
+        if (left >= 0 && left < free_pages)
+            metrics_add(METRIC_VACUUM_PAGES, free_pages - left);
+        // No progress means auto-vacuum is off; the pages are still reused
+        if (left > 0 && left < free_pages)
+            pending = 1;
+    }
+
+    return rc < 0 ? -1 : pending;
+}
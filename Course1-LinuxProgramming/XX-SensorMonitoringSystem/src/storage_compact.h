@@ -0,0 +1,36 @@
+/** @file storage_compact.h
+ *  @brief Compaction of old measurements declarations
+ *
+ *  Partitions older than STORE_COMPACT_AFTER_SECONDS are rewritten into
+ *  the archive table as columnar blocks (storage_columnar.h) of up to
+ *  COLUMNAR_BLOCK_POINTS readings of one sensor, and dropped once empty.
+ *  The database uses incremental auto-vacuum, so the freed pages are
+ *  returned to the file system a few at a time instead of by a VACUUM
+ *  that blocks the writer for the whole file.
+ *
+ *  The work is split into steps bounded by STORE_COMPACT_ROWS_PER_STEP
+ *  and STORE_VACUUM_PAGES_PER_STEP, which the storage writer runs
+ *  between groups.
+ *
+ *  All functions are called from the storage manager thread only.
+ *
+ *  @author Phuc
+ *  @bug No known bugs.
+ */
+
+#ifndef STORAGE_COMPACT_H
+#define STORAGE_COMPACT_H
+
+#include <sqlite3.h>
+#include <time.h>
+
+// Switch the database to incremental auto-vacuum before its tables are created.
+// An existing database is converted once with a full VACUUM.
+int compact_prepare(sqlite3 *db);
+
+// Archive up to STORE_COMPACT_ROWS_PER_STEP readings of the oldest partition due,
+// then vacuum up to STORE_VACUUM_PAGES_PER_STEP free pages. Must run outside a
+// transaction. Returns 1 if work is left, 0 if none, -1 on error.
+int compact_step(sqlite3 *db, time_t now);
+
+#endif /* STORAGE_COMPACT_H */
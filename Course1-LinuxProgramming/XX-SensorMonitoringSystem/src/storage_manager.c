@@ -1,7 +1,19 @@
 /** @file storage_manager.c
  *  @brief Implementation of the storage manager
  *
- *  Stores sensor data into a SQLite database.
+ *  Stores sensor data through a storage backend selected at startup:
+ *  the SQLite database (default) or the columnar store (storage_columnar.c).
+ *  This file also holds the SQLite backend.
+ *
+ *  Records are written with group commit: the writer commits, in one
+ *  transaction, everything that was queued while its previous commit
+ *  ran. A stager thread pops and sorts the next group meanwhile.
+ *
+ *  The database runs in WAL mode with synchronous=FULL, so readers do
+ *  not block the writer and every commit is durable; checkpoints run on
+ *  a background thread. Between groups, the writer compacts partitions
+ *  past STORE_COMPACT_AFTER_SECONDS into the archive table in small
+ *  steps (storage_compact.c).
  *
  *  @author Phuc
  *  @bug No known bugs.
@@ -19,6 +31,15 @@
 #include "../include/common.h"
 #include "log.h"
 #include "threads.h"
+#include "clock_service.h"
+#include "metrics.h"
+#include "rollup.h"
+#include "storage_checkpoint.h"
+#include "schema.h"
+#include "storage_partition.h"
+#include "storage_columnar.h"
+#include "storage_compact.h"
+#include "spool.h"
 
 #ifdef _WIN32
 #include <direct.h>
@@ -35,18 +56,181 @@ static const char *DB_NAME = "sensors.db";
 
 static void sqlite_error_log_callback(void *pArg, int iErrCode, const char *zMsg)
 {
-    char msg[512]; // Increased size for safety
-    snprintf(msg, sizeof(msg), "SQLite error %d: %s", iErrCode, zMsg);
-    log_event(msg);
+    log_error("SQLite error %d: %s", iErrCode, zMsg);
 }
 
-void *storage_manager(void *arg)
+// A bucket may be written twice (reopened by a late reading, or split by a restart): merge the parts
+static char rollup_upsert_stmts[ROLLUP_RESOLUTION_COUNT][512];
+
+// Apply journal, sync, cache and mmap settings to the writer connection
+static int configure_connection(sqlite3 *db)
 {
-    thread_args_t *args = (thread_args_t *)arg;
-    sbuffer_t *sb = args->sb;
-    sqlite3 *db = NULL;
+    char sql[256];
+    char *err_msg = NULL;
     sqlite3_stmt *stmt = NULL;
 
+    sqlite3_busy_timeout(db, STORE_BUSY_TIMEOUT_MS);
+
+    // journal_mode reports the mode actually in effect
+    snprintf(sql, sizeof(sql), "PRAGMA journal_mode=%s;", STORE_JOURNAL_MODE);
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK || sqlite3_step(stmt) != SQLITE_ROW)
+    {
+        log_error("Failed to set journal mode: %s", sqlite3_errmsg(db));
+        sqlite3_finalize(stmt);
+        return -1;
+    }
+    log_info("Database journal mode is %s", (const char *)sqlite3_column_text(stmt, 0));
+    sqlite3_finalize(stmt);
+
+    snprintf(sql, sizeof(sql),
+             "PRAGMA synchronous=%s; PRAGMA cache_size=-%d; PRAGMA mmap_size=%lld; PRAGMA temp_store=MEMORY;",
+             STORE_SYNCHRONOUS, STORE_CACHE_SIZE_KB, STORE_MMAP_SIZE);
+    if (sqlite3_exec(db, sql, NULL, NULL, &err_msg) != SQLITE_OK)
+    {
+        log_error("Failed to apply database pragmas: %s", err_msg);
+        sqlite3_free(err_msg);
+        return -1;
+    }
+
+    return 0;
+}
+
+// Build the upsert statement of each rollup resolution
+static void build_rollup_statements(void)
+{
+    for (int r = 0; r < ROLLUP_RESOLUTION_COUNT; r++)
+    {
+        snprintf(rollup_upsert_stmts[r], sizeof(rollup_upsert_stmts[r]),
+                 "INSERT INTO %s (id, start, min, max, avg, count) VALUES (?, ?, ?, ?, ?, ?) "
+                 "ON CONFLICT (id, start) DO UPDATE SET "
+                 "min = MIN(min, excluded.min), "
+                 "max = MAX(max, excluded.max), "
+                 "avg = (avg * count + excluded.avg * excluded.count) / (count + excluded.count), "
+                 "count = count + excluded.count;",
+                 rollup_table(r));
+    }
+}
+
+// Spool sequence numbers committed by the last transaction, see sqlite_recover_spool()
+static const char *SAVE_SPOOL_STMT = "INSERT OR REPLACE INTO spool_commit (id, seqs) VALUES (0, ?);";
+static const char *LOAD_SPOOL_STMT = "SELECT seqs FROM spool_commit WHERE id = 0;";
+
+// Statements prepared once and reused for the lifetime of the storage thread
+typedef struct
+{
+    sqlite3_stmt *upsert_rollup[ROLLUP_RESOLUTION_COUNT];
+    sqlite3_stmt *begin;
+    sqlite3_stmt *commit;
+    sqlite3_stmt *rollback;
+    sqlite3_stmt *save_spool;
+} stmt_cache_t;
+
+static void finalize_statements(stmt_cache_t *cache)
+{
+    for (int r = 0; r < ROLLUP_RESOLUTION_COUNT; r++)
+        sqlite3_finalize(cache->upsert_rollup[r]);
+    sqlite3_finalize(cache->begin);
+    sqlite3_finalize(cache->commit);
+    sqlite3_finalize(cache->rollback);
+    sqlite3_finalize(cache->save_spool);
+    memset(cache, 0, sizeof(*cache));
+}
+
+static int prepare_one(sqlite3 *db, const char *sql, sqlite3_stmt **stmt)
+{
+    int prepare_retries = 0;
+    while (prepare_retries < MAX_RETRIES && sqlite3_prepare_v3(db, sql, -1, SQLITE_PREPARE_PERSISTENT, stmt, NULL) != SQLITE_OK)
+    {
+        log_error("Failed to prepare statement, retry %d/%d: %s", prepare_retries + 1, MAX_RETRIES, sqlite3_errmsg(db));
+        sleep(1);
+        prepare_retries++;
+    }
+    return prepare_retries == MAX_RETRIES ? -1 : 0;
+}
+
+static int prepare_statements(sqlite3 *db, stmt_cache_t *cache)
+{
+    memset(cache, 0, sizeof(*cache));
+
+    if (prepare_one(db, "BEGIN;", &cache->begin) != 0 ||
+        prepare_one(db, "COMMIT;", &cache->commit) != 0 ||
+        prepare_one(db, "ROLLBACK;", &cache->rollback) != 0 ||
+        prepare_one(db, SAVE_SPOOL_STMT, &cache->save_spool) != 0)
+    {
+        finalize_statements(cache);
+        return -1;
+    }
+
+    for (int r = 0; r < ROLLUP_RESOLUTION_COUNT; r++)
+    {
+        if (prepare_one(db, rollup_upsert_stmts[r], &cache->upsert_rollup[r]) != 0)
+        {
+            finalize_statements(cache);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+// Cached statement for a queued record. Readings go to the partition of their timestamp.
+static sqlite3_stmt *record_stmt(sqlite3 *db, stmt_cache_t *cache, const store_record_t *rec)
+{
+    if (rec->type == STORE_ROLLUP)
+        return cache->upsert_rollup[rec->rollup.resolution];
+    return partition_insert_stmt(db, rec->data.timestamp);
+}
+
+// Run a statement without results (BEGIN/COMMIT/ROLLBACK), retrying while the database is busy
+static int step_control(sqlite3_stmt *stmt)
+{
+    int rc = SQLITE_ERROR;
+    for (int retries = 0; retries < MAX_RETRIES; retries++)
+    {
+        rc = sqlite3_step(stmt);
+        sqlite3_reset(stmt);
+        if (rc == SQLITE_DONE)
+            return 0;
+        if (rc != SQLITE_BUSY && rc != SQLITE_LOCKED)
+            break;
+        usleep(100000);
+    }
+    return -1;
+}
+
+// Bind a queued record to the statement returned by record_stmt()
+static int bind_record(sqlite3_stmt *stmt, const store_record_t *rec)
+{
+    if (rec->type == STORE_ROLLUP)
+    {
+        const rollup_bucket_t *b = &rec->rollup;
+        if (sqlite3_bind_int(stmt, 1, b->sensor_id) != SQLITE_OK ||
+            sqlite3_bind_int64(stmt, 2, (sqlite3_int64)b->start) != SQLITE_OK ||
+            sqlite3_bind_double(stmt, 3, b->min) != SQLITE_OK ||
+            sqlite3_bind_double(stmt, 4, b->max) != SQLITE_OK ||
+            sqlite3_bind_double(stmt, 5, b->sum / b->count) != SQLITE_OK ||
+            sqlite3_bind_int(stmt, 6, b->count) != SQLITE_OK)
+            return -1;
+        return 0;
+    }
+
+    if (sqlite3_bind_int(stmt, 1, rec->data.sensor_id) != SQLITE_OK ||
+        sqlite3_bind_int64(stmt, 2, (sqlite3_int64)rec->data.timestamp) != SQLITE_OK ||
+        sqlite3_bind_double(stmt, 3, rec->data.temperature) != SQLITE_OK ||
+        sqlite3_bind_int(stmt, 4, (int)rec->flags) != SQLITE_OK)
+        return -1;
+    return 0;
+}
+
+// SQLite backend state, owned by the storage thread
+static sqlite3 *db = NULL;
+static stmt_cache_t cache;
+static int txn_open = 0;
+static unsigned long long txn_seqs[STORE_TXN_MAX_ROWS]; // Spooled readings in the open transaction
+static int txn_seq_count = 0;
+
+static int sqlite_backend_open(void)
+{
     // Enable SQLite error logging
     sqlite3_config(SQLITE_CONFIG_LOG, sqlite_error_log_callback, NULL);
     sqlite3_initialize();
@@ -56,9 +240,7 @@ void *storage_manager(void *arg)
     snprintf(db_path, sizeof(db_path), "%s%s%s", DB_DIR, PATH_SEPARATOR, DB_NAME);
 
     // Log the database path for debugging
-    char msg[512]; // Increased from 256 to 512 to avoid truncation warnings
-    snprintf(msg, sizeof(msg), "Attempting to open database at %s", db_path);
-    log_event(msg);
+    log_info("Attempting to open database at %s", db_path);
 
     // Ensure the directory exists
     if (access(DB_DIR, F_OK) == -1)
@@ -66,9 +248,8 @@ void *storage_manager(void *arg)
         if (mkdir(DB_DIR, 0777) == -1 && errno != EEXIST)
         {
             perror("Failed to create database directory");
-            snprintf(msg, sizeof(msg), "Failed to create database directory: %s", strerror(errno));
-            log_event(msg);
-            return NULL;
+            log_error("Failed to create database directory: %s", strerror(errno));
+            return -1;
         }
     }
 
@@ -76,129 +257,605 @@ void *storage_manager(void *arg)
     int rc = sqlite3_open(db_path, &db);
     if (rc != SQLITE_OK)
     {
-        snprintf(msg, sizeof(msg), "Failed to open database at %s: %s", db_path, sqlite3_errmsg(db));
-        log_event(msg);
+        log_error("Failed to open database at %s: %s", db_path, sqlite3_errmsg(db));
         printf("SQLite error: %s\n", sqlite3_errmsg(db));
         if (db)
             sqlite3_close(db);
-        return NULL;
+        db = NULL;
+        return -1;
     }
 
-    snprintf(msg, sizeof(msg), "Connected to database %s", db_path);
-    log_event(msg);
-    time_t now = time(NULL);
-    char time_str[26];
-    ctime_r(&now, time_str);
-    time_str[strlen(time_str) - 1] = '\0';
-    printf("%s: Connected to database %s\n", time_str, db_path);
-
-    // Create table if it doesn't exist
-    static const char *CREATE_TABLE =
-        "CREATE TABLE IF NOT EXISTS measurements ("
-        "id INTEGER NOT NULL, "
-        "temp REAL NOT NULL, "
-        "time INTEGER NOT NULL"
-        ");";
-    char *err_msg = NULL;
-    if (sqlite3_exec(db, CREATE_TABLE, NULL, NULL, &err_msg) != SQLITE_OK)
+    log_info("Connected to database %s", db_path);
+    printf("%s: Connected to database %s\n", clock_now_str(), db_path);
+
+    // Compaction frees pages; incremental auto-vacuum hands them back without a full VACUUM.
+    // A new database only takes the mode before anything is written, even the WAL setting.
+    if (compact_prepare(db) != 0)
+        log_warn("Incremental vacuum unavailable, pages freed by compaction are reused but not released");
+
+    if (configure_connection(db) != 0)
+        goto fail;
+
+    // Bring the database up to the latest schema version
+    int version = schema_migrate(db);
+    if (version < 0)
     {
-        snprintf(msg, sizeof(msg), "Failed to create table: %s", err_msg);
-        log_event(msg);
-        printf("Failed to create table: %s\n", err_msg);
-        sqlite3_free(err_msg);
-        sqlite3_close(db);
-        return NULL;
+        printf("Failed to migrate database schema\n");
+        goto fail;
+    }
+    log_info("Database schema at version %d", version);
+    printf("%s: Table measurements ready\n", clock_now_str());
+
+    build_rollup_statements();
+
+    if (prepare_statements(db, &cache) != 0)
+    {
+        log_error("Max retries reached for preparing SQL statements, storage manager stopping.");
+        goto fail;
     }
-    log_event("New table measurements created or already exists");
-    now = time(NULL);
-    ctime_r(&now, time_str);
-    time_str[strlen(time_str) - 1] = '\0';
-    printf("%s: Table measurements ready\n", time_str);
 
-    // Main loop
-    while (!shutdown_flag)
+    if (partition_init(db) != 0)
     {
-        sensor_data_t data;
+        log_error("Failed to set up measurement partitions, storage manager stopping.");
+        finalize_statements(&cache);
+        goto fail;
+    }
 
-        if (shutdown_flag)
-            break;
+    // Checkpoints run in the background. Disabling SQLite's own checkpoint on commit
+    // replaces its WAL hook, so it must happen before checkpoint_start() installs ours.
+    sqlite3_wal_autocheckpoint(db, 0);
+    if (checkpoint_start(db_path, db) != 0)
+    {
+        log_warn("Falling back to automatic WAL checkpoints");
+        sqlite3_wal_autocheckpoint(db, STORE_CHECKPOINT_PAGES);
+    }
 
-        int pop_retries = 0;
-        while (pop_retries < MAX_RETRIES && sbuffer_pop(sb, &data) != 0)
+    return 0;
+
+fail:
+    sqlite3_close(db);
+    db = NULL;
+    return -1;
+}
+
+// Write one record inside the open transaction, opening it first if needed
+static int sqlite_backend_append(const store_record_t *rec)
+{
+    if (!txn_open)
+    {
+        if (step_control(cache.begin) != 0)
         {
-            if (shutdown_flag)
-                goto cleanup;
-            snprintf(msg, sizeof(msg), "Failed to pop data from sbuffer, retry %d/%d", pop_retries + 1, MAX_RETRIES);
-            log_event(msg);
-            sleep(1);
-            pop_retries++;
+            log_error("Failed to begin transaction: %s", sqlite3_errmsg(db));
+            return -1;
         }
+        txn_open = 1;
+    }
+
+    sqlite3_stmt *stmt = record_stmt(db, &cache, rec);
+    if (stmt == NULL)
+    {
+        log_warn("No partition for reading (outside retention window), skipping this data point.");
+        return -1;
+    }
+    if (bind_record(stmt, rec) != 0)
+    {
+        log_error("Failed to bind values to SQL statement");
+        sqlite3_reset(stmt);
+        return -1;
+    }
+
+    int step_retries = 0;
+    while (step_retries < MAX_RETRIES && sqlite3_step(stmt) != SQLITE_DONE)
+    {
+        sqlite3_reset(stmt);
+        log_error("Failed to insert row, retry %d/%d", step_retries + 1, MAX_RETRIES);
+        usleep(100000);
+        step_retries++;
+    }
+    sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
+
+    if (step_retries == MAX_RETRIES)
+    {
+        log_error("Max retries reached for inserting row, skipping this data point.");
+        return -1;
+    }
 
-        if (pop_retries == MAX_RETRIES)
+    if (rec->type == STORE_MEASUREMENT && rec->spool_seq != 0 && txn_seq_count < STORE_TXN_MAX_ROWS)
+        txn_seqs[txn_seq_count++] = rec->spool_seq;
+    return 0;
+}
+
+static int sqlite_backend_commit(void)
+{
+    if (!txn_open)
+        return 0;
+    txn_open = 0;
+
+    // Replaces the previous group's marker, whose readings are released by now
+    sqlite3_bind_blob(cache.save_spool, 1, txn_seqs, txn_seq_count * (int)sizeof(txn_seqs[0]), SQLITE_STATIC);
+    if (sqlite3_step(cache.save_spool) != SQLITE_DONE)
+    {
+        log_error("Failed to record spooled readings of the transaction: %s", sqlite3_errmsg(db));
+    }
+    sqlite3_reset(cache.save_spool);
+    txn_seq_count = 0;
+
+    if (step_control(cache.commit) != 0)
+    {
+        log_error("Failed to commit, rolling back: %s", sqlite3_errmsg(db));
+        step_control(cache.rollback);
+        // The rollback may have undone partitions created in the transaction
+        partition_reset();
+        return -1;
+    }
+    return 0;
+}
+
+static void sqlite_backend_close(void)
+{
+    sqlite_backend_commit();
+    checkpoint_stop();
+    finalize_statements(&cache);
+    partition_reset();
+    if (db && sqlite3_close(db) != SQLITE_OK)
+    {
+        log_error("Failed to close database");
+    }
+    db = NULL;
+}
+
+// Compact old partitions between groups; the writer never has a transaction open here
+static int sqlite_backend_maintain(void)
+{
+    if (db == NULL || txn_open)
+        return 0;
+    return compact_step(db, clock_now()) > 0;
+}
+
+// A crash during the commit's fsync leaves the group committed but still in the
+// spool. Its sequence numbers were committed with it, so release them before replay.
+static void sqlite_recover_spool(void)
+{
+    char db_path[256];
+    sqlite3 *rdb = NULL;
+    sqlite3_stmt *stmt = NULL;
+
+    snprintf(db_path, sizeof(db_path), "%s%s%s", DB_DIR, PATH_SEPARATOR, DB_NAME);
+    if (sqlite3_open_v2(db_path, &rdb, SQLITE_OPEN_READWRITE, NULL) != SQLITE_OK)
+    {
+        sqlite3_close(rdb);
+        return; // No database yet
+    }
+
+    // Older schema versions have no marker yet
+    if (sqlite3_prepare_v2(rdb, LOAD_SPOOL_STMT, -1, &stmt, NULL) == SQLITE_OK && sqlite3_step(stmt) == SQLITE_ROW)
+    {
+        int n = sqlite3_column_bytes(stmt, 0) / (int)sizeof(unsigned long long);
+        unsigned long long *seqs = n > 0 ? malloc(sizeof(unsigned long long) * n) : NULL;
+        if (seqs != NULL)
         {
-            log_event("Max retries reached for popping data, skipping...");
-            continue;
+            memcpy(seqs, sqlite3_column_blob(stmt, 0), sizeof(unsigned long long) * n);
+            spool_release(seqs, n);
+            free(seqs);
+        }
+    }
+
+    sqlite3_finalize(stmt);
+    sqlite3_close(rdb);
+}
+
+const storage_backend_t sqlite_backend = {
+    .name = "sqlite",
+    .open = sqlite_backend_open,
+    .append = sqlite_backend_append,
+    .commit = sqlite_backend_commit,
+    .close = sqlite_backend_close,
+    .idle_ms = 0,
+    .in_memory = NULL,
+    .recover_spool = sqlite_recover_spool,
+    .maintain = sqlite_backend_maintain,
+};
+
+static const storage_backend_t *backends[] = {&sqlite_backend, &columnar_backend};
+static const storage_backend_t *backend = &sqlite_backend;
+
+int storage_set_backend(const char *name)
+{
+    for (size_t i = 0; i < sizeof(backends) / sizeof(backends[0]); i++)
+    {
+        if (strcmp(backends[i]->name, name) == 0)
+        {
+            backend = backends[i];
+            return 0;
         }
+    }
+    return -1;
+}
+
+const storage_backend_t *storage_get_backend(void)
+{
+    return backend;
+}
+
+// Group commit hand-off between the stager and the writer
+typedef struct
+{
+    store_record_t *recs;
+    int count;
+} store_batch_t;
+
+static store_batch_t batches[2];
+static pthread_mutex_t group_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t group_cond = PTHREAD_COND_INITIALIZER;
+static int ready_batch = -1; // Batch handed to the writer, -1 if none
+static int writer_busy = 0;  // Writer is committing a batch
+static int stager_done = 0;  // Storage queue closed and drained
+
+// Raw readings first, by partition, sensor and time, so each partition's
+// clustered index is written sequentially. Rollup buckets follow.
+static int compare_records(const void *a, const void *b)
+{
+    const store_record_t *x = a;
+    const store_record_t *y = b;
+
+    if (x->type != y->type)
+        return x->type == STORE_MEASUREMENT ? -1 : 1;
+
+    if (x->type == STORE_MEASUREMENT)
+    {
+        time_t px = x->data.timestamp / STORE_PARTITION_SECONDS;
+        time_t py = y->data.timestamp / STORE_PARTITION_SECONDS;
+        if (px != py)
+            return px < py ? -1 : 1;
+        if (x->data.sensor_id != y->data.sensor_id)
+            return x->data.sensor_id < y->data.sensor_id ? -1 : 1;
+        if (x->data.timestamp != y->data.timestamp)
+            return x->data.timestamp < y->data.timestamp ? -1 : 1;
+    }
+    else
+    {
+        if (x->rollup.resolution != y->rollup.resolution)
+            return x->rollup.resolution < y->rollup.resolution ? -1 : 1;
+        if (x->rollup.sensor_id != y->rollup.sensor_id)
+            return x->rollup.sensor_id < y->rollup.sensor_id ? -1 : 1;
+        if (x->rollup.start != y->rollup.start)
+            return x->rollup.start < y->rollup.start ? -1 : 1;
+    }
+
+    // Keep arrival order between readings stamped the same second
+    if (x->enqueue_ns != y->enqueue_ns)
+        return x->enqueue_ns < y->enqueue_ns ? -1 : 1;
+    return 0;
+}
+
+// Spooled readings committed but possibly still in the backend's memory, in append order
+typedef struct
+{
+    unsigned long long seq;
+    int sensor_id;
+} held_seq_t;
+
+static held_seq_t held[SPOOL_RECORDS];
+static int held_count = 0;
+
+// Release the held readings the backend has persisted, or all of them
+static void release_held(int all)
+{
+    int total[MAX_SENSORS] = {0};
+    unsigned long long batch[256];
+    int n = 0;
+    int kept = 0;
 
-        static const char *INSERT_STMT = "INSERT INTO measurements VALUES (?, ?, ?);";
-        int prepare_retries = 0;
-        while (prepare_retries < MAX_RETRIES && sqlite3_prepare_v2(db, INSERT_STMT, -1, &stmt, NULL) != SQLITE_OK)
+    for (int i = 0; i < held_count; i++)
+        total[held[i].sensor_id]++;
+
+    // Only the newest in_memory(s) readings of a sensor can still be in memory
+    for (int s = 0; s < MAX_SENSORS; s++)
+    {
+        if (total[s] > 0 && !all && backend->in_memory != NULL)
+            total[s] -= backend->in_memory(s);
+    }
+
+    for (int i = 0; i < held_count; i++)
+    {
+        if (total[held[i].sensor_id]-- <= 0)
+        {
+            held[kept++] = held[i];
+            continue;
+        }
+        batch[n++] = held[i].seq;
+        if (n == 256)
         {
-            snprintf(msg, sizeof(msg), "Failed to prepare insert statement, retry %d/%d", prepare_retries + 1, MAX_RETRIES);
-            log_event(msg);
-            sleep(1);
-            prepare_retries++;
+            spool_release(batch, n);
+            n = 0;
         }
+    }
+    spool_release(batch, n);
+    held_count = kept;
+}
+
+// Commit without new records, so that the backend persists what it still holds
+static void commit_idle(void)
+{
+    if (backend->commit() == 0)
+        release_held(0);
+}
+
+static unsigned long long next_maintain_ns = 0;
+
+// Run a step of the backend's background work once it is due
+static void maintain_if_due(void)
+{
+    if (backend->maintain == NULL || clock_mono_ns() < next_maintain_ns)
+        return;
 
-        if (prepare_retries == MAX_RETRIES)
+    // Pending work continues soon, but leaves room for the groups in between
+    int more = backend->maintain();
+    next_maintain_ns = clock_mono_ns() + (more ? STORE_COMPACT_STEP_GAP_MS : STORE_COMPACT_INTERVAL_MS) * 1000000ULL;
+}
+
+// How long the writer may wait for records before it has idle work to do, -1 for ever
+static int idle_wait_ms(void)
+{
+    int wait_ms = backend->idle_ms > 0 ? backend->idle_ms : -1;
+
+    if (backend->maintain != NULL)
+    {
+        unsigned long long now_ns = clock_mono_ns();
+        int due_ms = next_maintain_ns > now_ns ? (int)((next_maintain_ns - now_ns + 999999) / 1000000) : 0;
+        if (wait_ms < 0 || due_ms < wait_ms)
+            wait_ms = due_ms;
+    }
+    return wait_ms;
+}
+
+// Nothing arrived for a while: let the backend persist and maintain
+static void on_idle(void)
+{
+    commit_idle();
+    maintain_if_due();
+}
+
+// Append a group of records and commit them at once
+static void write_group(store_record_t *recs, int n)
+{
+    int rows = 0;
+    int measurement_rows = 0;
+    unsigned long long enqueue_ns_sum = 0;
+
+    for (int i = 0; i < n; i++)
+    {
+        if (backend->append(&recs[i]) != 0)
         {
-            log_event("Max retries reached for preparing SQL statement, skipping this data point.");
+            // Skipped readings will never be stored, so the spool must not replay them
+            if (recs[i].type == STORE_MEASUREMENT)
+                spool_release(&recs[i].spool_seq, 1);
+            recs[i].spool_seq = 0;
             continue;
         }
+        rows++;
+        if (recs[i].type == STORE_MEASUREMENT)
+        {
+            measurement_rows++;
+            enqueue_ns_sum += recs[i].enqueue_ns;
+        }
+    }
+
+    // Readings still waiting in the pipeline reach the disk with the same group
+    spool_sync();
+
+    unsigned long long start_ns = clock_mono_ns();
+    int rc = backend->commit();
+    unsigned long long now_ns = clock_mono_ns();
 
-        if (sqlite3_bind_int(stmt, 1, data.sensor_id) != SQLITE_OK ||
-            sqlite3_bind_double(stmt, 2, data.temperature) != SQLITE_OK ||
-            sqlite3_bind_int64(stmt, 3, (sqlite3_int64)data.timestamp) != SQLITE_OK)
+    if (rc == 0)
+    {
+        for (int i = 0; i < n; i++)
         {
-            log_event("Failed to bind values to SQL statement");
-            goto cleanup_stmt;
+            if (recs[i].type == STORE_MEASUREMENT && recs[i].spool_seq != 0 && held_count < SPOOL_RECORDS)
+                held[held_count++] = (held_seq_t){recs[i].spool_seq, recs[i].data.sensor_id};
         }
+        release_held(0);
+    }
+
+    if (rows == 0)
+        return;
+
+    if (rc == 0)
+    {
+        metrics_add(METRIC_STORE_ROWS, measurement_rows);
+        metrics_add(METRIC_STORE_LATENCY_NS, now_ns * measurement_rows - enqueue_ns_sum);
+        metrics_add(METRIC_STORE_COMMITS, 1);
+        metrics_observe(HIST_COMMIT_ROWS, rows);
+        metrics_observe(HIST_COMMIT_US, (now_ns - start_ns) / 1000);
+
+        log_debug("Committed %d rows to %s storage", rows, backend->name);
+    }
+    else
+    {
+        log_error("Failed to commit %d rows, spooled readings are kept for the next start", rows);
+    }
+}
+
+// Stager thread: pops and sorts the next group while the writer commits the
+// current one, and hands it over as soon as the writer is idle
+static void *stager(void *arg)
+{
+    store_queue_t *sq = arg;
+    int fill = 0;
+    int closed = 0;
+
+    while (1)
+    {
+        store_batch_t *b = &batches[fill];
+        int room = STORE_TXN_MAX_ROWS - b->count;
+
+        if (!closed && room > 0)
+        {
+            // Wait for data when empty, otherwise only briefly so an idle writer is noticed
+            int n = store_queue_pop_batch(sq, b->recs + b->count, room, b->count > 0 ? STORE_STAGE_POLL_MS : -1);
+            if (n < 0)
+                closed = 1;
+            else
+                b->count += n;
+        }
+
+        pthread_mutex_lock(&group_mutex);
+        // A full batch, or the last one, waits for the writer
+        while ((b->count == STORE_TXN_MAX_ROWS || closed) && b->count > 0 && (writer_busy || ready_batch >= 0))
+            pthread_cond_wait(&group_cond, &group_mutex);
+
+        if (b->count > 0 && !writer_busy && ready_batch < 0)
+        {
+            qsort(b->recs, b->count, sizeof(store_record_t), compare_records);
+            ready_batch = fill;
+            // The writer is idle, so it is done with the other batch
+            fill ^= 1;
+            batches[fill].count = 0;
+            pthread_cond_broadcast(&group_cond);
+        }
+
+        if (closed && batches[fill].count == 0)
+        {
+            stager_done = 1;
+            pthread_cond_broadcast(&group_cond);
+            pthread_mutex_unlock(&group_mutex);
+            break;
+        }
+        pthread_mutex_unlock(&group_mutex);
+    }
+
+    return NULL;
+}
 
-        int step_retries = 0;
-        while (step_retries < MAX_RETRIES && sqlite3_step(stmt) != SQLITE_DONE)
+// Writer fed by the stager thread
+static void write_staged(void)
+{
+    while (1)
+    {
+        pthread_mutex_lock(&group_mutex);
+        while (ready_batch < 0 && !stager_done)
         {
-            snprintf(msg, sizeof(msg), "Failed to insert row, retry %d/%d", step_retries + 1, MAX_RETRIES);
-            log_event(msg);
-            sleep(1);
-            step_retries++;
+            int wait_ms = idle_wait_ms();
+            if (wait_ms < 0)
+            {
+                pthread_cond_wait(&group_cond, &group_mutex);
+                continue;
+            }
+
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += wait_ms / 1000;
+            deadline.tv_nsec += (long)(wait_ms % 1000) * 1000000L;
+            if (deadline.tv_nsec >= 1000000000L)
+            {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000L;
+            }
+            if (pthread_cond_timedwait(&group_cond, &group_mutex, &deadline) == ETIMEDOUT)
+            {
+                pthread_mutex_unlock(&group_mutex);
+                on_idle();
+                pthread_mutex_lock(&group_mutex);
+            }
         }
 
-        if (step_retries == MAX_RETRIES)
+        if (ready_batch < 0)
         {
-            log_event("Max retries reached for inserting row, skipping this data point.");
-            goto cleanup_stmt;
+            pthread_mutex_unlock(&group_mutex);
+            return; // Stager done and nothing left
         }
 
-        log_event("Inserted a row to SQL table");
+        store_batch_t *b = &batches[ready_batch];
+        ready_batch = -1;
+        writer_busy = 1;
+        pthread_mutex_unlock(&group_mutex);
+
+        write_group(b->recs, b->count);
+
+        pthread_mutex_lock(&group_mutex);
+        writer_busy = 0;
+        pthread_cond_broadcast(&group_cond);
+        int idle = ready_batch < 0;
+        pthread_mutex_unlock(&group_mutex);
+
+        // Under steady load the writer never times out waiting; maintain between groups
+        if (idle)
+            maintain_if_due();
+    }
+}
+
+// Writer popping its groups itself
+static void write_direct(store_queue_t *sq)
+{
+    store_batch_t *b = &batches[0];
 
-    cleanup_stmt:
-        if (stmt)
+    while (1)
+    {
+        int n = store_queue_pop_batch(sq, b->recs, STORE_TXN_MAX_ROWS, idle_wait_ms());
+        if (n < 0)
+            return; // Queue closed and drained
+        if (n == 0)
         {
-            sqlite3_finalize(stmt);
-            stmt = NULL;
+            on_idle();
+            continue;
         }
+        qsort(b->recs, n, sizeof(store_record_t), compare_records);
+        write_group(b->recs, n);
+        maintain_if_due();
     }
+}
 
-cleanup:
-    if (stmt)
+void *storage_manager(void *arg)
+{
+    thread_args_t *args = (thread_args_t *)arg;
+    store_queue_t *sq = args->sq;
+    pthread_t stager_thread;
+    int stager_running = 0;
+
+    log_info("Storage backend: %s", backend->name);
+
+    for (int i = 0; i < 2; i++)
     {
-        sqlite3_finalize(stmt);
+        batches[i].count = 0;
+        batches[i].recs = malloc(sizeof(store_record_t) * STORE_TXN_MAX_ROWS);
     }
-    if (db && sqlite3_close(db) != SQLITE_OK)
+    if (batches[0].recs == NULL || batches[1].recs == NULL || backend->open() != 0)
     {
-        log_event("Failed to close database");
+        log_error("Storage manager failed to start");
+        free(batches[0].recs);
+        free(batches[1].recs);
+        store_queue_consumer_done(sq);
+        threads_mark_exit();
+        return NULL;
     }
-    log_event("Storage manager shutting down");
+
+    // Group commit: each commit takes everything queued while the previous one ran,
+    // so the group size follows the commit (fsync) latency instead of a timer
+    if (STORE_STAGER_ENABLED && pthread_create(&stager_thread, NULL, stager, sq) == 0)
+        stager_running = 1;
+    else if (STORE_STAGER_ENABLED)
+        log_error("Failed to start storage stager, popping in the writer");
+
+    if (stager_running)
+    {
+        write_staged();
+        pthread_join(stager_thread, NULL);
+    }
+    else
+    {
+        write_direct(sq);
+    }
+
+    // Closing persists everything the backend still held
+    backend->close();
+    release_held(1);
+    free(batches[0].recs);
+    free(batches[1].recs);
+    log_info("Storage manager shutting down");
+    store_queue_consumer_done(sq);
+    threads_mark_exit();
 
     return NULL;
-}
\ No newline at end of file
+}
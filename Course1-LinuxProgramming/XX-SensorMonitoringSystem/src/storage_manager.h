@@ -2,9 +2,68 @@
 #define STORAGE_MANAGER_H
 
 #include "sbuffer.h"
+#include "store_queue.h"
 #include "log.h"
 #include "threads.h"
 
+// Group commit: each commit takes every record queued while the previous one ran, up to this many
+#define STORE_TXN_MAX_ROWS 4096
+// Stager thread popping and sorting the next group while the writer commits (0 to pop in the writer)
+#define STORE_STAGER_ENABLED 1
+// How often the stager checks whether the writer is idle while it holds records (ms)
+#define STORE_STAGE_POLL_MS 2
+
+// Connection tuning for the sensors.db writer
+#define STORE_JOURNAL_MODE "WAL"              // Readers never block the writer and vice versa
+#define STORE_SYNCHRONOUS "FULL"              // fsync the WAL on every commit, paid once per group
+#define STORE_CACHE_SIZE_KB 16384             // Page cache size
+#define STORE_MMAP_SIZE (256LL * 1024 * 1024) // Memory-mapped I/O window
+#define STORE_BUSY_TIMEOUT_MS 5000            // Wait this long for locks held by other connections
+
+// Background checkpoint policy
+#define STORE_CHECKPOINT_INTERVAL_MS 1000 // Checkpoint at least this often...
+#define STORE_CHECKPOINT_PAGES 1000       // ...or as soon as the WAL holds this many pages
+#define STORE_WAL_TRUNCATE_PAGES 10000    // Reset the WAL file once it grew this large
+
+// Time partitioning of raw measurements
+#define STORE_PARTITION_SECONDS 86400        // One measurements_<date> table per day
+#define STORE_RETENTION_SECONDS (30 * 86400) // Drop partitions whose whole range is older than this
+#define STORE_PARTITION_CACHE 4              // Insert statements kept for recently written partitions
+
+// Compaction of old partitions into the archive table (storage_compact.c)
+#define STORE_COMPACT_AFTER_SECONDS (7 * 86400) // Archive partitions whose whole range is older than this
+#define STORE_COMPACT_INTERVAL_MS 1000          // Look for maintenance work this often
+#define STORE_COMPACT_STEP_GAP_MS 20            // Pause between steps while work is pending
+#define STORE_COMPACT_ROWS_PER_STEP 8192        // Readings moved per step (one transaction)
+#define STORE_VACUUM_PAGES_PER_STEP 256         // Free pages returned to the file system per step
+
+// Backend used when none is given on the command line
+#define STORE_BACKEND_DEFAULT "sqlite"
+
+// Storage backend. The storage writer appends one group of records at a
+// time and commits it as a whole.
+typedef struct
+{
+    const char *name;
+    int (*open)(void);                         // -1 if storage is unusable
+    int (*append)(const store_record_t *rec);  // -1 if the record was skipped
+    int (*commit)(void);                       // Make appended records durable, -1 if they were lost
+    void (*close)(void);                       // Commit and release everything
+    int idle_ms;                               // Also call commit this often without new records, 0 for never
+    int (*in_memory)(int sensor_id);           // Committed readings of sensor_id not persisted yet, NULL if commit persists all
+    void (*recover_spool)(void);               // Release spooled readings committed right before a crash, NULL if unknown
+    int (*maintain)(void);                     // One bounded step of background work, 1 if more is pending; NULL for none
+} storage_backend_t;
+
+extern const storage_backend_t sqlite_backend;
+extern const storage_backend_t columnar_backend;
+
+// Select the backend by name before the storage thread starts, -1 if unknown
+int storage_set_backend(const char *name);
+
+// Backend in use
+const storage_backend_t *storage_get_backend(void);
+
 void* storage_manager(void* arg);
 
 #endif /* STORAGE_MANAGER_H */
@@ -0,0 +1,260 @@
+/** @file storage_partition.c
+ *  @brief Implementation of time-partitioned measurements
+ *
+ *  A partition covers [start, stop) and is named after its start date,
+ *  e.g. measurements_20250414 for daily partitions. Each one has the
+ *  clustered (id, time, seq) layout and its own flagged-row index.
+ *
+ *  The measurements view is rebuilt whenever a partition is created or
+ *  dropped, so readers always see exactly the retained partitions.
+ *
+ *  @author Phuc
+ *  @bug No known bugs.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "storage_partition.h"
+#include "storage_manager.h"
+#include "log.h"
+#include "clock_service.h"
+
+#define PARTITION_NAME_SIZE 64
+// Partitions dropped per retention pass; the rest go on the next pass
+#define PARTITION_DROP_MAX 64
+
+// Insert statement of a recently written partition
+typedef struct
+{
+    time_t start;                    // Partition start, -1 when the slot is unused
+    char name[PARTITION_NAME_SIZE];
+    sqlite3_stmt *insert;
+    unsigned long long last_used;
+} partition_slot_t;
+
+static partition_slot_t slots[STORE_PARTITION_CACHE];
+static unsigned long long use_tick = 0;
+
+static void partition_name(time_t start, char *name, size_t size)
+{
+    struct tm tm;
+    char date[32];
+
+    gmtime_r(&start, &tm);
+    if (STORE_PARTITION_SECONDS % 86400 == 0)
+        strftime(date, sizeof(date), "%Y%m%d", &tm);
+    else
+        strftime(date, sizeof(date), "%Y%m%d_%H%M%S", &tm);
+    snprintf(name, size, "measurements_%s", date);
+}
+
+// Run SQL built with sqlite3_str, logging failures
+static int exec_str(sqlite3 *db, sqlite3_str *str, const char *what)
+{
+    char *err_msg = NULL;
+    char *sql = sqlite3_str_finish(str);
+
+    if (sql == NULL)
+    {
+        log_error("Out of memory building SQL to %s", what);
+        return -1;
+    }
+
+    int rc = sqlite3_exec(db, sql, NULL, NULL, &err_msg);
+    sqlite3_free(sql);
+    if (rc != SQLITE_OK)
+    {
+        log_error("Failed to %s: %s", what, err_msg);
+        sqlite3_free(err_msg);
+        return -1;
+    }
+    return 0;
+}
+
+// Recreate the measurements view over all partitions, oldest first
+static int rebuild_view(sqlite3 *db)
+{
+    sqlite3_stmt *stmt = NULL;
+    sqlite3_str *sql = sqlite3_str_new(db);
+    int count = 0;
+
+    sqlite3_str_appendall(sql, "DROP VIEW IF EXISTS measurements; CREATE VIEW measurements AS ");
+    if (sqlite3_prepare_v2(db, "SELECT name FROM partitions ORDER BY start;", -1, &stmt, NULL) != SQLITE_OK)
+    {
+        sqlite3_free(sqlite3_str_finish(sql));
+        return -1;
+    }
+    while (sqlite3_step(stmt) == SQLITE_ROW)
+    {
+        if (count++ > 0)
+            sqlite3_str_appendall(sql, " UNION ALL ");
+        sqlite3_str_appendf(sql, "SELECT id, time, seq, temp, flags FROM %s", (const char *)sqlite3_column_text(stmt, 0));
+    }
+    sqlite3_finalize(stmt);
+
+    // Keep the view's columns even with no partition left
+    if (count == 0)
+        sqlite3_str_appendall(sql, "SELECT 0 AS id, 0 AS time, 0 AS seq, 0.0 AS temp, 0 AS flags WHERE 0");
+    sqlite3_str_appendall(sql, ";");
+
+    return exec_str(db, sql, "rebuild measurements view");
+}
+
+// Create the partition starting at start if it does not exist yet.
+// Returns 1 if it was created, 0 if it existed, -1 on error.
+static int ensure_partition(sqlite3 *db, time_t start, const char *name)
+{
+    sqlite3_str *sql = sqlite3_str_new(db);
+
+    sqlite3_str_appendf(sql,
+                        "CREATE TABLE IF NOT EXISTS %s ("
+                        "id INTEGER NOT NULL, "
+                        "time INTEGER NOT NULL, "
+                        "seq INTEGER NOT NULL, "
+                        "temp REAL NOT NULL, "
+                        "flags INTEGER NOT NULL DEFAULT 0, "
+                        "PRIMARY KEY (id, time, seq)"
+                        ") WITHOUT ROWID, STRICT;"
+                        "CREATE INDEX IF NOT EXISTS idx_%s_flagged ON %s(id, time) WHERE flags != 0;"
+                        "INSERT OR IGNORE INTO partitions (name, start, stop) VALUES ('%s', %lld, %lld);",
+                        name, name, name, name,
+                        (long long)start, (long long)(start + STORE_PARTITION_SECONDS));
+    if (exec_str(db, sql, "create partition") != 0)
+        return -1;
+
+    // Changes of the last statement, the catalog insert
+    if (sqlite3_changes(db) == 0)
+        return 0;
+
+    log_info("Created partition %s", name);
+    return rebuild_view(db) == 0 ? 1 : -1;
+}
+
+static void release_slot(partition_slot_t *slot)
+{
+    sqlite3_finalize(slot->insert);
+    memset(slot, 0, sizeof(*slot));
+    slot->start = -1;
+}
+
+void partition_reset(void)
+{
+    for (int i = 0; i < STORE_PARTITION_CACHE; i++)
+        release_slot(&slots[i]);
+}
+
+// Release the cached insert statement of a partition about to be dropped
+static void forget_partition(const char *name)
+{
+    for (int i = 0; i < STORE_PARTITION_CACHE; i++)
+    {
+        if (slots[i].insert && strcmp(slots[i].name, name) == 0)
+            release_slot(&slots[i]);
+    }
+}
+
+int partition_drop(sqlite3 *db, const char *name)
+{
+    sqlite3_str *sql = sqlite3_str_new(db);
+
+    forget_partition(name);
+    sqlite3_str_appendf(sql, "DROP TABLE IF EXISTS %s; DELETE FROM partitions WHERE name = '%s';", name, name);
+    if (exec_str(db, sql, "drop partition") != 0 || rebuild_view(db) != 0)
+        return -1;
+    return 0;
+}
+
+int partition_apply_retention(sqlite3 *db, time_t now)
+{
+    char names[PARTITION_DROP_MAX][PARTITION_NAME_SIZE];
+    sqlite3_stmt *stmt = NULL;
+    int count = 0;
+
+    // Collect first: a table cannot be dropped while a statement reads the catalog
+    if (sqlite3_prepare_v2(db, "SELECT name FROM partitions WHERE stop <= ? ORDER BY start LIMIT ?;", -1, &stmt, NULL) != SQLITE_OK)
+    {
+        log_error("Failed to read partitions: %s", sqlite3_errmsg(db));
+        return -1;
+    }
+    sqlite3_bind_int64(stmt, 1, (sqlite3_int64)(now - STORE_RETENTION_SECONDS));
+    sqlite3_bind_int(stmt, 2, PARTITION_DROP_MAX);
+    while (sqlite3_step(stmt) == SQLITE_ROW)
+        snprintf(names[count++], PARTITION_NAME_SIZE, "%s", (const char *)sqlite3_column_text(stmt, 0));
+    sqlite3_finalize(stmt);
+
+    if (count == 0)
+        return 0;
+
+    // Dropping a table frees its pages for reuse; no row is visited
+    sqlite3_str *sql = sqlite3_str_new(db);
+    for (int i = 0; i < count; i++)
+    {
+        forget_partition(names[i]);
+        sqlite3_str_appendf(sql, "DROP TABLE IF EXISTS %s; DELETE FROM partitions WHERE name = '%s';", names[i], names[i]);
+    }
+    if (exec_str(db, sql, "drop expired partitions") != 0 || rebuild_view(db) != 0)
+        return -1;
+
+    for (int i = 0; i < count; i++)
+    {
+        log_info("Dropped partition %s (retention)", names[i]);
+    }
+    return count;
+}
+
+sqlite3_stmt *partition_insert_stmt(sqlite3 *db, time_t ts)
+{
+    time_t start = ts - ts % STORE_PARTITION_SECONDS;
+    partition_slot_t *victim = &slots[0];
+
+    for (int i = 0; i < STORE_PARTITION_CACHE; i++)
+    {
+        if (slots[i].insert && slots[i].start == start)
+        {
+            slots[i].last_used = ++use_tick;
+            return slots[i].insert;
+        }
+        if (slots[i].last_used < victim->last_used)
+            victim = &slots[i];
+    }
+
+    // Such a partition would be dropped by the next retention pass
+    time_t now = clock_now();
+    if (start + STORE_PARTITION_SECONDS <= now - STORE_RETENTION_SECONDS)
+        return NULL;
+
+    char name[PARTITION_NAME_SIZE];
+    partition_name(start, name, sizeof(name));
+    int created = ensure_partition(db, start, name);
+    if (created < 0)
+        return NULL;
+    if (created)
+        partition_apply_retention(db, now);
+
+    release_slot(victim);
+    char *sql = sqlite3_mprintf(
+        "INSERT INTO %s (id, time, seq, temp, flags) VALUES (?1, ?2, "
+        "COALESCE((SELECT MAX(seq) + 1 FROM %s WHERE id = ?1 AND time = ?2), 0), ?3, ?4);",
+        name, name);
+    int rc = sql ? sqlite3_prepare_v3(db, sql, -1, SQLITE_PREPARE_PERSISTENT, &victim->insert, NULL) : SQLITE_NOMEM;
+    sqlite3_free(sql);
+    if (rc != SQLITE_OK)
+    {
+        log_error("Failed to prepare insert for partition %s: %s", name, sqlite3_errmsg(db));
+        release_slot(victim);
+        return NULL;
+    }
+
+    victim->start = start;
+    snprintf(victim->name, sizeof(victim->name), "%s", name);
+    victim->last_used = ++use_tick;
+    return victim->insert;
+}
+
+int partition_init(sqlite3 *db)
+{
+    partition_reset();
+    if (partition_insert_stmt(db, clock_now()) == NULL)
+        return -1;
+    return partition_apply_retention(db, clock_now()) < 0 ? -1 : 0;
+}
@@ -0,0 +1,38 @@
+/** @file storage_partition.h
+ *  @brief Time-partitioned measurements declarations
+ *
+ *  Raw readings are written to one table per STORE_PARTITION_SECONDS
+ *  period. The partitions table lists them and the measurements view
+ *  unions them for queries. Retention drops whole partitions instead of
+ *  deleting rows one by one.
+ *
+ *  All functions are called from the storage manager thread only.
+ *
+ *  @author Phuc
+ *  @bug No known bugs.
+ */
+
+#ifndef STORAGE_PARTITION_H
+#define STORAGE_PARTITION_H
+
+#include <sqlite3.h>
+#include <time.h>
+
+// Create the partition for the current period and apply the retention policy
+int partition_init(sqlite3 *db);
+
+// Cached insert statement for the partition holding timestamp ts, creating
+// the partition if needed. NULL if ts is past the retention window or on error.
+// Parameters: ?1 id, ?2 time, ?3 temp, ?4 flags.
+sqlite3_stmt *partition_insert_stmt(sqlite3 *db, time_t ts);
+
+// Drop partitions older than the retention window, returns the number dropped
+int partition_apply_retention(sqlite3 *db, time_t now);
+
+// Drop one partition, e.g. once its readings were archived
+int partition_drop(sqlite3 *db, const char *name);
+
+// Forget cached partitions, e.g. after a rollback undid their creation
+void partition_reset(void);
+
+#endif /* STORAGE_PARTITION_H */
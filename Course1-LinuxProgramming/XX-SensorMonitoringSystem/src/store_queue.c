@@ -0,0 +1,261 @@
+/** @file store_queue.c
+ *  @brief Implementation of the storage queue
+ *
+ *  Bounded blocking queue between the data manager and the storage manager.
+ *
+ *  @author Phuc
+ *  @bug No known bugs.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+#include "store_queue.h"
+#include "../include/common.h"
+
+// Initializes the storage queue
+int store_queue_init(store_queue_t *sq, int size)
+{
+    if (sq == NULL || size <= 0)
+    {
+        perror("Invalid storage queue initialization");
+        return -1;
+    }
+
+    sq->buffer = (store_record_t *)malloc(size * sizeof(store_record_t));
+    if (sq->buffer == NULL)
+    {
+        perror("Memory allocation failed");
+        return -1;
+    }
+
+    sq->size = size;
+    sq->head = 0;
+    sq->tail = 0;
+    sq->count = 0;
+    sq->closed = 0;
+    sq->consumer_done = 0;
+
+    if (pthread_mutex_init(&sq->mutex, NULL) != 0)
+    {
+        free(sq->buffer);
+        perror("Init mutex failed");
+        return -1;
+    }
+
+    if (pthread_cond_init(&sq->not_full, NULL) != 0)
+    {
+        pthread_mutex_destroy(&sq->mutex);
+        free(sq->buffer);
+        perror("Init condition for queue fullness failed");
+        return -1;
+    }
+
+    if (pthread_cond_init(&sq->not_empty, NULL) != 0)
+    {
+        pthread_cond_destroy(&sq->not_full);
+        pthread_mutex_destroy(&sq->mutex);
+        free(sq->buffer);
+        perror("Init condition for queue emptiness failed");
+        return -1;
+    }
+
+    return 0;
+}
+
+// Add a record, blocking while the queue is full
+int store_queue_push(store_queue_t *sq, const store_record_t *rec)
+{
+    if (sq == NULL || rec == NULL)
+    {
+        perror("Invalid storage queue or record pointer, push failed");
+        return -1;
+    }
+
+    if (pthread_mutex_lock(&sq->mutex) != 0)
+    {
+        perror("Mutex lock failed in store_queue_push");
+        return -1;
+    }
+
+    // The storage manager drains the queue until it is closed, also during shutdown
+    while (sq->count == sq->size && !sq->consumer_done)
+    {
+        pthread_cond_wait(&sq->not_full, &sq->mutex);
+    }
+
+    if (sq->count == sq->size)
+    {
+        pthread_mutex_unlock(&sq->mutex);
+        return -1; // Storage manager is gone, nothing will make room
+    }
+
+    sq->buffer[sq->head] = *rec;
+    sq->head = (sq->head + 1) % sq->size;
+    sq->count++;
+
+    pthread_cond_signal(&sq->not_empty);
+
+    if (pthread_mutex_unlock(&sq->mutex) != 0)
+    {
+        perror("Mutex unlock failed in store_queue_push");
+        return -1;
+    }
+
+    return 0;
+}
+
+// Mark the queue as complete, consumers drain it and then stop
+int store_queue_close(store_queue_t *sq)
+{
+    if (sq == NULL)
+    {
+        perror("Invalid storage queue, close failed");
+        return -1;
+    }
+
+    if (pthread_mutex_lock(&sq->mutex) != 0)
+    {
+        perror("Mutex lock failed in store_queue_close");
+        return -1;
+    }
+
+    sq->closed = 1;
+    pthread_cond_broadcast(&sq->not_empty);
+
+    if (pthread_mutex_unlock(&sq->mutex) != 0)
+    {
+        perror("Mutex unlock failed in store_queue_close");
+        return -1;
+    }
+
+    return 0;
+}
+
+// Called by the consumer when it stops, pushes to a full queue then fail
+int store_queue_consumer_done(store_queue_t *sq)
+{
+    if (sq == NULL)
+    {
+        perror("Invalid storage queue, store_queue_consumer_done failed");
+        return -1;
+    }
+
+    if (pthread_mutex_lock(&sq->mutex) != 0)
+    {
+        perror("Mutex lock failed in store_queue_consumer_done");
+        return -1;
+    }
+
+    sq->consumer_done = 1;
+    pthread_cond_broadcast(&sq->not_full);
+
+    if (pthread_mutex_unlock(&sq->mutex) != 0)
+    {
+        perror("Mutex unlock failed in store_queue_consumer_done");
+        return -1;
+    }
+
+    return 0;
+}
+
+// Remove up to max records, waiting at most timeout_ms (forever if negative)
+int store_queue_pop_batch(store_queue_t *sq, store_record_t *recs, int max, int timeout_ms)
+{
+    if (sq == NULL || recs == NULL || max <= 0)
+    {
+        perror("Invalid storage queue or record pointer, batch pop failed");
+        return -1;
+    }
+
+    struct timespec deadline;
+    if (timeout_ms >= 0)
+    {
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += timeout_ms / 1000;
+        deadline.tv_nsec += (long)(timeout_ms % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L)
+        {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+    }
+
+    if (pthread_mutex_lock(&sq->mutex) != 0)
+    {
+        perror("Mutex lock failed in store_queue_pop_batch");
+        return -1;
+    }
+
+    while (sq->count == 0 && !sq->closed)
+    {
+        int rc = timeout_ms >= 0 ? pthread_cond_timedwait(&sq->not_empty, &sq->mutex, &deadline)
+                                 : pthread_cond_wait(&sq->not_empty, &sq->mutex);
+        if (rc == ETIMEDOUT)
+        {
+            pthread_mutex_unlock(&sq->mutex);
+            return 0;
+        }
+    }
+
+    if (sq->count == 0)
+    {
+        pthread_mutex_unlock(&sq->mutex);
+        return -1; // Queue closed and drained
+    }
+
+    int n = 0;
+    while (n < max && sq->count > 0)
+    {
+        recs[n++] = sq->buffer[sq->tail];
+        sq->tail = (sq->tail + 1) % sq->size;
+        sq->count--;
+    }
+
+    pthread_cond_broadcast(&sq->not_full);
+
+    if (pthread_mutex_unlock(&sq->mutex) != 0)
+    {
+        perror("Mutex unlock failed in store_queue_pop_batch");
+        return -1;
+    }
+
+    return n;
+}
+
+// Free the queue storage
+int store_queue_free(store_queue_t *sq)
+{
+    if (sq == NULL)
+    {
+        perror("Invalid storage queue, store_queue_free failed");
+        return -1;
+    }
+
+    if (pthread_mutex_lock(&sq->mutex) != 0)
+    {
+        perror("Mutex lock failed in store_queue_free");
+        return -1;
+    }
+
+    free(sq->buffer);
+    sq->buffer = NULL;
+    sq->size = 0;
+    sq->head = 0;
+    sq->tail = 0;
+    sq->count = 0;
+
+    pthread_mutex_unlock(&sq->mutex);
+
+    if (pthread_mutex_destroy(&sq->mutex) != 0 ||
+        pthread_cond_destroy(&sq->not_full) != 0 ||
+        pthread_cond_destroy(&sq->not_empty) != 0)
+    {
+        perror("Destroy synchronization primitives failed in store_queue_free");
+        return -1;
+    }
+
+    return 0;
+}
+
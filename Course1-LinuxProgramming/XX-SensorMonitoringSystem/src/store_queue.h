@@ -0,0 +1,86 @@
+/** @file store_queue.h
+ *  @brief Storage queue declarations
+ *
+ *  Bounded queue carrying processed readings and rollup buckets from the data manager
+ *  to the storage manager. Unlike sbuffer it never overwrites data:
+ *  producers block while the queue is full.
+ *
+ *  @author Phuc
+ *  @bug No known bugs.
+ */
+
+#ifndef STORE_QUEUE_H
+#define STORE_QUEUE_H
+
+#include <pthread.h>
+#include "sbuffer.h"
+
+#define STORE_QUEUE_SIZE 8192 // Absorbs the readings arriving during one commit
+
+typedef enum
+{
+    STORE_MEASUREMENT, // Raw reading for the measurements table
+    STORE_ROLLUP       // Closed rollup bucket for a rollup table
+} store_record_type_t;
+
+typedef struct
+{
+    int sensor_id;
+    int resolution;       // rollup_resolution_t
+    time_t start;         // Bucket start, aligned to the bucket width
+    float min;
+    float max;
+    double sum;           // Sum of readings, avg = sum / count
+    int count;
+} rollup_bucket_t;
+
+typedef struct
+{
+    store_record_type_t type;
+    union
+    {
+        struct
+        {
+            sensor_data_t data;   // Reading as received from the sensor node
+            unsigned int flags;   // Tags set by pipeline stages (e.g. ANOMALY_FLAG_*)
+            unsigned long long spool_seq; // Released from the spool once stored, 0 if not spooled
+        };
+        rollup_bucket_t rollup;   // STORE_ROLLUP
+    };
+    unsigned long long enqueue_ns; // clock_mono_ns() when queued, for latency measurement
+} store_record_t;
+
+typedef struct
+{
+    store_record_t *buffer;   // Array for circular buffer
+    int size;                 // Maximum number of elements
+    int head;                 // Index where next record will be added
+    int tail;                 // Index where next record will be removed
+    int count;                // Current number of elements
+    int closed;               // Set once the producer is done, pop then fails when empty
+    int consumer_done;        // Set once the consumer stopped, push then fails when full
+    pthread_mutex_t mutex;    // For thread safety
+    pthread_cond_t not_full;  // Signal when queue isn’t full
+    pthread_cond_t not_empty; // Signal when queue isn’t empty
+} store_queue_t;
+
+// Initializes the storage queue
+int store_queue_init(store_queue_t *sq, int size);
+
+// Add a record, blocking while the queue is full and the consumer runs
+int store_queue_push(store_queue_t *sq, const store_record_t *rec);
+
+// Mark the queue as complete, consumers drain it and then stop
+int store_queue_close(store_queue_t *sq);
+
+// Mark the consumer as stopped, producers blocked on a full queue then give up
+int store_queue_consumer_done(store_queue_t *sq);
+
+// Remove up to max records, waiting at most timeout_ms (forever if negative).
+// Returns the number removed, 0 on timeout, -1 once closed and drained.
+int store_queue_pop_batch(store_queue_t *sq, store_record_t *recs, int max, int timeout_ms);
+
+// Free the queue storage
+int store_queue_free(store_queue_t *sq);
+
+#endif /* STORE_QUEUE_H */
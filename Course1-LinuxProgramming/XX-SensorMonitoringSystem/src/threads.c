@@ -10,16 +10,32 @@
 
 #include <stdio.h>
 #include <pthread.h>
+#include <stdatomic.h>
 #include "threads.h"
 #include "log.h"
 #include "connection_manager.h"
 #include "data_manager.h"
 #include "storage_manager.h"
+#include "alert.h"
+#include "query_server.h"
 
-void init_threads(sbuffer_t* sb, int port)
+// Threads that drain their queues on shutdown and must finish before main frees them
+static atomic_int running_threads = 0;
+
+void threads_mark_exit(void)
+{
+    atomic_fetch_sub(&running_threads, 1);
+}
+
+int threads_running(void)
 {
-    // Create 3 threads: Connection manager, Data manager, and Storage manager
-    pthread_t conn_thread, data_thread, stor_thread;
+    return atomic_load(&running_threads);
+}
+
+void init_threads(sbuffer_t* sb, store_queue_t* sq, int port)
+{
+    // Create 5 threads: Connection manager, Data manager, Storage manager, Alert dispatcher, and Query server
+    pthread_t conn_thread, data_thread, stor_thread, alert_thread, query_thread;
     int ret;
 
     // Allocate memory for thread arguments
@@ -29,7 +45,7 @@ void init_threads(sbuffer_t* sb, int port)
 
     if (!conn_args || !data_args || !stor_args)
     {
-        log_event("Failed to allocate memory for thread arguments");
+        log_error("Failed to allocate memory for thread arguments");
         free(conn_args);
         free(data_args);
         free(stor_args);
@@ -38,20 +54,24 @@ void init_threads(sbuffer_t* sb, int port)
 
     // Initialize thread arguments
     conn_args->sb = sb;
+    conn_args->sq = sq;
     conn_args->port = port;
 
     data_args->sb = sb;
+    data_args->sq = sq;
     data_args->port = port;
 
     stor_args->sb = sb;
+    stor_args->sq = sq;
     stor_args->port = port;
 
     // Connection manager thread
+    atomic_fetch_add(&running_threads, 1);
     ret = pthread_create(&conn_thread, NULL, &connection_manager, conn_args);
     if (ret != 0)
     {
         printf("pthread_create() Connection manager error number=%d\n", ret);
-        log_event("pthread_create() Connection manager failed");
+        log_error("pthread_create() Connection manager failed");
         free(conn_args);
         free(data_args);
         free(stor_args);
@@ -61,7 +81,7 @@ void init_threads(sbuffer_t* sb, int port)
     if (ret != 0)
     {
         printf("pthread_detach() Connection manager error number=%d\n", ret);
-        log_event("pthread_detach() Connection manager failed");
+        log_error("pthread_detach() Connection manager failed");
         free(conn_args);
         free(data_args);
         free(stor_args);
@@ -69,11 +89,12 @@ void init_threads(sbuffer_t* sb, int port)
     }
 
     // Data manager thread
+    atomic_fetch_add(&running_threads, 1);
     ret = pthread_create(&data_thread, NULL, &data_manager, data_args);
     if (ret != 0)
     {
         printf("pthread_create() Data manager error number=%d\n", ret);
-        log_event("pthread_create() Data manager failed");
+        log_error("pthread_create() Data manager failed");
         free(conn_args);
         free(data_args);
         free(stor_args);
@@ -83,7 +104,7 @@ void init_threads(sbuffer_t* sb, int port)
     if (ret != 0)
     {
         printf("pthread_detach() Data manager error number=%d\n", ret);
-        log_event("pthread_detach() Data manager failed");
+        log_error("pthread_detach() Data manager failed");
         free(conn_args);
         free(data_args);
         free(stor_args);
@@ -91,11 +112,12 @@ void init_threads(sbuffer_t* sb, int port)
     }
 
     // Storage manager thread
+    atomic_fetch_add(&running_threads, 1);
     ret = pthread_create(&stor_thread, NULL, &storage_manager, stor_args);
     if (ret != 0)
     {
         printf("pthread_create() Storage manager error number=%d\n", ret);
-        log_event("pthread_create() Storage manager failed");
+        log_error("pthread_create() Storage manager failed");
         free(conn_args);
         free(data_args);
         free(stor_args);
@@ -105,10 +127,44 @@ void init_threads(sbuffer_t* sb, int port)
     if (ret != 0)
     {
         printf("pthread_detach() Storage manager error number=%d\n", ret);
-        log_event("pthread_detach() Storage manager failed");
+        log_error("pthread_detach() Storage manager failed");
         free(conn_args);
         free(data_args);
         free(stor_args);
         exit(EXIT_FAILURE);
     }
+
+    // Alert dispatcher thread
+    atomic_fetch_add(&running_threads, 1);
+    ret = pthread_create(&alert_thread, NULL, &alert_dispatcher, NULL);
+    if (ret != 0)
+    {
+        printf("pthread_create() Alert dispatcher error number=%d\n", ret);
+        log_error("pthread_create() Alert dispatcher failed");
+        exit(EXIT_FAILURE);
+    }
+    ret = pthread_detach(alert_thread);
+    if (ret != 0)
+    {
+        printf("pthread_detach() Alert dispatcher error number=%d\n", ret);
+        log_error("pthread_detach() Alert dispatcher failed");
+        exit(EXIT_FAILURE);
+    }
+
+    // Query server thread
+    atomic_fetch_add(&running_threads, 1);
+    ret = pthread_create(&query_thread, NULL, &query_server, NULL);
+    if (ret != 0)
+    {
+        printf("pthread_create() Query server error number=%d\n", ret);
+        log_error("pthread_create() Query server failed");
+        exit(EXIT_FAILURE);
+    }
+    ret = pthread_detach(query_thread);
+    if (ret != 0)
+    {
+        printf("pthread_detach() Query server error number=%d\n", ret);
+        log_error("pthread_detach() Query server failed");
+        exit(EXIT_FAILURE);
+    }
 }
\ No newline at end of file
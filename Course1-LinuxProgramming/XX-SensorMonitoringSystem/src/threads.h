@@ -12,13 +12,21 @@
 #define THREADS_H
 
 #include "sbuffer.h"
+#include "store_queue.h"
 
 typedef struct
 {
     sbuffer_t* sb;
+    store_queue_t* sq;
     int port;
 } thread_args_t;
 
-void init_threads(sbuffer_t* sb, int port);
+void init_threads(sbuffer_t* sb, store_queue_t* sq, int port);
+
+// Called by the connection manager, data manager, storage manager, alert dispatcher and query server when they finish
+void threads_mark_exit(void);
+
+// Number of draining threads still running
+int threads_running(void);
 
 #endif /* THREADS_H */
\ No newline at end of file
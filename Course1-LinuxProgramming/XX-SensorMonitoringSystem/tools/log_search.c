@@ -0,0 +1,409 @@
+/** @file log_search.c
+ *  @brief Indexed search of the gateway log
+ *
+ *  Prints the lines of gateway.log and of its rotated files, oldest
+ *  first, that fall in a time or line number range and, optionally,
+ *  mention a sensor. The index of each file (log_index.h) tells which
+ *  blocks can hold such lines, and only those are read: one pread, and
+ *  for a compressed file one gzip member to inflate, per block. Lines
+ *  after the last indexed block, and files without an index, are read
+ *  in full.
+ *
+ *  A bound is one of:
+ *    -                      open
+ *    #N                     line number N
+ *    1760868000             Unix seconds
+ *    10:00, 10:00:30        today, local time
+ *    2026-10-19 10:00[:30]  local time, 'T' may replace the space
+ *  A time without seconds covers its whole minute.
+ *
+ *  Usage: ./log_search <from> <to> [sensor|all] [log_path]
+ *
+ *  @author Phuc
+ *  @bug No known bugs.
+ */
+
+#define _GNU_SOURCE // strptime(), strverscmp()
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#include "clock_service.h"
+#include "log_index.h"
+#include "log.h"
+
+#define SEARCH_BUFFER_BYTES (1024 * 1024) // Output buffer, and read size of files without an index
+
+typedef struct
+{
+    long long from_time;
+    long long to_time;
+    unsigned int from_seq;
+    unsigned int to_seq;
+    int sensor; // -1 for all
+} search_t;
+
+typedef struct
+{
+    long long lines;
+    long long blocks;
+    long long blocks_read;
+    unsigned long long bytes_read;
+} search_stats_t;
+
+static search_t search = {LLONG_MIN, LLONG_MAX, 0, UINT_MAX, -1};
+static search_stats_t stats;
+
+// Parse a bound into the time or line number range. Returns -1 if it is not one.
+static int parse_bound(const char *arg, int upper)
+{
+    static const char *formats[] = {"%Y-%m-%d %H:%M:%S", "%Y-%m-%dT%H:%M:%S", "%Y-%m-%d %H:%M",
+                                    "%Y-%m-%dT%H:%M", "%H:%M:%S", "%H:%M"};
+    char *end;
+
+    if (strcmp(arg, "-") == 0)
+        return 0;
+    if (arg[0] == '#')
+    {
+        unsigned long seq = strtoul(arg + 1, &end, 10);
+        if (end == arg + 1 || *end != '\0' || seq > UINT_MAX)
+            return -1;
+        *(upper ? &search.to_seq : &search.from_seq) = (unsigned int)seq;
+        return 0;
+    }
+
+    long long secs = strtoll(arg, &end, 10);
+    if (end != arg && *end == '\0')
+    {
+        *(upper ? &search.to_time : &search.from_time) = secs;
+        return 0;
+    }
+
+    for (size_t f = 0; f < sizeof(formats) / sizeof(formats[0]); f++)
+    {
+        // A time of day is taken as today's
+        time_t now = time(NULL);
+        struct tm tm;
+        localtime_r(&now, &tm);
+        tm.tm_sec = 0;
+        char *rest = strptime(arg, formats[f], &tm);
+        if (rest == NULL || *rest != '\0')
+            continue;
+        tm.tm_isdst = -1;
+        secs = (long long)mktime(&tm);
+        if (upper && strstr(formats[f], "%S") == NULL)
+            secs += 59;
+        *(upper ? &search.to_time : &search.from_time) = secs;
+        return 0;
+    }
+    return -1;
+}
+
+static int block_matches(const log_index_entry_t *entry)
+{
+    return entry->lines > 0 && entry->max_time >= search.from_time && entry->min_time <= search.to_time &&
+           entry->last_seq >= search.from_seq && entry->first_seq <= search.to_seq &&
+           (search.sensor < 0 || log_index_has_sensor(entry, search.sensor));
+}
+
+static int line_matches(const char *line, size_t len)
+{
+    log_line_t parsed;
+    int ids[LOG_INDEX_MAX_IDS];
+
+    if (log_index_parse(line, len, &parsed) != 0 || parsed.time < search.from_time || parsed.time > search.to_time ||
+        parsed.seq < search.from_seq || parsed.seq > search.to_seq)
+        return 0;
+    if (search.sensor < 0)
+        return 1;
+    int count = log_index_sensor_ids(parsed.text, parsed.len, ids);
+    for (int i = 0; i < count; i++)
+    {
+        if (ids[i] == search.sensor)
+            return 1;
+    }
+    return 0;
+}
+
+// Print the matching lines of text. Returns the length of the complete lines, the rest is a partial line.
+static size_t scan_lines(const char *text, size_t len)
+{
+    const char *line = text;
+    const char *nl;
+
+    while ((nl = memchr(line, '\n', len - (size_t)(line - text))) != NULL)
+    {
+        if (line_matches(line, (size_t)(nl - line)))
+        {
+            fwrite(line, 1, (size_t)(nl - line) + 1, stdout);
+            stats.lines++;
+        }
+        line = nl + 1;
+    }
+    return (size_t)(line - text);
+}
+
+// Scan a plain file from offset to its end
+static void scan_plain(int fd, unsigned long long offset)
+{
+    char *buffer = malloc(SEARCH_BUFFER_BYTES);
+    size_t held = 0;
+    ssize_t n;
+
+    if (buffer == NULL)
+        return;
+    while ((n = pread(fd, buffer + held, SEARCH_BUFFER_BYTES - held, (off_t)offset)) > 0)
+    {
+        offset += (unsigned long long)n;
+        stats.bytes_read += (unsigned long long)n;
+        held += (size_t)n;
+        size_t used = scan_lines(buffer, held);
+        // A line longer than the buffer is skipped
+        held = used == 0 && held == SEARCH_BUFFER_BYTES ? 0 : held - used;
+        memmove(buffer, buffer + used, held);
+    }
+    free(buffer);
+}
+
+// Scan a whole compressed file
+static void scan_gz(const char *path)
+{
+    char *buffer = malloc(SEARCH_BUFFER_BYTES);
+    size_t held = 0;
+    int n;
+    gzFile gz = gzopen(path, "rb");
+
+    if (buffer == NULL || gz == NULL)
+    {
+        fprintf(stderr, "Failed to read %s\n", path);
+        free(buffer);
+        if (gz != NULL)
+            gzclose(gz);
+        return;
+    }
+    while ((n = gzread(gz, buffer + held, (unsigned int)(SEARCH_BUFFER_BYTES - held))) > 0)
+    {
+        stats.bytes_read += (unsigned long long)n;
+        held += (size_t)n;
+        size_t used = scan_lines(buffer, held);
+        held = used == 0 && held == SEARCH_BUFFER_BYTES ? 0 : held - used;
+        memmove(buffer, buffer + used, held);
+    }
+    gzclose(gz);
+    free(buffer);
+}
+
+// Inflate one gzip member of a block into buffer. Returns the length of the block, -1 on error.
+static long long inflate_member(const unsigned char *member, size_t len, char **buffer, size_t *capacity)
+{
+    z_stream zs = {0};
+    size_t used = 0;
+    int rc = Z_OK;
+
+    if (inflateInit2(&zs, 15 + 16) != Z_OK)
+        return -1;
+    zs.next_in = (unsigned char *)member;
+    zs.avail_in = (unsigned int)len;
+    while (rc != Z_STREAM_END)
+    {
+        if (used == *capacity)
+        {
+            size_t grown_size = *capacity * 2;
+            char *grown = realloc(*buffer, grown_size);
+            if (grown == NULL)
+                break;
+            *buffer = grown;
+            *capacity = grown_size;
+        }
+        zs.next_out = (unsigned char *)*buffer + used;
+        zs.avail_out = (unsigned int)(*capacity - used);
+        rc = inflate(&zs, Z_NO_FLUSH);
+        used = *capacity - zs.avail_out;
+        if (rc != Z_OK && rc != Z_STREAM_END)
+            break;
+    }
+    inflateEnd(&zs);
+    return rc == Z_STREAM_END ? (long long)used : -1;
+}
+
+// Search one file, through its index if it has one
+static void search_file(const char *path, int compressed)
+{
+    char index_path[PATH_MAX + NAME_MAX + 8];
+    log_index_header_t header;
+    log_index_entry_t entry;
+    unsigned long long indexed_end = 0;
+
+    snprintf(index_path, sizeof(index_path), "%s%s", path, LOG_INDEX_SUFFIX);
+    FILE *index = fopen(index_path, "rb");
+    if (index != NULL && (fread(&header, sizeof(header), 1, index) != 1 || header.magic != LOG_INDEX_MAGIC ||
+                          header.version != LOG_INDEX_VERSION || header.entry_size != sizeof(log_index_entry_t)))
+    {
+        fclose(index);
+        index = NULL;
+    }
+    if (index == NULL)
+    {
+        // Compressed files without an index are one stream, plain ones are read in full
+        if (compressed)
+        {
+            scan_gz(path);
+        }
+        else
+        {
+            int fd = open(path, O_RDONLY);
+            if (fd != -1)
+            {
+                scan_plain(fd, 0);
+                close(fd);
+            }
+        }
+        return;
+    }
+
+    int fd = open(path, O_RDONLY);
+    if (fd == -1)
+    {
+        fclose(index);
+        return;
+    }
+
+    size_t capacity = 2 * LOG_INDEX_BLOCK_BYTES;
+    char *block = malloc(capacity);
+    size_t member_capacity = 0;
+    unsigned char *member = NULL;
+    while (block != NULL && fread(&entry, sizeof(entry), 1, index) == 1)
+    {
+        stats.blocks++;
+        indexed_end = entry.offset + entry.bytes;
+        if (!block_matches(&entry))
+            continue;
+
+        stats.blocks_read++;
+        stats.bytes_read += entry.bytes;
+        if (entry.bytes > member_capacity)
+        {
+            unsigned char *grown = realloc(member, entry.bytes);
+            if (grown == NULL)
+                break;
+            member = grown;
+            member_capacity = entry.bytes;
+        }
+        if (pread(fd, member, entry.bytes, (off_t)entry.offset) != (ssize_t)entry.bytes)
+        {
+            fprintf(stderr, "Short read in %s at %llu\n", path, entry.offset);
+            break;
+        }
+
+        long long len = entry.bytes;
+        if (!compressed)
+            scan_lines((const char *)member, entry.bytes);
+        else if ((len = inflate_member(member, entry.bytes, &block, &capacity)) >= 0)
+            scan_lines(block, (size_t)len);
+        else
+            fprintf(stderr, "Corrupt block in %s at %llu\n", path, entry.offset);
+    }
+    free(member);
+    free(block);
+    fclose(index);
+
+    // Lines of the block being filled
+    if (!compressed)
+        scan_plain(fd, indexed_end);
+    close(fd);
+}
+
+// Oldest first: compare the names without their ".gz"
+static int compare_rotated(const void *a, const void *b)
+{
+    char x[NAME_MAX + 1];
+    char y[NAME_MAX + 1];
+    snprintf(x, sizeof(x), "%s", *(char *const *)a);
+    snprintf(y, sizeof(y), "%s", *(char *const *)b);
+    char *gz = strstr(x, ".gz");
+    if (gz != NULL)
+        *gz = '\0';
+    gz = strstr(y, ".gz");
+    if (gz != NULL)
+        *gz = '\0';
+    return strverscmp(x, y);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *log_path = argc > 4 ? argv[4] : LOG_FIFO_PATH;
+    char *end = "";
+
+    if (argc > 3 && strcmp(argv[3], "all") != 0)
+        search.sensor = (int)strtol(argv[3], &end, 10);
+    if (argc < 3 || parse_bound(argv[1], 0) != 0 || parse_bound(argv[2], 1) != 0 || *end != '\0' ||
+        (argc > 3 && end == argv[3]))
+    {
+        fprintf(stderr, "Usage: %s <from> <to> [sensor|all] [log_path]\n"
+                        "  bounds: -, #line, Unix seconds, HH:MM[:SS] (today), YYYY-MM-DD HH:MM[:SS]\n",
+                argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    // Rotated files are <log>.<YYYYMMDD-HHMMSS>[-n][.gz] next to the log
+    char dir_path[PATH_MAX];
+    snprintf(dir_path, sizeof(dir_path), "%s", log_path);
+    char *slash = strrchr(dir_path, '/');
+    const char *base = slash != NULL ? log_path + (slash - dir_path) + 1 : log_path;
+    if (slash != NULL)
+        *slash = '\0';
+    else
+        snprintf(dir_path, sizeof(dir_path), ".");
+
+    char **names = NULL;
+    int count = 0;
+    size_t base_len = strlen(base);
+    DIR *dir = opendir(dir_path);
+    struct dirent *entry;
+    while (dir != NULL && (entry = readdir(dir)) != NULL)
+    {
+        const char *name = entry->d_name;
+        size_t len = strlen(name);
+        if (strncmp(name, base, base_len) != 0 || name[base_len] != '.' || !isdigit((unsigned char)name[base_len + 1]) ||
+            (len > 4 && strcmp(name + len - 4, LOG_INDEX_SUFFIX) == 0) || (len > 4 && strcmp(name + len - 4, ".tmp") == 0))
+            continue;
+        char **grown = realloc(names, sizeof(char *) * (count + 1));
+        if (grown == NULL)
+            break;
+        names = grown;
+        names[count++] = strdup(name);
+    }
+    if (dir != NULL)
+        closedir(dir);
+    if (count > 1)
+        qsort(names, count, sizeof(char *), compare_rotated);
+
+    static char out_buffer[SEARCH_BUFFER_BYTES];
+    setvbuf(stdout, out_buffer, _IOFBF, sizeof(out_buffer));
+    unsigned long long start_ns = clock_mono_ns();
+
+    for (int i = 0; i < count; i++)
+    {
+        char path[PATH_MAX + NAME_MAX + 2];
+        size_t len = strlen(names[i]);
+        snprintf(path, sizeof(path), "%s/%s", dir_path, names[i]);
+        search_file(path, len > 3 && strcmp(names[i] + len - 3, ".gz") == 0);
+        free(names[i]);
+    }
+    free(names);
+    search_file(log_path, 0);
+    fflush(stdout);
+
+    double secs = (clock_mono_ns() - start_ns) / 1e9;
+    fprintf(stderr, "%lld lines, %lld of %lld indexed blocks read, %llu bytes in %.3f s\n",
+            stats.lines, stats.blocks_read, stats.blocks, stats.bytes_read, secs);
+    return EXIT_SUCCESS;
+}
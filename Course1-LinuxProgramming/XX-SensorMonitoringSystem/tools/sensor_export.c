@@ -0,0 +1,379 @@
+/** @file sensor_export.c
+ *  @brief Bulk export of stored readings
+ *
+ *  Streams the readings of a time range for a set of sensors, sensor by
+ *  sensor in time order, from either storage backend to CSV or to a
+ *  binary columnar file. Memory use does not depend on the number of
+ *  rows: text goes through one EXPORT_BUFFER_BYTES buffer and binary
+ *  output through one chunk of EXPORT_CHUNK_ROWS readings per column,
+ *  both written out whenever they fill.
+ *
+ *  The SQLite database is read the way the query server reads it:
+ *  archive blocks first, then each partition overlapping the range
+ *  through its (id, time) primary key, all in one read snapshot.
+ *
+ *  CSV: a "sensor,time,temp,flags" header line, then one line per reading.
+ *
+ *  Binary (native byte order):
+ *    export_header_t
+ *    chunks of one sensor: export_chunk_t, then count int64 timestamps,
+ *    count float temperatures and count uint8 flags
+ *    a final chunk with count 0, which tells a complete file from a
+ *    truncated one
+ *
+ *  Usage: ./sensor_export <csv|bin> <from> <to> <sensor[,sensor...]|all> [output|-] [sqlite|columnar]
+ *
+ *  @author Phuc
+ *  @bug No known bugs.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sqlite3.h>
+#include "../include/common.h"
+#include "clock_service.h"
+#include "log.h"
+#include "storage_columnar.h"
+#include "query_server.h"
+
+#define EXPORT_BUFFER_BYTES (1024 * 1024) // CSV output buffer
+#define EXPORT_CHUNK_ROWS 65536           // Readings per binary chunk
+#define EXPORT_CACHE_SIZE_KB 8192         // SQLite page cache of the export connection
+#define EXPORT_MAGIC 0x50584553u          // "SEXP"
+#define EXPORT_VERSION 1
+
+typedef struct
+{
+    uint32_t magic;
+    uint32_t version;
+    int64_t from;
+    int64_t to;
+} export_header_t;
+
+typedef struct
+{
+    uint32_t sensor_id;
+    uint32_t count;
+} export_chunk_t;
+
+// Output stream, reused for every reading
+typedef struct
+{
+    int fd;
+    int binary;
+    int failed;
+    long long rows;
+    int sensor;            // Sensor of the readings being exported
+    size_t len;            // Bytes in text, CSV only
+    uint32_t count;        // Readings in the chunk, binary only
+} export_out_t;
+
+static char text[EXPORT_BUFFER_BYTES];
+static int64_t chunk_times[EXPORT_CHUNK_ROWS];
+static float chunk_temps[EXPORT_CHUNK_ROWS];
+static uint8_t chunk_flags[EXPORT_CHUNK_ROWS];
+
+// The columnar decoder logs through the gateway's log process; print instead
+int log_level = LOG_LEVEL_INFO;
+
+void log_eventf(int level, const char *fmt, ...)
+{
+    va_list ap;
+    (void)level;
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+    fputc('\n', stderr);
+}
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+    const char *p = buf;
+    while (len > 0)
+    {
+        ssize_t n = write(fd, p, len);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        p += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+static void out_write(export_out_t *out, const void *buf, size_t len)
+{
+    if (!out->failed && write_all(out->fd, buf, len) != 0)
+    {
+        perror("Failed to write export");
+        out->failed = 1;
+    }
+}
+
+// Write the buffered chunk or text
+static void out_flush(export_out_t *out)
+{
+    if (out->binary && out->count > 0)
+    {
+        export_chunk_t c = {(uint32_t)out->sensor, out->count};
+        out_write(out, &c, sizeof(c));
+        out_write(out, chunk_times, sizeof(chunk_times[0]) * out->count);
+        out_write(out, chunk_temps, sizeof(chunk_temps[0]) * out->count);
+        out_write(out, chunk_flags, sizeof(chunk_flags[0]) * out->count);
+        out->count = 0;
+    }
+    else if (!out->binary && out->len > 0)
+    {
+        out_write(out, text, out->len);
+        out->len = 0;
+    }
+}
+
+static void out_reading(export_out_t *out, time_t timestamp, float temperature, unsigned int flags)
+{
+    if (out->binary)
+    {
+        chunk_times[out->count] = (int64_t)timestamp;
+        chunk_temps[out->count] = temperature;
+        chunk_flags[out->count] = (uint8_t)flags;
+        if (++out->count == EXPORT_CHUNK_ROWS)
+            out_flush(out);
+    }
+    else
+    {
+        // Longest line: 11 + 20 + 15 + 10 characters and separators
+        if (out->len + 64 > sizeof(text))
+            out_flush(out);
+        out->len += (size_t)snprintf(text + out->len, sizeof(text) - out->len, "%d,%lld,%g,%u\n",
+                                     out->sensor, (long long)timestamp, temperature, flags);
+    }
+    out->rows++;
+}
+
+static int export_point(const columnar_point_t *p, void *ctx)
+{
+    export_out_t *out = ctx;
+    out_reading(out, p->timestamp, p->temperature, p->flags);
+    return out->failed;
+}
+
+// Readings of one sensor from the SQLite database: archive blocks, then partitions
+static int export_sqlite_sensor(sqlite3 *db, export_out_t *out, int has_archive, time_t from, time_t to)
+{
+    sqlite3_stmt *parts = NULL;
+    sqlite3_stmt *stmt = NULL;
+    int rc = 0;
+
+    if (has_archive)
+    {
+        if (sqlite3_prepare_v2(db, "SELECT block FROM archive WHERE id = ?1 AND stop >= ?2 AND start <= ?3 ORDER BY start;",
+                               -1, &stmt, NULL) != SQLITE_OK)
+            return -1;
+        sqlite3_bind_int(stmt, 1, out->sensor);
+        sqlite3_bind_int64(stmt, 2, (sqlite3_int64)from);
+        sqlite3_bind_int64(stmt, 3, (sqlite3_int64)to);
+        while (rc == 0 && !out->failed && sqlite3_step(stmt) == SQLITE_ROW)
+        {
+            if (columnar_decode_block(sqlite3_column_blob(stmt, 0), (size_t)sqlite3_column_bytes(stmt, 0),
+                                      from, to, export_point, out) < 0)
+                rc = -1;
+        }
+        sqlite3_finalize(stmt);
+        stmt = NULL;
+    }
+
+    if (rc != 0 || sqlite3_prepare_v2(db, "SELECT name FROM partitions WHERE stop > ? AND start <= ? ORDER BY start;",
+                                      -1, &parts, NULL) != SQLITE_OK)
+        return -1;
+    sqlite3_bind_int64(parts, 1, (sqlite3_int64)from);
+    sqlite3_bind_int64(parts, 2, (sqlite3_int64)to);
+
+    while (!out->failed && sqlite3_step(parts) == SQLITE_ROW)
+    {
+        char *sql = sqlite3_mprintf("SELECT time, temp, flags FROM %s WHERE id = ?1 AND time BETWEEN ?2 AND ?3 ORDER BY time, seq;",
+                                    (const char *)sqlite3_column_text(parts, 0));
+        if (sql == NULL || sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK)
+        {
+            sqlite3_free(sql);
+            rc = -1;
+            break;
+        }
+        sqlite3_free(sql);
+
+        sqlite3_bind_int(stmt, 1, out->sensor);
+        sqlite3_bind_int64(stmt, 2, (sqlite3_int64)from);
+        sqlite3_bind_int64(stmt, 3, (sqlite3_int64)to);
+        while (!out->failed && sqlite3_step(stmt) == SQLITE_ROW)
+            out_reading(out, (time_t)sqlite3_column_int64(stmt, 0), (float)sqlite3_column_double(stmt, 1),
+                        (unsigned int)sqlite3_column_int(stmt, 2));
+        sqlite3_finalize(stmt);
+        stmt = NULL;
+    }
+
+    sqlite3_finalize(parts);
+    return rc;
+}
+
+static int has_table(sqlite3 *db, const char *name)
+{
+    sqlite3_stmt *stmt = NULL;
+    int found = 0;
+    if (sqlite3_prepare_v2(db, "SELECT 1 FROM sqlite_master WHERE type = 'table' AND name = ?;", -1, &stmt, NULL) == SQLITE_OK)
+    {
+        sqlite3_bind_text(stmt, 1, name, -1, SQLITE_STATIC);
+        found = sqlite3_step(stmt) == SQLITE_ROW;
+    }
+    sqlite3_finalize(stmt);
+    return found;
+}
+
+static sqlite3 *open_database(int *has_archive)
+{
+    sqlite3 *db = NULL;
+    char pragmas[128];
+
+    if (sqlite3_open_v2(QUERY_DB_PATH, &db, SQLITE_OPEN_READONLY, NULL) != SQLITE_OK)
+    {
+        fprintf(stderr, "Cannot open %s: %s\n", QUERY_DB_PATH, sqlite3_errmsg(db));
+        sqlite3_close(db);
+        return NULL;
+    }
+    if (!has_table(db, "partitions"))
+    {
+        fprintf(stderr, "%s has no partitions table, start the gateway once to migrate it\n", QUERY_DB_PATH);
+        sqlite3_close(db);
+        return NULL;
+    }
+    *has_archive = has_table(db, "archive");
+
+    // A bounded page cache: every page is read once, in key order
+    snprintf(pragmas, sizeof(pragmas), "PRAGMA cache_size=-%d; PRAGMA mmap_size=0;", EXPORT_CACHE_SIZE_KB);
+    sqlite3_exec(db, pragmas, NULL, NULL, NULL);
+    return db;
+}
+
+// Parse "1,2,5" or "all" into selected[MAX_SENSORS], returns the count or -1
+static int parse_sensors(const char *arg, int *selected)
+{
+    int count = 0;
+
+    if (strcmp(arg, "all") == 0)
+    {
+        for (int i = 0; i < MAX_SENSORS; i++)
+            selected[i] = 1;
+        return MAX_SENSORS;
+    }
+
+    memset(selected, 0, sizeof(int) * MAX_SENSORS);
+    for (const char *p = arg; *p != '\0';)
+    {
+        char *end;
+        long id = strtol(p, &end, 10);
+        if (end == p || id < 0 || id >= MAX_SENSORS || (*end != ',' && *end != '\0'))
+            return -1;
+        count += !selected[id];
+        selected[id] = 1;
+        p = *end == ',' ? end + 1 : end;
+    }
+    return count;
+}
+
+int main(int argc, char *argv[])
+{
+    int selected[MAX_SENSORS];
+    int binary = argc > 1 && strcmp(argv[1], "bin") == 0;
+    int columnar = argc > 6 && strcmp(argv[6], "columnar") == 0;
+    char *end_from = "", *end_to = "";
+    long long from = argc > 3 ? strtoll(argv[2], &end_from, 10) : 0;
+    long long to = argc > 3 ? strtoll(argv[3], &end_to, 10) : -1;
+
+    if (argc < 5 || (!binary && strcmp(argv[1], "csv") != 0) || *end_from != '\0' || *end_to != '\0' || from > to ||
+        parse_sensors(argv[4], selected) <= 0 || (argc > 6 && !columnar && strcmp(argv[6], "sqlite") != 0))
+    {
+        fprintf(stderr, "Usage: %s <csv|bin> <from> <to> <sensor[,sensor...]|all> [output|-] [sqlite|columnar]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    sqlite3 *db = NULL;
+    int has_archive = 0;
+    if (!columnar && (db = open_database(&has_archive)) == NULL)
+        return EXIT_FAILURE;
+
+    export_out_t out = {STDOUT_FILENO, binary, 0, 0, 0, 0, 0};
+    if (argc > 5 && strcmp(argv[5], "-") != 0)
+    {
+        out.fd = open(argv[5], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (out.fd < 0)
+        {
+            perror("Failed to create export file");
+            sqlite3_close(db);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (binary)
+    {
+        export_header_t h = {EXPORT_MAGIC, EXPORT_VERSION, from, to};
+        out_write(&out, &h, sizeof(h));
+    }
+    else
+    {
+        const char *header = "sensor,time,temp,flags\n";
+        out_write(&out, header, strlen(header));
+    }
+
+    unsigned long long start_ns = clock_mono_ns();
+    int rc = 0;
+
+    // One snapshot for the whole export, even while the gateway writes
+    if (db != NULL)
+        sqlite3_exec(db, "BEGIN;", NULL, NULL, NULL);
+
+    for (int s = 0; s < MAX_SENSORS && rc == 0 && !out.failed; s++)
+    {
+        if (!selected[s])
+            continue;
+        out.sensor = s;
+        if (columnar)
+            rc = columnar_scan(COLUMNAR_DIR, s, (time_t)from, (time_t)to, export_point, &out) < 0 ? -1 : 0;
+        else
+            rc = export_sqlite_sensor(db, &out, has_archive, (time_t)from, (time_t)to);
+        // Chunks hold a single sensor
+        if (binary)
+            out_flush(&out);
+    }
+
+    if (rc != 0)
+        fprintf(stderr, "Export failed reading sensor %d: %s\n", out.sensor, db ? sqlite3_errmsg(db) : "corrupt series");
+
+    out_flush(&out);
+    if (binary && rc == 0)
+    {
+        export_chunk_t last = {0, 0};
+        out_write(&out, &last, sizeof(last));
+    }
+
+    if (db != NULL)
+    {
+        sqlite3_exec(db, "COMMIT;", NULL, NULL, NULL);
+        sqlite3_close(db);
+    }
+    if (out.fd != STDOUT_FILENO && close(out.fd) != 0)
+    {
+        perror("Failed to close export file");
+        out.failed = 1;
+    }
+
+    double secs = (clock_mono_ns() - start_ns) / 1e9;
+    fprintf(stderr, "Exported %lld readings in %.3f s (%.0f readings/s)\n", out.rows, secs, secs > 0 ? out.rows / secs : 0.0);
+    return rc == 0 && !out.failed ? EXIT_SUCCESS : EXIT_FAILURE;
+}